@@ -0,0 +1,958 @@
+/**
+ * nmrpflash - Netgear Unbrick Utility
+ * Copyright (C) 2016 Joseph Lehner <joseph.c.lehner@gmail.com>
+ *
+ * nmrpflash is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * nmrpflash is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with nmrpflash.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+// runs nmrp_do() against an emulated bootloader, which sits on the other
+// end of a tap interface, and reports how long it took.
+
+#include <stdio.h>
+#include "nmrpd.h"
+
+#ifdef NMRPFLASH_LINUX
+#include <sys/ioctl.h>
+#include <linux/if_tun.h>
+#include <net/if.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+
+#define ETH_P_NMRP 0x0912
+#define ETH_P_IP 0x0800
+#define ETH_P_ARP 0x0806
+
+#define NMRP_C_ADVERTISE 1
+#define NMRP_C_CONF_REQ 2
+#define NMRP_C_CONF_ACK 3
+#define NMRP_C_CLOSE_REQ 4
+#define NMRP_C_CLOSE_ACK 5
+#define NMRP_C_KEEP_ALIVE_REQ 6
+#define NMRP_C_TFTP_UL_REQ 16
+#define NMRP_O_DEV_IP 0x0002
+#define NMRP_HDR_LEN 6
+
+#define TFTP_WRQ 2
+#define TFTP_DATA 3
+#define TFTP_ACK 4
+#define TFTP_ERR 5
+#define TFTP_OACK 6
+// option negotiation refused (RFC 2347)
+#define TFTP_ERR_OPTION 8
+
+#define BENCH_FRAME_LEN 1600
+#define BENCH_QUEUE_LEN 512
+// how long the device waits after the upload, before sending anything
+#define BENCH_SETTLE_MS 10
+// interval at which an unanswered CLOSE_REQ is resent
+#define BENCH_CLOSE_RESEND_MS 500
+
+enum oack_mode
+{
+	OACK_FULL,
+	OACK_BLKSIZE,
+	OACK_NONE,
+	// answer a WRQ with any option but blksize with ERR 8
+	OACK_REFUSE
+};
+
+struct bench_opts
+{
+	const char *intf;
+	size_t size;
+	unsigned runs;
+	// [us]
+	unsigned rtt;
+	unsigned ack_delay;
+	// probability of losing a packet, in each direction
+	double loss;
+	enum oack_mode oack;
+	unsigned blksize;
+	unsigned windowsize;
+	// value to accept for the rollover option, or -1 to ignore it
+	int rollover;
+	// frames above this size are dropped, if not 0
+	unsigned max_frame;
+	unsigned ka_count;
+	unsigned ka_interval;
+	unsigned seed;
+	// upload using nmrpflash's userspace UDP/IP (-u)
+	bool raw_tftp;
+};
+
+struct frame
+{
+	long long due;
+	size_t len;
+	bool used;
+	uint8_t buf[BENCH_FRAME_LEN];
+};
+
+enum dev_state
+{
+	DEV_IDLE,
+	DEV_CONF,
+	DEV_XFER,
+	DEV_DONE,
+	DEV_CLOSE,
+	DEV_FINISHED
+};
+
+// the emulated bootloader
+struct device
+{
+	const struct bench_opts *opts;
+	int fd;
+	enum dev_state state;
+	uint8_t mac[6];
+	uint8_t host_mac[6];
+	// network byte order
+	uint32_t ip;
+	uint32_t host_ip;
+	uint16_t port;
+	uint16_t host_port;
+	uint16_t ip_id;
+	unsigned blksize;
+	unsigned windowsize;
+	// block number that follows 65535
+	uint16_t rollover;
+	// last block received in order
+	uint16_t block;
+	// blocks received since the last ACK
+	unsigned inwin;
+	// sent an ACK for an out-of-order block; inwin then counts those
+	// received since.
+	bool nacked;
+	size_t bytes;
+	uint32_t hash;
+	unsigned kas;
+	// time at which the next KEEP_ALIVE_REQ or CLOSE_REQ is due [us]
+	long long next;
+	uint32_t rng;
+	struct frame queue[BENCH_QUEUE_LEN];
+};
+
+struct session
+{
+	struct nmrpd_args args;
+	xthread_t thread;
+	// set by the session thread, under lock
+	xmutex_t lock;
+	bool finished;
+	int status;
+};
+
+static bool session_finished(struct session *s)
+{
+	bool finished;
+
+	xmutex_lock(&s->lock);
+	finished = s->finished;
+	xmutex_unlock(&s->lock);
+	return finished;
+}
+
+static void sigh(int sig)
+{
+	g_interrupted = 1;
+}
+
+static inline uint16_t get16(const uint8_t *p)
+{
+	return (p[0] << 8) | p[1];
+}
+
+static inline void put16(uint8_t *p, uint16_t val)
+{
+	p[0] = val >> 8;
+	p[1] = val & 0xff;
+}
+
+static uint32_t fnv1a(uint32_t hash, const uint8_t *buf, size_t len)
+{
+	while (len--) {
+		hash = (hash ^ *buf++) * 16777619;
+	}
+
+	return hash;
+}
+
+static uint32_t xorshift(uint32_t *state)
+{
+	uint32_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return *state = x;
+}
+
+static bool dev_lose(struct device *d)
+{
+	return d->opts->loss && (xorshift(&d->rng) / 4294967296.0) < d->opts->loss;
+}
+
+static void dev_write(struct device *d, const uint8_t *buf, size_t len)
+{
+	if (write(d->fd, buf, len) < 0 && errno != EIO) {
+		xperror("write");
+	}
+}
+
+// sends all frames that are due, and returns the time until the next
+// one is [us], or -1 if the queue is empty.
+static long long dev_flush(struct device *d)
+{
+	struct frame *f;
+	long long now;
+	int i;
+
+	while (true) {
+		now = micros();
+		f = NULL;
+
+		for (i = 0; i < BENCH_QUEUE_LEN; ++i) {
+			if (d->queue[i].used && (!f || d->queue[i].due < f->due)) {
+				f = &d->queue[i];
+			}
+		}
+
+		if (!f) {
+			return -1;
+		} else if (f->due > now) {
+			return f->due - now;
+		}
+
+		dev_write(d, f->buf, f->len);
+		f->used = false;
+	}
+}
+
+static void dev_send(struct device *d, uint8_t *buf, size_t len, unsigned delay)
+{
+	int i;
+
+	if (dev_lose(d)) {
+		return;
+	}
+
+	// the whole round-trip time is applied on the way back
+	delay += d->opts->rtt;
+
+	if (delay) {
+		for (i = 0; i < BENCH_QUEUE_LEN; ++i) {
+			if (!d->queue[i].used) {
+				d->queue[i].used = true;
+				d->queue[i].due = micros() + delay;
+				d->queue[i].len = len;
+				memcpy(d->queue[i].buf, buf, len);
+				return;
+			}
+		}
+	}
+
+	dev_write(d, buf, len);
+}
+
+static uint8_t *dev_mkether(struct device *d, uint8_t *buf, uint16_t type)
+{
+	memcpy(buf, d->host_mac, 6);
+	memcpy(buf + 6, d->mac, 6);
+	put16(buf + 12, type);
+	return buf + 14;
+}
+
+static void dev_send_nmrp(struct device *d, uint8_t code)
+{
+	uint8_t buf[64];
+	uint8_t *msg = dev_mkether(d, buf, ETH_P_NMRP);
+
+	memset(msg, 0, NMRP_HDR_LEN);
+	msg[2] = code;
+	put16(msg + 4, NMRP_HDR_LEN);
+
+	dev_send(d, buf, 14 + NMRP_HDR_LEN, 0);
+}
+
+static void dev_send_udp(struct device *d, const void *payload, size_t len, unsigned delay)
+{
+	uint8_t buf[BENCH_FRAME_LEN];
+	uint8_t *ip = dev_mkether(d, buf, ETH_P_IP);
+	uint8_t *udp = ip + 20;
+	uint16_t sum;
+
+	memset(ip, 0, 28);
+	ip[0] = 0x45;
+	put16(ip + 2, 28 + len);
+	put16(ip + 4, d->ip_id++);
+	put16(ip + 6, 0x4000);
+	ip[8] = 64;
+	ip[9] = 17;
+	memcpy(ip + 12, &d->ip, 4);
+	memcpy(ip + 16, &d->host_ip, 4);
+	sum = ip_checksum(ip, 20);
+	memcpy(ip + 10, &sum, 2);
+
+	put16(udp, d->port);
+	put16(udp + 2, d->host_port);
+	put16(udp + 4, 8 + len);
+	memcpy(udp + 8, payload, len);
+
+	// as with the NMRP socket (-u), the checksum is verified
+	sum = ip_sum_fold(ip_sum(ip_sum(0, ip + 12, 8) + 17 + 8 + len, udp, 8 + len));
+	memcpy(udp + 6, sum ? &sum : &(uint16_t){ 0xffff }, 2);
+
+	dev_send(d, buf, 14 + 28 + len, delay);
+}
+
+static void dev_send_ack(struct device *d, uint16_t block)
+{
+	uint8_t pkt[4];
+	put16(pkt, TFTP_ACK);
+	put16(pkt + 2, block);
+	dev_send_udp(d, pkt, sizeof(pkt), d->opts->ack_delay);
+}
+
+static void dev_handle_nmrp(struct device *d, const uint8_t *msg, size_t len)
+{
+	const uint8_t *opt;
+	size_t rem, olen;
+
+	if (len < NMRP_HDR_LEN || get16(msg + 4) > len) {
+		return;
+	}
+
+	len = get16(msg + 4);
+
+	switch (msg[2]) {
+		case NMRP_C_ADVERTISE:
+			if (d->state == DEV_IDLE) {
+				d->state = DEV_CONF;
+			}
+
+			if (d->state == DEV_CONF) {
+				dev_send_nmrp(d, NMRP_C_CONF_REQ);
+			}
+			break;
+		case NMRP_C_CONF_ACK:
+			if (d->state == DEV_XFER && !d->port) {
+				// our TFTP_UL_REQ got lost
+				dev_send_nmrp(d, NMRP_C_TFTP_UL_REQ);
+				break;
+			} else if (d->state != DEV_CONF) {
+				break;
+			}
+
+			opt = msg + NMRP_HDR_LEN;
+			rem = len - NMRP_HDR_LEN;
+
+			while (rem >= 4 && (olen = get16(opt + 2)) >= 4 && olen <= rem) {
+				if (get16(opt) == NMRP_O_DEV_IP && olen >= 12) {
+					memcpy(&d->ip, opt + 4, 4);
+				}
+
+				opt += olen;
+				rem -= olen;
+			}
+
+			d->state = DEV_XFER;
+			d->block = 0;
+			d->bytes = 0;
+			d->hash = 2166136261u;
+			d->port = 0;
+			d->inwin = 0;
+			d->nacked = false;
+			dev_send_nmrp(d, NMRP_C_TFTP_UL_REQ);
+			break;
+		case NMRP_C_CLOSE_ACK:
+			if (d->state == DEV_CLOSE) {
+				d->state = DEV_FINISHED;
+			}
+			break;
+	}
+}
+
+static void dev_handle_wrq(struct device *d, const uint8_t *pkt, size_t len)
+{
+	const char *p = (const char*)pkt + 2, *end = (const char*)pkt + len;
+	const char *name, *val;
+	char oack[128];
+	size_t olen;
+	unsigned n;
+
+	if (d->state != DEV_XFER || d->block) {
+		return;
+	}
+
+	if (!d->port) {
+		d->port = 49152 + (xorshift(&d->rng) % 16384);
+	}
+
+	d->blksize = 512;
+	d->windowsize = 1;
+	d->rollover = 0;
+	put16((uint8_t*)oack, TFTP_OACK);
+	olen = 2;
+
+	// skip filename and mode
+	for (n = 0; n < 2 && p < end; ++n) {
+		p += strnlen(p, end - p) + 1;
+	}
+
+	while (p < end && d->opts->oack != OACK_NONE) {
+		name = p;
+		p += strnlen(p, end - p) + 1;
+		if (p >= end) {
+			break;
+		}
+
+		val = p;
+		p += strnlen(p, end - p) + 1;
+		if (p > end) {
+			break;
+		}
+
+		if (d->opts->oack == OACK_REFUSE && strcasecmp(name, "blksize")) {
+			put16((uint8_t*)oack, TFTP_ERR);
+			put16((uint8_t*)oack + 2, TFTP_ERR_OPTION);
+			olen = 4 + snprintf(oack + 4, sizeof(oack) - 4, "Unknown option %s", name) + 1;
+			dev_send_udp(d, oack, olen, d->opts->ack_delay);
+			return;
+		} else if (!strcasecmp(name, "blksize")) {
+			d->blksize = MIN(atoi(val), d->opts->blksize);
+			olen += snprintf(oack + olen, sizeof(oack) - olen, "blksize%c%u", 0, d->blksize) + 1;
+		} else if (!strcasecmp(name, "windowsize") && d->opts->oack == OACK_FULL) {
+			d->windowsize = MAX(1, MIN(atoi(val), d->opts->windowsize));
+			olen += snprintf(oack + olen, sizeof(oack) - olen, "windowsize%c%u", 0, d->windowsize) + 1;
+		} else if (!strcasecmp(name, "rollover") && d->opts->rollover >= 0
+				&& d->opts->oack == OACK_FULL) {
+			d->rollover = d->opts->rollover;
+			olen += snprintf(oack + olen, sizeof(oack) - olen, "rollover%c%u", 0, d->rollover) + 1;
+		}
+	}
+
+	if (olen > 2) {
+		dev_send_udp(d, oack, olen, d->opts->ack_delay);
+	} else {
+		d->blksize = 512;
+		d->windowsize = 1;
+		d->rollover = 0;
+		dev_send_ack(d, 0);
+	}
+}
+
+static void dev_handle_data(struct device *d, const uint8_t *pkt, size_t len)
+{
+	uint16_t block = get16(pkt + 2);
+	uint16_t next = d->block + 1;
+
+	len -= 4;
+
+	if (!next) {
+		next = d->rollover;
+	}
+
+	if (d->state != DEV_XFER) {
+		// our final ACK got lost
+		if (d->state >= DEV_DONE && block == d->block) {
+			dev_send_ack(d, block);
+		}
+		return;
+	}
+
+	if (block != next) {
+		// ACK the last block we got, but don't flood the sender if it's
+		// still sending the rest of the window.
+		if (!d->nacked || ++d->inwin >= d->windowsize) {
+			dev_send_ack(d, d->block);
+			d->nacked = true;
+			d->inwin = 0;
+		}
+		return;
+	}
+
+	d->block = block;
+	d->bytes += len;
+	d->hash = fnv1a(d->hash, pkt + 4, len);
+
+	if (d->nacked) {
+		d->nacked = false;
+		d->inwin = 0;
+	}
+
+	if (len < d->blksize) {
+		dev_send_ack(d, block);
+		d->state = DEV_DONE;
+		d->kas = 0;
+		// make sure the ACK arrives first
+		d->next = micros() + d->opts->ack_delay + BENCH_SETTLE_MS * 1000;
+	} else if (++d->inwin >= d->windowsize) {
+		dev_send_ack(d, block);
+		d->inwin = 0;
+	}
+}
+
+static void dev_handle_ip(struct device *d, const uint8_t *ip, size_t len)
+{
+	const uint8_t *udp;
+	size_t hlen;
+
+	if (len < 20 || (ip[0] >> 4) != 4 || ip[9] != 17) {
+		return;
+	}
+
+	hlen = (ip[0] & 0xf) * 4;
+	if (hlen < 20 || get16(ip + 2) > len || get16(ip + 2) < hlen + 8
+			|| memcmp(ip + 16, &d->ip, 4)) {
+		return;
+	}
+
+	len = get16(ip + 2) - hlen;
+	udp = ip + hlen;
+
+	if (get16(udp + 4) > len || get16(udp + 4) < 12) {
+		return;
+	}
+
+	len = get16(udp + 4) - 8;
+	memcpy(&d->host_ip, ip + 12, 4);
+
+	if (get16(udp + 2) == NMRP_DEFAULT_TFTP_PORT && get16(udp + 8) == TFTP_WRQ) {
+		d->host_port = get16(udp);
+		dev_handle_wrq(d, udp + 8, len);
+	} else if (d->port && get16(udp + 2) == d->port && get16(udp + 8) == TFTP_DATA) {
+		dev_handle_data(d, udp + 8, len);
+	}
+}
+
+static void dev_handle_arp(struct device *d, const uint8_t *arp, size_t len)
+{
+	uint8_t buf[64];
+	uint8_t *p;
+
+	// only answer requests for our address
+	if (len < 28 || get16(arp + 6) != 1 || memcmp(arp + 24, &d->ip, 4)) {
+		return;
+	}
+
+	p = dev_mkether(d, buf, ETH_P_ARP);
+	memcpy(p, arp, 6);
+	put16(p + 6, 2);
+	memcpy(p + 8, d->mac, 6);
+	memcpy(p + 14, &d->ip, 4);
+	memcpy(p + 18, arp + 8, 10);
+
+	dev_send(d, buf, 14 + 28, 0);
+}
+
+static void dev_handle(struct device *d, const uint8_t *buf, size_t len)
+{
+	if (len < 14 || !memcmp(buf + 6, d->mac, 6) || dev_lose(d)) {
+		return;
+	} else if (d->opts->max_frame && len > d->opts->max_frame) {
+		return;
+	}
+
+	memcpy(d->host_mac, buf + 6, 6);
+
+	switch (get16(buf + 12)) {
+		case ETH_P_NMRP:
+			dev_handle_nmrp(d, buf + 14, len - 14);
+			break;
+		case ETH_P_IP:
+			dev_handle_ip(d, buf + 14, len - 14);
+			break;
+		case ETH_P_ARP:
+			dev_handle_arp(d, buf + 14, len - 14);
+			break;
+	}
+}
+
+// sends keep-alive requests after the upload, followed by CLOSE_REQ
+// returns the time until the next one is due [us], or -1.
+static long long dev_timers(struct device *d)
+{
+	long long now = micros();
+
+	if (d->state != DEV_DONE && d->state != DEV_CLOSE) {
+		return -1;
+	} else if (d->next > now) {
+		return d->next - now;
+	}
+
+	if (d->state == DEV_DONE && d->kas < d->opts->ka_count) {
+		dev_send_nmrp(d, NMRP_C_KEEP_ALIVE_REQ);
+		++d->kas;
+		d->next = now + d->opts->ka_interval * 1000LL;
+	} else {
+		dev_send_nmrp(d, NMRP_C_CLOSE_REQ);
+		d->state = DEV_CLOSE;
+		d->next = now + BENCH_CLOSE_RESEND_MS * 1000;
+	}
+
+	return d->next - now;
+}
+
+static int tap_open(const char *name)
+{
+	struct ifreq ifr;
+	int fd, sock;
+
+	fd = open("/dev/net/tun", O_RDWR | O_NONBLOCK);
+	if (fd < 0) {
+		xperror("open(/dev/net/tun)");
+		return -1;
+	}
+
+	memset(&ifr, 0, sizeof(ifr));
+	ifr.ifr_flags = IFF_TAP | IFF_NO_PI;
+	strncpy(ifr.ifr_name, name, IFNAMSIZ - 1);
+
+	if (ioctl(fd, TUNSETIFF, &ifr) < 0) {
+		xperror("ioctl(TUNSETIFF)");
+		goto err;
+	}
+
+	sock = socket(AF_INET, SOCK_DGRAM, 0);
+	if (sock < 0) {
+		xperror("socket");
+		goto err;
+	}
+
+	if (ioctl(sock, SIOCGIFFLAGS, &ifr) < 0) {
+		xperror("ioctl(SIOCGIFFLAGS)");
+	} else {
+		ifr.ifr_flags |= IFF_UP;
+		if (ioctl(sock, SIOCSIFFLAGS, &ifr) < 0) {
+			xperror("ioctl(SIOCSIFFLAGS)");
+		}
+	}
+
+	close(sock);
+	return fd;
+
+err:
+	close(fd);
+	return -1;
+}
+
+static char *image_create(size_t size, uint32_t seed, uint32_t *hash)
+{
+	static char path[] = "/tmp/nmrpflash-bench-XXXXXX";
+	uint8_t buf[4096];
+	size_t i, len;
+	int fd;
+
+	fd = mkstemp(path);
+	if (fd < 0) {
+		xperror("mkstemp");
+		return NULL;
+	}
+
+	*hash = 2166136261u;
+
+	while (size) {
+		len = MIN(size, sizeof(buf));
+		for (i = 0; i < len; ++i) {
+			buf[i] = xorshift(&seed);
+		}
+
+		if (write(fd, buf, len) != len) {
+			xperror("write");
+			close(fd);
+			unlink(path);
+			return NULL;
+		}
+
+		*hash = fnv1a(*hash, buf, len);
+		size -= len;
+	}
+
+	close(fd);
+	return path;
+}
+
+static void *session_run(void *arg)
+{
+	struct session *s = arg;
+	int status = nmrp_do(&s->args);
+
+	xmutex_lock(&s->lock);
+	s->status = status;
+	s->finished = true;
+	xmutex_unlock(&s->lock);
+	return NULL;
+}
+
+// runs one session, and returns its total duration [us], or -1
+static long long bench_run(struct device *d, const char *file, uint32_t hash,
+		struct nmrp_stats *stats)
+{
+	struct session s;
+	struct pollfd pfd;
+	uint8_t buf[BENCH_FRAME_LEN];
+	long long beg, wait, next;
+	ssize_t len;
+
+	memset(&s, 0, sizeof(s));
+	s.lock = (xmutex_t)XMUTEX_INITIALIZER;
+	s.args.rx_timeout = NMRP_DEFAULT_RX_TIMEOUT_MS;
+	s.args.ul_timeout = NMRP_DEFAULT_UL_TIMEOUT_S * 1000;
+	s.args.file_local = file;
+	s.args.ipmask = NMRP_DEFAULT_SUBNET;
+	s.args.intf = d->opts->intf;
+	s.args.mac = "ff:ff:ff:ff:ff:ff";
+	s.args.op = NMRP_UPLOAD_FW;
+	s.args.port = NMRP_DEFAULT_TFTP_PORT;
+	s.args.raw_tftp = d->opts->raw_tftp;
+	// the progress display would only get in the way of our output
+	s.args.quiet = true;
+
+	d->state = DEV_IDLE;
+	d->port = 0;
+	memset(d->queue, 0, sizeof(d->queue));
+
+	beg = micros();
+
+	if (xthread_create(&s.thread, &session_run, &s) != 0) {
+		return -1;
+	}
+
+	pfd.fd = d->fd;
+	pfd.events = POLLIN;
+
+	while (!session_finished(&s)) {
+		wait = 10000;
+
+		if ((next = dev_flush(d)) >= 0) {
+			wait = MIN(wait, next);
+		}
+
+		if ((next = dev_timers(d)) >= 0) {
+			wait = MIN(wait, next);
+		}
+
+		if (poll(&pfd, 1, (wait + 999) / 1000) < 0 && errno != EINTR) {
+			xperror("poll");
+			g_interrupted = 1;
+		}
+
+		while ((len = read(d->fd, buf, sizeof(buf))) > 0) {
+			dev_handle(d, buf, len);
+		}
+	}
+
+	xthread_join(s.thread);
+	*stats = s.args.stats;
+
+	if (s.status != 0) {
+		fprintf(stderr, "Error: session failed (device received %zu of %zu bytes).\n",
+				d->bytes, d->opts->size);
+		return -1;
+	} else if (d->bytes != d->opts->size || d->hash != hash) {
+		fprintf(stderr, "Error: received %zu of %zu bytes, hash %s.\n", d->bytes,
+				d->opts->size, d->hash == hash ? "ok" : "mismatch");
+		return -1;
+	}
+
+	return micros() - beg;
+}
+
+static int usage(FILE *fp)
+{
+	fprintf(fp,
+			"Usage: bench [OPTIONS...]\n"
+			"\n"
+			"Runs nmrpflash against an emulated bootloader on a tap interface.\n"
+			"\n"
+			"Options:\n"
+			" -i <interface>  Name of the tap interface [nmrpbench0]\n"
+			" -s <size>       Image size (KiB) [4096]\n"
+			" -n <runs>       Number of runs [1]\n"
+			" -r <rtt>        Round-trip time (ms) [0]\n"
+			" -l <loss>       Packet loss (%%) in each direction [0]\n"
+			" -d <delay>      Additional delay for TFTP ACKs (ms) [0]\n"
+			" -o <mode>       Option negotiation: full, blksize, none, refuse (ERR 8 for\n"
+			"                 anything but blksize) [full]\n"
+			" -B <blksize>    Maximum accepted blksize [1468]\n"
+			" -W <window>     Maximum accepted windowsize [64]\n"
+			" -R <rollover>   Accept rollover option with this value (0, 1)\n"
+			" -M <size>       Drop frames larger than <size> bytes [no limit]\n"
+			" -k <count>      Keep-alive requests after upload [0]\n"
+			" -K <interval>   Keep-alive interval (ms) [1000]\n"
+			" -S <seed>       Random seed [1]\n"
+			" -u              Use nmrpflash -u\n"
+			" -v              Be verbose\n"
+			" -h              Show this screen\n"
+		   );
+
+	return fp == stderr ? 1 : 0;
+}
+
+int main(int argc, char **argv)
+{
+	static struct device dev;
+	struct bench_opts opts = {
+		.intf = "nmrpbench0",
+		.size = 4096 * 1024,
+		.runs = 1,
+		.oack = OACK_FULL,
+		.blksize = 1468,
+		.windowsize = 64,
+		.rollover = -1,
+		.ka_interval = 1000,
+		.seed = 1,
+	};
+	struct nmrp_stats stats;
+	long long t, total, best, worst;
+	unsigned i, ok;
+	uint32_t hash;
+	char *file;
+	int c;
+
+	while ((c = getopt(argc, argv, "i:s:n:r:l:d:o:B:W:R:M:k:K:S:uvh")) != -1) {
+		switch (c) {
+			case 'i':
+				opts.intf = optarg;
+				break;
+			case 's':
+				opts.size = strtoul(optarg, NULL, 10) * 1024;
+				break;
+			case 'n':
+				opts.runs = MAX(1, atoi(optarg));
+				break;
+			case 'r':
+				opts.rtt = atof(optarg) * 1000;
+				break;
+			case 'l':
+				opts.loss = atof(optarg) / 100;
+				break;
+			case 'd':
+				opts.ack_delay = atof(optarg) * 1000;
+				break;
+			case 'o':
+				if (!strcmp(optarg, "full")) {
+					opts.oack = OACK_FULL;
+				} else if (!strcmp(optarg, "blksize")) {
+					opts.oack = OACK_BLKSIZE;
+				} else if (!strcmp(optarg, "none")) {
+					opts.oack = OACK_NONE;
+				} else if (!strcmp(optarg, "refuse")) {
+					opts.oack = OACK_REFUSE;
+				} else {
+					return usage(stderr);
+				}
+				break;
+			case 'B':
+				opts.blksize = MAX(8, atoi(optarg));
+				break;
+			case 'W':
+				opts.windowsize = MAX(1, atoi(optarg));
+				break;
+			case 'R':
+				opts.rollover = atoi(optarg);
+				if (opts.rollover != 0 && opts.rollover != 1) {
+					return usage(stderr);
+				}
+				break;
+			case 'M':
+				opts.max_frame = atoi(optarg);
+				break;
+			case 'k':
+				opts.ka_count = atoi(optarg);
+				break;
+			case 'K':
+				opts.ka_interval = atoi(optarg);
+				break;
+			case 'S':
+				opts.seed = atoi(optarg);
+				break;
+			case 'u':
+				opts.raw_tftp = true;
+				break;
+			case 'v':
+				++verbosity;
+				break;
+			case 'h':
+				return usage(stdout);
+			default:
+				return usage(stderr);
+		}
+	}
+
+	if (argc != optind) {
+		return usage(stderr);
+	}
+
+	dev.opts = &opts;
+	dev.rng = opts.seed ? opts.seed : 1;
+	memcpy(dev.mac, "\x02\x00\x4e\x4d\x52\x50", 6);
+
+	if ((dev.fd = tap_open(opts.intf)) < 0) {
+		return 1;
+	}
+
+	if (!(file = image_create(opts.size, dev.rng, &hash))) {
+		close(dev.fd);
+		return 1;
+	}
+
+	signal(SIGINT, sigh);
+
+	total = ok = 0;
+	best = worst = -1;
+
+	for (i = 0; i < opts.runs && !g_interrupted; ++i) {
+		t = bench_run(&dev, file, hash, &stats);
+		if (t < 0) {
+			continue;
+		}
+
+		printf("run %u: %.1f ms total, CONF_REQ after %.1f ms, upload %.1f ms "
+				"(%.2f MB/s, %lu resends, %lu timeouts)\n", i + 1, t / 1000.0,
+				stats.phases[NMRP_PHASE_ADVERTISE] / 1000.0,
+				stats.tftp.duration / 1000.0,
+				stats.tftp.duration ? (double)stats.tftp.bytes / stats.tftp.duration : 0,
+				stats.tftp.resends, stats.tftp.timeouts);
+
+		total += t;
+		best = (best < 0) ? t : MIN(best, t);
+		worst = MAX(worst, t);
+		++ok;
+	}
+
+	if (ok > 1) {
+		printf("\n%u/%u runs ok: min %.1f ms, avg %.1f ms, max %.1f ms\n", ok,
+				opts.runs, best / 1000.0, total / 1000.0 / ok, worst / 1000.0);
+	}
+
+	unlink(file);
+	close(dev.fd);
+
+	return ok == opts.runs ? 0 : 1;
+}
+#else
+int main(int argc, char **argv)
+{
+	fprintf(stderr, "Error: bench requires Linux.\n");
+	return 1;
+}
+#endif
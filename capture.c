@@ -0,0 +1,437 @@
+/**
+ * nmrpflash - Netgear Unbrick Utility
+ * Copyright (C) 2016 Joseph Lehner <joseph.c.lehner@gmail.com>
+ *
+ * nmrpflash is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * nmrpflash is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with nmrpflash.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include "nmrpd.h"
+
+// packets are collected in memory, and written to disk by a separate
+// thread, so that a slow disk doesn't slow down the upload. the writer
+// wakes up once the buffer is half full, or after CAPTURE_FLUSH_MS.
+#define CAPTURE_BUF_SIZE (1 << 20)
+#define CAPTURE_FLUSH_MS 100
+
+#define PCAPNG_SHB 0x0a0d0d0a
+#define PCAPNG_IDB 0x00000001
+#define PCAPNG_EPB 0x00000006
+#define PCAPNG_BYTE_ORDER_MAGIC 0x1a2b3c4d
+
+#define PCAPNG_OPT_END 0
+#define PCAPNG_OPT_SHB_USERAPPL 4
+#define PCAPNG_OPT_IF_NAME 2
+#define PCAPNG_OPT_IF_DESCRIPTION 3
+#define PCAPNG_OPT_IF_TSRESOL 9
+#define PCAPNG_OPT_EPB_FLAGS 2
+
+#define PCAPNG_EPB_INBOUND 1
+#define PCAPNG_EPB_OUTBOUND 2
+
+#define PAD4(n) (((n) + 3) & ~3)
+#define OPT_LEN(n) (4 + PAD4(n))
+
+struct capture
+{
+	FILE *fp;
+	char *path;
+	xthread_t thread;
+	xmutex_t lock;
+	// signaled when there's something to write, or when closing
+	xcond_t ready;
+	// signaled when the writer has emptied the buffer
+	xcond_t space;
+	// packets are appended to buf, while the writer writes wbuf
+	uint8_t *buf;
+	uint8_t *wbuf;
+	size_t len;
+	unsigned intfs;
+	bool closing;
+	bool error;
+#ifdef NMRPFLASH_WINDOWS
+	uint64_t start;
+	LONGLONG counter;
+#endif
+};
+
+// nanoseconds since the epoch
+static uint64_t capture_time(struct capture *cap)
+{
+#ifndef NMRPFLASH_WINDOWS
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#else
+	// the system time is too coarse, so use the performance counter,
+	// relative to the system time at which the capture was opened.
+	LARGE_INTEGER now, freq;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&now);
+	now.QuadPart -= cap->counter;
+	return cap->start + (now.QuadPart / freq.QuadPart) * 1000000000ULL
+		+ ((now.QuadPart % freq.QuadPart) * 1000000000ULL) / freq.QuadPart;
+#endif
+}
+
+static uint8_t *put(uint8_t *p, const void *data, size_t len)
+{
+	memcpy(p, data, len);
+	return p + len;
+}
+
+static uint8_t *put_u16(uint8_t *p, uint16_t val)
+{
+	return put(p, &val, sizeof(val));
+}
+
+static uint8_t *put_u32(uint8_t *p, uint32_t val)
+{
+	return put(p, &val, sizeof(val));
+}
+
+static uint8_t *put_opt(uint8_t *p, uint16_t code, const void *val, size_t len)
+{
+	p = put_u16(p, code);
+	p = put_u16(p, len);
+	p = put(p, val, len);
+	memset(p, 0, PAD4(len) - len);
+	return p + PAD4(len) - len;
+}
+
+static uint8_t *put_opt_end(uint8_t *p)
+{
+	return put_u32(p, PCAPNG_OPT_END);
+}
+
+// locks the capture, and returns a pointer to `len` bytes of buffer
+// space, or NULL (and unlocks) if the capture has failed.
+static uint8_t *capture_begin(struct capture *cap, size_t len)
+{
+	xmutex_lock(&cap->lock);
+
+	while (!cap->error && cap->len + len > CAPTURE_BUF_SIZE) {
+		xcond_broadcast(&cap->ready);
+		xcond_wait(&cap->space, &cap->lock);
+	}
+
+	if (cap->error) {
+		xmutex_unlock(&cap->lock);
+		return NULL;
+	}
+
+	return cap->buf + cap->len;
+}
+
+static void capture_end(struct capture *cap, size_t len)
+{
+	cap->len += len;
+	if (cap->len >= CAPTURE_BUF_SIZE / 2) {
+		xcond_broadcast(&cap->ready);
+	}
+	xmutex_unlock(&cap->lock);
+}
+
+static void *capture_thread(void *arg)
+{
+	struct capture *cap = arg;
+	uint8_t *buf;
+	size_t len;
+	bool ok;
+
+	xmutex_lock(&cap->lock);
+
+	while (true) {
+		if (!cap->len && !cap->closing) {
+			xcond_timedwait(&cap->ready, &cap->lock, CAPTURE_FLUSH_MS);
+		}
+
+		if (!cap->len) {
+			if (cap->closing) {
+				break;
+			}
+			continue;
+		}
+
+		buf = cap->buf;
+		len = cap->len;
+		cap->buf = cap->wbuf;
+		cap->wbuf = buf;
+		cap->len = 0;
+		xcond_broadcast(&cap->space);
+
+		xmutex_unlock(&cap->lock);
+		ok = fwrite(buf, 1, len, cap->fp) == len && !fflush(cap->fp);
+		if (!ok) {
+			fprintf(stderr, "Error writing to '%s': %s.\n", cap->path, strerror(errno));
+		}
+		xmutex_lock(&cap->lock);
+
+		if (!ok) {
+			// drop everything from now on
+			cap->error = true;
+			cap->len = 0;
+			xcond_broadcast(&cap->space);
+			break;
+		}
+	}
+
+	xmutex_unlock(&cap->lock);
+	return NULL;
+}
+
+static void capture_free(struct capture *cap)
+{
+	if (cap->fp) {
+		fclose(cap->fp);
+	}
+
+	free(cap->buf);
+	free(cap->wbuf);
+	free(cap->path);
+	free(cap);
+}
+
+struct capture *capture_open(const char *path)
+{
+	static const char *appl = "nmrpflash " NMRPFLASH_VERSION;
+	struct capture *cap;
+	uint8_t *p;
+	size_t len;
+
+	cap = calloc(1, sizeof(*cap));
+	if (!cap) {
+		xperror("calloc");
+		return NULL;
+	}
+
+	cap->lock = (xmutex_t)XMUTEX_INITIALIZER;
+	cap->ready = (xcond_t)XCOND_INITIALIZER;
+	cap->space = (xcond_t)XCOND_INITIALIZER;
+
+	cap->buf = malloc(CAPTURE_BUF_SIZE);
+	cap->wbuf = malloc(CAPTURE_BUF_SIZE);
+	cap->path = strdup(path);
+	if (!cap->buf || !cap->wbuf || !cap->path) {
+		xperror("malloc");
+		goto err;
+	}
+
+	cap->fp = fopen(path, "wb");
+	if (!cap->fp) {
+		fprintf(stderr, "Error opening file '%s': %s.\n", path, strerror(errno));
+		goto err;
+	}
+
+#ifdef NMRPFLASH_WINDOWS
+	FILETIME ft;
+	LARGE_INTEGER now;
+	GetSystemTimeAsFileTime(&ft);
+	QueryPerformanceCounter(&now);
+	// 100 ns intervals since 1601-01-01
+	cap->start = ((((uint64_t)ft.dwHighDateTime << 32) | ft.dwLowDateTime)
+			- 116444736000000000ULL) * 100;
+	cap->counter = now.QuadPart;
+#endif
+
+	// section header block
+	len = 28 + OPT_LEN(strlen(appl)) + 4;
+	p = capture_begin(cap, len);
+	p = put_u32(p, PCAPNG_SHB);
+	p = put_u32(p, len);
+	p = put_u32(p, PCAPNG_BYTE_ORDER_MAGIC);
+	p = put_u16(p, 1);
+	p = put_u16(p, 0);
+	// section length is unknown
+	p = put_u32(p, 0xffffffff);
+	p = put_u32(p, 0xffffffff);
+	p = put_opt(p, PCAPNG_OPT_SHB_USERAPPL, appl, strlen(appl));
+	p = put_opt_end(p);
+	p = put_u32(p, len);
+	capture_end(cap, len);
+
+	if (xthread_create(&cap->thread, &capture_thread, cap) != 0) {
+		goto err;
+	}
+
+	return cap;
+
+err:
+	capture_free(cap);
+	return NULL;
+}
+
+unsigned capture_add_intf(struct capture *cap, const char *name,
+		const char *desc, uint16_t linktype)
+{
+	// nanosecond resolution
+	static const uint8_t tsresol = 9;
+	unsigned id;
+	uint8_t *p;
+	size_t len;
+
+	len = 20 + OPT_LEN(strlen(name)) + OPT_LEN(1) + 4;
+	if (desc) {
+		len += OPT_LEN(strlen(desc));
+	}
+
+	p = capture_begin(cap, len);
+	if (!p) {
+		return 0;
+	}
+
+	p = put_u32(p, PCAPNG_IDB);
+	p = put_u32(p, len);
+	p = put_u16(p, linktype);
+	p = put_u16(p, 0);
+	// no snapshot length limit
+	p = put_u32(p, 0);
+	p = put_opt(p, PCAPNG_OPT_IF_NAME, name, strlen(name));
+	if (desc) {
+		p = put_opt(p, PCAPNG_OPT_IF_DESCRIPTION, desc, strlen(desc));
+	}
+	p = put_opt(p, PCAPNG_OPT_IF_TSRESOL, &tsresol, 1);
+	p = put_opt_end(p);
+	p = put_u32(p, len);
+
+	// IDs are assigned in the order the blocks appear in the file
+	id = cap->intfs++;
+	capture_end(cap, len);
+
+	return id;
+}
+
+// locks the capture, and writes the header of an enhanced packet block
+// with `caplen` bytes of packet data, which must be added by the caller,
+// followed by a call to capture_packet_end.
+static uint8_t *capture_packet_begin(struct capture *cap, unsigned intf,
+		size_t caplen, size_t *len)
+{
+	uint64_t ts = capture_time(cap);
+	uint8_t *p;
+
+	*len = 28 + PAD4(caplen) + OPT_LEN(4) + 4 + 4;
+
+	p = capture_begin(cap, *len);
+	if (!p) {
+		return NULL;
+	}
+
+	p = put_u32(p, PCAPNG_EPB);
+	p = put_u32(p, *len);
+	p = put_u32(p, intf);
+	p = put_u32(p, ts >> 32);
+	p = put_u32(p, ts & 0xffffffff);
+	p = put_u32(p, caplen);
+	p = put_u32(p, caplen);
+	return p;
+}
+
+static void capture_packet_end(struct capture *cap, uint8_t *p, size_t caplen,
+		bool out, size_t len)
+{
+	uint32_t flags = out ? PCAPNG_EPB_OUTBOUND : PCAPNG_EPB_INBOUND;
+
+	memset(p, 0, PAD4(caplen) - caplen);
+	p += PAD4(caplen) - caplen;
+	p = put_opt(p, PCAPNG_OPT_EPB_FLAGS, &flags, sizeof(flags));
+	p = put_opt_end(p);
+	p = put_u32(p, len);
+	capture_end(cap, len);
+}
+
+void capture_frame(struct capture *cap, unsigned intf, bool out,
+		const void *buf, size_t len)
+{
+	size_t blen;
+	uint8_t *p;
+
+	p = capture_packet_begin(cap, intf, len, &blen);
+	if (p) {
+		p = put(p, buf, len);
+		capture_packet_end(cap, p, len, out, blen);
+	}
+}
+
+void capture_udp(struct capture *cap, unsigned intf, bool out,
+		const struct sockaddr_in *src, const struct sockaddr_in *dst,
+		const void *hdr, size_t hlen, const void *data, size_t dlen)
+{
+	struct ip_hdr ip;
+	struct udp_hdr udp;
+	size_t caplen, blen;
+	uint8_t *p;
+
+	caplen = sizeof(ip) + sizeof(udp) + hlen + dlen;
+
+	memset(&ip, 0, sizeof(ip));
+	ip.ver_ihl = 0x45;
+	ip.len = htons(caplen);
+	// don't fragment
+	ip.frag = htons(0x4000);
+	ip.ttl = 64;
+	ip.proto = IPPROTO_UDP;
+	ip.src = src->sin_addr.s_addr;
+	ip.dst = dst->sin_addr.s_addr;
+	ip.sum = ip_checksum(&ip, sizeof(ip));
+
+	// a zero UDP checksum means "none"
+	udp.sport = src->sin_port;
+	udp.dport = dst->sin_port;
+	udp.len = htons(sizeof(udp) + hlen + dlen);
+	udp.sum = 0;
+
+	p = capture_packet_begin(cap, intf, caplen, &blen);
+	if (p) {
+		p = put(p, &ip, sizeof(ip));
+		p = put(p, &udp, sizeof(udp));
+		p = put(p, hdr, hlen);
+		if (dlen) {
+			p = put(p, data, dlen);
+		}
+		capture_packet_end(cap, p, caplen, out, blen);
+	}
+}
+
+int capture_close(struct capture *cap)
+{
+	bool error;
+
+	if (!cap) {
+		return 0;
+	}
+
+	xmutex_lock(&cap->lock);
+	cap->closing = true;
+	xcond_broadcast(&cap->ready);
+	xmutex_unlock(&cap->lock);
+
+	xthread_join(cap->thread);
+	error = cap->error;
+
+	if (fclose(cap->fp) != 0 && !error) {
+		fprintf(stderr, "Error writing to '%s': %s.\n", cap->path, strerror(errno));
+		error = true;
+	}
+
+	cap->fp = NULL;
+	capture_free(cap);
+
+	return error ? -1 : 0;
+}
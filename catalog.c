@@ -0,0 +1,394 @@
+/**
+ * nmrpflash - Netgear Unbrick Utility
+ * Copyright (C) 2016 Joseph Lehner <joseph.c.lehner@gmail.com>
+ *
+ * nmrpflash is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * nmrpflash is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with nmrpflash.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <sys/stat.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <dirent.h>
+#include <ctype.h>
+#include "nmrpd.h"
+
+// one line per file: size, mtime, chk_validate() status, checksum, region
+// and board ID ("-" if none), followed by the filename. hidden, so that it's
+// skipped like any other dotfile.
+#define CATALOG_INDEX ".nmrpflash-index"
+#define CATALOG_INDEX_MAGIC "# nmrpflash catalog 1\n"
+
+struct catalog_entry
+{
+	char *name;
+	long long size;
+	long long mtime;
+	int status;
+	uint32_t checksum;
+	char region[3];
+	char board_id[CHK_MAX_BOARD_ID + 1];
+	// NULL if the image is invalid, and not used anyway
+	struct image *image;
+	char *path;
+};
+
+struct catalog
+{
+	struct catalog_entry *entries;
+	size_t count;
+};
+
+static void catalog_entries_free(struct catalog_entry *entries, size_t count)
+{
+	size_t i;
+
+	for (i = 0; i < count; ++i) {
+		image_close(entries[i].image);
+		free(entries[i].name);
+		free(entries[i].path);
+	}
+
+	free(entries);
+}
+
+static bool catalog_append(struct catalog_entry **entries, size_t *count,
+		const struct catalog_entry *e)
+{
+	struct catalog_entry *p = realloc(*entries, (*count + 1) * sizeof(*p));
+	if (!p) {
+		xperror("realloc");
+		return false;
+	}
+
+	p[*count] = *e;
+	*entries = p;
+	++*count;
+	return true;
+}
+
+static char *catalog_path(const char *dir, const char *name)
+{
+	size_t len = strlen(dir) + strlen(name) + 2;
+	char *path = malloc(len);
+
+	if (!path) {
+		xperror("malloc");
+		return NULL;
+	}
+
+	snprintf(path, len, "%s/%s", dir, name);
+	return path;
+}
+
+static size_t catalog_load_index(const char *dir, struct catalog_entry **entries)
+{
+	char line[1024], *name;
+	struct catalog_entry e;
+	size_t count = 0;
+	char *path;
+	FILE *fp;
+	int n;
+
+	*entries = NULL;
+
+	if (!(path = catalog_path(dir, CATALOG_INDEX))) {
+		return 0;
+	}
+
+	fp = fopen(path, "r");
+	free(path);
+
+	if (!fp) {
+		return 0;
+	}
+
+	if (!fgets(line, sizeof(line), fp) || strcmp(line, CATALOG_INDEX_MAGIC)) {
+		fclose(fp);
+		return 0;
+	}
+
+	while (fgets(line, sizeof(line), fp)) {
+		memset(&e, 0, sizeof(e));
+		line[strcspn(line, "\r\n")] = '\0';
+
+		if (sscanf(line, "%lld %lld %d %x %2s %64s %n", &e.size, &e.mtime, &e.status,
+					&e.checksum, e.region, e.board_id, &n) != 6 || !line[n]) {
+			continue;
+		}
+
+		if (!strcmp(e.region, "-")) {
+			e.region[0] = '\0';
+		}
+
+		if (!strcmp(e.board_id, "-")) {
+			e.board_id[0] = '\0';
+		}
+
+		name = strdup(line + n);
+		if (!name) {
+			break;
+		}
+
+		e.name = name;
+		if (!catalog_append(entries, &count, &e)) {
+			free(name);
+			break;
+		}
+	}
+
+	fclose(fp);
+	return count;
+}
+
+static void catalog_save_index(const char *dir, struct catalog *cat)
+{
+	struct catalog_entry *e;
+	char *path;
+	FILE *fp;
+	size_t i;
+
+	if (!(path = catalog_path(dir, CATALOG_INDEX))) {
+		return;
+	}
+
+	fp = fopen(path, "w");
+	if (!fp) {
+		// not fatal; the directory might be read-only
+		if (verbosity > 1) {
+			fprintf(stderr, "Error writing '%s': %s.\n", path, strerror(errno));
+		}
+		free(path);
+		return;
+	}
+
+	fputs(CATALOG_INDEX_MAGIC, fp);
+
+	for (i = 0; i < cat->count; ++i) {
+		e = &cat->entries[i];
+		fprintf(fp, "%lld %lld %d %08x %s %s %s\n", e->size, e->mtime, e->status,
+				e->checksum, *e->region ? e->region : "-",
+				*e->board_id ? e->board_id : "-", e->name);
+	}
+
+	if (fclose(fp) != 0 && verbosity > 1) {
+		fprintf(stderr, "Error writing '%s': %s.\n", path, strerror(errno));
+	}
+
+	free(path);
+}
+
+// validates the image, unless the cached entry is still current
+static bool catalog_index(struct catalog_entry *e, const struct catalog_entry *cached,
+		size_t cached_count, bool *dirty)
+{
+	struct chk_info info;
+	size_t i;
+	char *p;
+
+	for (i = 0; i < cached_count; ++i) {
+		if (cached[i].size == e->size && cached[i].mtime == e->mtime
+				&& !strcmp(cached[i].name, e->name)) {
+			e->status = cached[i].status;
+			e->checksum = cached[i].checksum;
+			memcpy(e->region, cached[i].region, sizeof(e->region));
+			memcpy(e->board_id, cached[i].board_id, sizeof(e->board_id));
+			return e->status >= 0;
+		}
+	}
+
+	*dirty = true;
+
+	e->status = chk_validate(e->image, NULL, &info);
+	if (e->status) {
+		e->checksum = info.checksum;
+		snprintf(e->region, sizeof(e->region), "%s", info.region ? info.region : "");
+		snprintf(e->board_id, sizeof(e->board_id), "%s", info.board_id);
+		// so that it survives the index
+		for (p = e->board_id; *p; ++p) {
+			if (!isgraph((unsigned char)*p)) {
+				*p = '_';
+			}
+		}
+	} else {
+		e->checksum = chk_checksum(e->image->data, e->image->size);
+	}
+
+	return e->status >= 0;
+}
+
+struct catalog *catalog_open(const char *dir, bool no_check)
+{
+	struct catalog_entry *cached, e;
+	size_t cached_count, valid = 0;
+	struct catalog *cat;
+	struct dirent *d;
+	struct stat st;
+	bool dirty;
+	DIR *dp;
+
+	dp = opendir(dir);
+	if (!dp) {
+		fprintf(stderr, "Error opening directory '%s': %s.\n", dir, strerror(errno));
+		return NULL;
+	}
+
+	cat = calloc(1, sizeof(*cat));
+	if (!cat) {
+		xperror("calloc");
+		closedir(dp);
+		return NULL;
+	}
+
+	cached_count = catalog_load_index(dir, &cached);
+	dirty = false;
+
+	while ((d = readdir(dp))) {
+		if (d->d_name[0] == '.') {
+			continue;
+		}
+
+		memset(&e, 0, sizeof(e));
+
+		if (!(e.path = catalog_path(dir, d->d_name))) {
+			goto err;
+		}
+
+		if (stat(e.path, &st) != 0 || !S_ISREG(st.st_mode)) {
+			free(e.path);
+			continue;
+		}
+
+		e.name = strdup(d->d_name);
+		e.size = st.st_size;
+		e.mtime = st.st_mtime;
+		e.image = image_open(e.path, 0);
+
+		if (!e.name || !e.image) {
+			image_close(e.image);
+			free(e.name);
+			free(e.path);
+			goto err;
+		}
+
+		if (catalog_index(&e, cached, cached_count, &dirty) || no_check) {
+			++valid;
+		} else {
+			fprintf(stderr, "Warning: skipping invalid image '%s'.\n", e.name);
+			image_close(e.image);
+			e.image = NULL;
+		}
+
+		if (!catalog_append(&cat->entries, &cat->count, &e)) {
+			image_close(e.image);
+			free(e.name);
+			free(e.path);
+			goto err;
+		}
+	}
+
+	closedir(dp);
+
+	// also drops entries of files that are gone
+	if (dirty || cat->count != cached_count) {
+		catalog_save_index(dir, cat);
+	}
+
+	catalog_entries_free(cached, cached_count);
+
+	if (!valid) {
+		fprintf(stderr, "Error: no usable images in '%s'.\n", dir);
+		catalog_close(cat);
+		return NULL;
+	}
+
+	if (verbosity) {
+		printf("Catalog: %zu image(s) in '%s'.\n", valid, dir);
+	}
+
+	return cat;
+
+err:
+	closedir(dp);
+	catalog_entries_free(cached, cached_count);
+	catalog_close(cat);
+	return NULL;
+}
+
+static bool catalog_stem_eq(const char *name, const char *filename)
+{
+	const char *dot = strrchr(name, '.');
+	size_t len = dot ? (size_t)(dot - name) : strlen(name);
+
+	dot = strrchr(filename, '.');
+	return len == (dot ? (size_t)(dot - filename) : strlen(filename))
+		&& !strncasecmp(name, filename, len);
+}
+
+struct image *catalog_find(struct catalog *cat, const char *filename,
+		const char *region, const char **path)
+{
+	struct catalog_entry *e, *match;
+	size_t i, matches;
+	int pass;
+
+	// by filename, by filename without extension, and by board ID. only
+	// if no filename was requested, the only image (if any) is used: on
+	// a bench with several models, that would flash the wrong one.
+	for (pass = filename ? 0 : 3; pass < (filename ? 3 : 4); ++pass) {
+		match = NULL;
+		matches = 0;
+
+		for (i = 0; i < cat->count; ++i) {
+			e = &cat->entries[i];
+
+			if (!e->image || (region && *e->region && strcasecmp(region, e->region))) {
+				continue;
+			} else if ((pass == 0 && !strcasecmp(e->name, filename))
+					|| (pass == 1 && catalog_stem_eq(e->name, filename))
+					|| (pass == 2 && *e->board_id && !strcasecmp(e->board_id, filename))
+					|| pass == 3) {
+				match = e;
+				++matches;
+			}
+		}
+
+		if (matches == 1) {
+			*path = match->path;
+			return match->image;
+		} else if (matches > 1) {
+			break;
+		}
+	}
+
+	if (filename) {
+		fprintf(stderr, "Error: %s image in catalog for '%s' (by filename or board ID).\n",
+				matches ? "more than one" : "no", filename);
+	} else {
+		fprintf(stderr, "Error: no filename requested, and %s image in catalog.\n",
+				matches ? "more than one" : "no");
+	}
+
+	return NULL;
+}
+
+void catalog_close(struct catalog *cat)
+{
+	if (cat) {
+		catalog_entries_free(cat->entries, cat->count);
+		free(cat);
+	}
+}
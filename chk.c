@@ -0,0 +1,282 @@
+/**
+ * nmrpflash - Netgear Unbrick Utility
+ * Copyright (C) 2016 Joseph Lehner <joseph.c.lehner@gmail.com>
+ *
+ * nmrpflash is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * nmrpflash is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with nmrpflash.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <string.h>
+#include <stdio.h>
+#include "nmrpd.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Netgear .chk header. all fields are big-endian, and the header is
+// followed by the board ID, the kernel, and the rootfs (if any).
+#define CHK_MAGIC          0x2a23245e
+#define CHK_HDR_LEN        40
+
+#define CHK_OFF_MAGIC      0
+#define CHK_OFF_HDR_LEN    4
+#define CHK_OFF_REGION     8
+#define CHK_OFF_KERNEL_SUM 16
+#define CHK_OFF_ROOTFS_SUM 20
+#define CHK_OFF_KERNEL_LEN 24
+#define CHK_OFF_ROOTFS_LEN 28
+#define CHK_OFF_IMAGE_SUM  32
+#define CHK_OFF_HDR_SUM    36
+
+// the checksum is a Fletcher-32 variant on bytes, with 32-bit sums that
+// are only folded to 16 bits at the end. wrapping is fine everywhere.
+struct chk_sum
+{
+	uint32_t c0;
+	uint32_t c1;
+};
+
+static uint32_t chk_be32(const uint8_t *p)
+{
+	return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+#ifdef __SSE2__
+// for each 16-byte chunk, c1 grows by 16 times c0 before the chunk, plus
+// the chunk's bytes weighted 16..1.
+static size_t chk_sum_sse2(struct chk_sum *s, const uint8_t *p, size_t len)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i w_lo = _mm_set_epi16(9, 10, 11, 12, 13, 14, 15, 16);
+	const __m128i w_hi = _mm_set_epi16(1, 2, 3, 4, 5, 6, 7, 8);
+	__m128i v0 = zero, vp = zero, v1 = zero, b;
+	uint32_t l0[4], lp[4], l1[4];
+	size_t i, chunks = len / 16;
+
+	for (i = 0; i < chunks; ++i, p += 16) {
+		b = _mm_loadu_si128((const __m128i*)p);
+		vp = _mm_add_epi64(vp, v0);
+		v0 = _mm_add_epi64(v0, _mm_sad_epu8(b, zero));
+		v1 = _mm_add_epi32(v1, _mm_madd_epi16(_mm_unpacklo_epi8(b, zero), w_lo));
+		v1 = _mm_add_epi32(v1, _mm_madd_epi16(_mm_unpackhi_epi8(b, zero), w_hi));
+	}
+
+	_mm_storeu_si128((__m128i*)l0, v0);
+	_mm_storeu_si128((__m128i*)lp, vp);
+	_mm_storeu_si128((__m128i*)l1, v1);
+
+	// only the low halves of the 64-bit lanes matter
+	s->c1 += (uint32_t)chunks * 16 * s->c0 + 16 * (lp[0] + lp[2])
+		+ l1[0] + l1[1] + l1[2] + l1[3];
+	s->c0 += l0[0] + l0[2];
+
+	return chunks * 16;
+}
+#endif
+
+static void chk_sum_scalar(struct chk_sum *s, const uint8_t *p, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; ++i) {
+		s->c0 += p[i];
+		s->c1 += s->c0;
+	}
+}
+
+static void chk_sum_add(struct chk_sum *s, const uint8_t *p, size_t len)
+{
+	size_t i = 0;
+
+#ifdef __SSE2__
+	i = chk_sum_sse2(s, p, len);
+#endif
+
+	chk_sum_scalar(s, p + i, len - i);
+}
+
+// the sum of a followed by b, where b was started from zero
+static void chk_sum_cat(struct chk_sum *a, const struct chk_sum *b, size_t b_len)
+{
+	a->c1 += (uint32_t)b_len * a->c0 + b->c1;
+	a->c0 += b->c0;
+}
+
+static uint32_t chk_fold(uint32_t c)
+{
+	c = (c & 0xffff) + (c >> 16);
+	return ((c >> 16) + c) & 0xffff;
+}
+
+static uint32_t chk_sum_final(const struct chk_sum *s)
+{
+	return (chk_fold(s->c1) << 16) | chk_fold(s->c0);
+}
+
+uint32_t chk_checksum(const void *buf, size_t len)
+{
+	struct chk_sum s = { 0 };
+	chk_sum_add(&s, buf, len);
+	return chk_sum_final(&s);
+}
+
+#ifdef NMRPFLASH_FUZZ
+#define CHK_FUZZ_MAX_LEN 1024
+
+static void chk_fuzz_cmp(const char *what, const struct chk_sum *s,
+		const struct chk_sum *ref, size_t off, size_t len)
+{
+	if (s->c0 != ref->c0 || s->c1 != ref->c1) {
+		fprintf(stderr, "%s: sum %08x/%08x != %08x/%08x (offset %zu, %zu b).\n",
+				what, s->c0, s->c1, ref->c0, ref->c1, off, len);
+		abort();
+	}
+}
+
+void chk_fuzz_sum(const uint8_t *buf, size_t len)
+{
+	uint8_t data[CHK_FUZZ_MAX_LEN + 16];
+	struct chk_sum init = { 0 }, s, ref, tail;
+	size_t off, n, half;
+
+	// the first 8 bytes are the initial sums, since the vector path
+	// adds to them too
+	if (len >= 8) {
+		memcpy(&init, buf, 8);
+		buf += 8;
+		len -= 8;
+	}
+
+	len = MIN(len, CHK_FUZZ_MAX_LEN);
+
+	// every length, at every alignment of a 16-byte load
+	for (off = 0; off < 16; ++off) {
+		memcpy(data + off, buf, len);
+
+		for (n = 0; n <= len; ++n) {
+			ref = init;
+			chk_sum_scalar(&ref, data + off, n);
+
+			s = init;
+			chk_sum_add(&s, data + off, n);
+			chk_fuzz_cmp("chk_sum_add", &s, &ref, off, n);
+
+			half = n / 2;
+			s = init;
+			chk_sum_add(&s, data + off, half);
+			memset(&tail, 0, sizeof(tail));
+			chk_sum_add(&tail, data + off + half, n - half);
+			chk_sum_cat(&s, &tail, n - half);
+			chk_fuzz_cmp("chk_sum_cat", &s, &ref, off, n);
+		}
+	}
+}
+#endif
+
+static const char *chk_region_str(uint8_t region)
+{
+	switch (region) {
+		case 1:
+			return "WW";
+		case 2:
+			return "NA";
+		default:
+			return NULL;
+	}
+}
+
+static bool chk_verify(const char *what, uint32_t expected, uint32_t actual)
+{
+	if (expected != actual) {
+		fprintf(stderr, "Error: %s checksum mismatch (expected %08x, got %08x).\n",
+				what, expected, actual);
+		return false;
+	}
+
+	return true;
+}
+
+int chk_validate(const struct image *img, const char *region, struct chk_info *info)
+{
+	struct chk_sum kernel = { 0 }, rootfs = { 0 }, hdr = { 0 };
+	uint8_t buf[CHK_HDR_LEN + CHK_MAX_BOARD_ID];
+	uint32_t hdr_len, kernel_len, rootfs_len;
+	const char *img_region;
+	long long beg;
+	bool ok;
+
+	if (img->size < CHK_HDR_LEN || chk_be32(img->data + CHK_OFF_MAGIC) != CHK_MAGIC) {
+		return 0;
+	}
+
+	hdr_len = chk_be32(img->data + CHK_OFF_HDR_LEN);
+	kernel_len = chk_be32(img->data + CHK_OFF_KERNEL_LEN);
+	rootfs_len = chk_be32(img->data + CHK_OFF_ROOTFS_LEN);
+
+	if (hdr_len < CHK_HDR_LEN || hdr_len > sizeof(buf)) {
+		fprintf(stderr, "Error: invalid .chk header length %u.\n", hdr_len);
+		return -1;
+	} else if ((uint64_t)hdr_len + kernel_len + rootfs_len > img->size) {
+		fprintf(stderr, "Error: image is truncated (%zu b, expected %llu b).\n",
+				img->size, (unsigned long long)hdr_len + kernel_len + rootfs_len);
+		return -1;
+	}
+
+	memcpy(buf, img->data, hdr_len);
+	memset(buf + CHK_OFF_HDR_SUM, 0, 4);
+	img_region = chk_region_str(buf[CHK_OFF_REGION]);
+
+	if (verbosity) {
+		printf("Image: board ID '%.*s', region %s, kernel %u b, rootfs %u b.\n",
+				(int)(hdr_len - CHK_HDR_LEN), buf + CHK_HDR_LEN,
+				img_region ? img_region : "(any)", kernel_len, rootfs_len);
+	}
+
+	beg = millis();
+	chk_sum_add(&hdr, buf, hdr_len);
+	chk_sum_add(&kernel, img->data + hdr_len, kernel_len);
+	chk_sum_add(&rootfs, img->data + hdr_len + kernel_len, rootfs_len);
+
+	ok = chk_verify("header", chk_be32(img->data + CHK_OFF_HDR_SUM), chk_sum_final(&hdr))
+		&& chk_verify("kernel", chk_be32(img->data + CHK_OFF_KERNEL_SUM), chk_sum_final(&kernel))
+		&& (!rootfs_len || chk_verify("rootfs", chk_be32(img->data + CHK_OFF_ROOTFS_SUM),
+				chk_sum_final(&rootfs)));
+
+	chk_sum_cat(&kernel, &rootfs, rootfs_len);
+
+	if (ok) {
+		ok = chk_verify("image", chk_be32(img->data + CHK_OFF_IMAGE_SUM),
+				chk_sum_final(&kernel));
+	}
+
+	if (verbosity > 1) {
+		printf("Verified checksums in %lld ms.\n", millis() - beg);
+	}
+
+	if (info) {
+		memcpy(info->board_id, buf + CHK_HDR_LEN, hdr_len - CHK_HDR_LEN);
+		info->board_id[hdr_len - CHK_HDR_LEN] = '\0';
+		info->region = img_region;
+		info->checksum = chk_sum_final(&kernel);
+	}
+
+	if (ok && region && img_region && strcasecmp(region, img_region)) {
+		fprintf(stderr, "Error: image is for region %s, but region %s was requested.\n",
+				img_region, region);
+		ok = false;
+	}
+
+	return ok ? 1 : -1;
+}
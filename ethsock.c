@@ -38,16 +38,21 @@
 #  include <ifaddrs.h>
 #  include <unistd.h>
 #  include <net/if.h>
+#  include <errno.h>
+#  include <poll.h>
 #  include <pcap.h>
 #  if defined(NMRPFLASH_LINUX)
 #    define NMRPFLASH_AF_PACKET AF_PACKET
 #    include <linux/if_packet.h>
 #    include <netlink/route/addr.h>
+#    include <netlink/route/link.h>
+#    include <netlink/route/link/vlan.h>
 #    include <netlink/route/neighbour.h>
 #  else
 #    define NMRPFLASH_AF_PACKET AF_LINK
 #    include <net/if_types.h>
 #    include <net/if_media.h>
+#    include <net/route.h>
 #  endif
 #endif
 
@@ -56,23 +61,78 @@
 #include <SystemConfiguration/SystemConfiguration.h>
 #endif
 
+// maximum time ethsock_wait_link sleeps before checking nmrp_interrupted (and
+// the link state, if there are no notifications for it)
+#define ETHSOCK_LINK_POLL_MS 250
+
+// NMRP frames are tiny (64 bytes for the largest one we send), but leave
+// some room, so that oversized messages are truncated by the NMRP code,
+// rather than by pcap.
+#define ETHSOCK_SNAPLEN 256
+
+// frames queued per session on a VLAN trunk, see ethsock_open_trunk
+#define TRUNK_QUEUE_LEN 16
+// how often the trunk's reader thread checks whether it should exit [ms]
+#define TRUNK_POLL_MS 200
+
+struct ethsock_ip
+{
+	struct in_addr addr;
+	struct in_addr mask;
+};
+
 struct ethsock
 {
-	const char *intf;
+	char *intf;
 	pcap_t *pcap;
+#ifdef NMRPFLASH_TPACKET
+	// if set, used instead of pcap
+	struct tpacket *tp;
+#endif
 #ifndef NMRPFLASH_WINDOWS
 	int fd;
 #ifdef NMRPFLASH_LINUX
 	bool stp;
-	// managed by NetworkManager
+	// must call nm_restore on close
 	bool nm_managed;
+	// if set, address and neighbour changes are queued here
+	struct ethsock_batch *batch;
+	// if set, NMRP frames are received through a capture handle on the
+	// parent interface, shared by all sessions, and sent tagged with `vid`.
+	struct trunk *trunk;
+	struct ethsock *trunk_next;
+	uint16_t vid;
+	// one byte per queued frame. fd is the read end.
+	int trunk_pipe[2];
+	struct trunk_frame *queue;
+	unsigned queue_head;
+	unsigned queue_len;
+	// only tagged frames are received, and the tag is stripped. the
+	// VLAN ID of the last frame is stored in rx_vid.
+	bool vlan;
+	uint16_t rx_vid;
+	uint8_t rxbuf[ETHSOCK_SNAPLEN];
 #endif
 #else
 	HANDLE handle;
 	DWORD index;
+	// signaled when the socket passed to ethsock_wait is readable
+	WSAEVENT fd_event;
 #endif
 	unsigned timeout;
 	uint8_t hwaddr[6];
+	// cached IPv4 addresses of this interface, see ethsock_for_each_ip
+	struct ethsock_ip *ips;
+	size_t ips_count;
+	bool ips_valid;
+	// if set, the cache is only refreshed after an address change
+	struct intf_watch *ips_watch;
+	// if set, all frames are written here
+	struct capture *capture;
+	unsigned capture_intf;
+	uint16_t protocol;
+	// IPv4 and ARP frames are received as well, see ethsock_add_ipv4
+	bool ipv4;
 };
 
 struct ethsock_arp_undo
@@ -181,6 +241,15 @@ static bool intf_sys_read(const char* intf, const char* file, bool def)
 	return c ? (c == '1') : def;
 }
 
+#ifdef NMRPFLASH_TPACKET
+static bool intf_sys_exists(const char* intf, const char* file)
+{
+	char name[256];
+	snprintf(name, sizeof(name), "/sys/class/net/%s/%s", intf, file);
+	return access(name, F_OK) == 0;
+}
+#endif
+
 static bool intf_stp_enable(const char *intf, bool enabled)
 {
 	int fd;
@@ -207,34 +276,185 @@ static struct nl_addr *build_ip(uint32_t ip)
 	return na;
 }
 
+// one rtnetlink socket is shared by all sessions for address and
+// neighbour changes, instead of connecting for every single change.
+static struct nl_sock *nl_route = NULL;
+static xmutex_t nl_route_lock = XMUTEX_INITIALIZER;
+
+// the kernel drops ACKs that don't fit into the socket's receive buffer,
+// so don't send too many requests at once.
+#define NL_CHANGES_MAX 16
+
+struct nl_change
+{
+	struct nl_msg *msg;
+	// if NULL, errors are ignored
+	const char *name;
+	bool add;
+	int err;
+};
+
+struct ethsock_batch
+{
+	struct nl_change *changes;
+	size_t count;
+};
+
+// must be called with nl_route_lock held
 static struct nl_sock *xnl_socket_route()
 {
 	int err;
-	struct nl_sock *sk = nl_socket_alloc();
-	if (sk) {
-		if (!(err = nl_connect(sk, NETLINK_ROUTE))) {
-			return sk;
-		}
-		nl_socket_free(sk);
-		nl_perror(err, "nl_connect");
-	} else {
+
+	if (nl_route) {
+		return nl_route;
+	}
+
+	if (!(nl_route = nl_socket_alloc())) {
 		xperror("nl_socket_alloc");
+		return NULL;
 	}
 
-	return NULL;
+	if ((err = nl_connect(nl_route, NETLINK_ROUTE)) < 0) {
+		nl_perror(err, "nl_connect");
+		nl_socket_free(nl_route);
+		nl_route = NULL;
+	}
+
+	return nl_route;
+}
+
+// sends up to NL_CHANGES_MAX requests in one go, and waits for their ACKs.
+// must be called with nl_route_lock held.
+static int nl_changes_send(struct nl_sock *sk, struct nl_change *changes, size_t count)
+{
+	struct nlmsghdr *hdr;
+	uint8_t *buf;
+	size_t i, len;
+	int err;
+
+	len = 0;
+
+	for (i = 0; i < count; ++i) {
+		nl_complete_msg(sk, changes[i].msg);
+		len += NLMSG_ALIGN(nlmsg_hdr(changes[i].msg)->nlmsg_len);
+	}
+
+	buf = calloc(1, len);
+	if (!buf) {
+		xperror("calloc");
+		return -1;
+	}
+
+	len = 0;
+
+	for (i = 0; i < count; ++i) {
+		hdr = nlmsg_hdr(changes[i].msg);
+		memcpy(buf + len, hdr, hdr->nlmsg_len);
+		len += NLMSG_ALIGN(hdr->nlmsg_len);
+	}
+
+	err = nl_sendto(sk, buf, len);
+	free(buf);
+
+	if (err < 0) {
+		nl_perror(err, "nl_sendto");
+		return -1;
+	}
+
+	// the kernel handles requests in order, so the ACKs arrive in order too
+	for (i = 0; i < count; ++i) {
+		changes[i].err = nl_wait_for_ack(sk);
+		if (changes[i].add && changes[i].err == -NLE_EXIST) {
+			changes[i].err = 0;
+		}
+	}
+
+	return 0;
+}
+
+// applies all changes, and frees their messages. returns the number of
+// failed changes, not counting those without a name.
+static int nl_changes_apply(struct nl_change *changes, size_t count)
+{
+	struct nl_sock *sk;
+	size_t i, n;
+	int failed;
+
+	xmutex_lock(&nl_route_lock);
+
+	for (i = 0; i < count; ++i) {
+		changes[i].err = -NLE_FAILURE;
+	}
+
+	if ((sk = xnl_socket_route())) {
+		for (i = 0; i < count; i += n) {
+			n = MIN(count - i, NL_CHANGES_MAX);
+			if (nl_changes_send(sk, changes + i, n) != 0) {
+				break;
+			}
+		}
+	}
+
+	failed = 0;
+
+	for (i = 0; i < count; ++i) {
+		if (changes[i].err < 0 && changes[i].name) {
+			if (changes[i].add || (verbosity > 1 && changes[i].err != -NLE_OBJ_NOTFOUND)) {
+				nl_perror(changes[i].err, changes[i].name);
+			}
+			++failed;
+		}
+
+		if (changes[i].err < 0 && changes[i].err != -NLE_OBJ_NOTFOUND
+				&& changes[i].err != -NLE_EXIST && nl_route) {
+			// the error may have been ours, rather than the kernel's, so
+			// don't trust this socket anymore.
+			nl_socket_free(nl_route);
+			nl_route = NULL;
+		}
+
+		nlmsg_free(changes[i].msg);
+	}
+
+	xmutex_unlock(&nl_route_lock);
+
+	return failed;
+}
+
+// applies the changes right away, or queues them on the socket's batch.
+// returns false if any of the changes failed.
+static bool intf_apply(struct ethsock *sock, struct nl_change *changes, size_t count)
+{
+	struct ethsock_batch *batch = sock->batch;
+	struct nl_change *p;
+	bool queued = false;
+
+	if (batch) {
+		xmutex_lock(&nl_route_lock);
+		p = realloc(batch->changes, (batch->count + count) * sizeof(*p));
+		if (p) {
+			memcpy(p + batch->count, changes, count * sizeof(*p));
+			batch->changes = p;
+			batch->count += count;
+			queued = true;
+		}
+		xmutex_unlock(&nl_route_lock);
+
+		if (queued) {
+			return true;
+		}
+	}
+
+	return nl_changes_apply(changes, count) == 0;
 }
 
-static bool intf_add_del_ip(const char *intf, uint32_t ipaddr, uint32_t ipmask, bool add)
+static struct nl_msg *intf_ip_msg(struct ethsock *sock, uint32_t ipaddr, uint32_t ipmask, bool add)
 {
 	struct rtnl_addr *ra = NULL;
-	struct nl_sock *sk = NULL;
 	struct nl_addr *laddr = NULL;
 	struct nl_addr *bcast = NULL;
-	int err = 1;
-
-	if (!(sk = xnl_socket_route())) {
-		return false;
-	}
+	struct nl_msg *msg = NULL;
+	int err;
 
 	if (!(laddr = build_ip(ipaddr))) {
 		goto out;
@@ -251,28 +471,41 @@ static bool intf_add_del_ip(const char *intf, uint32_t ipaddr, uint32_t ipmask,
 		goto out;
 	}
 
-	rtnl_addr_set_ifindex(ra, if_nametoindex(intf));
+	rtnl_addr_set_ifindex(ra, if_nametoindex(sock->intf));
 	rtnl_addr_set_local(ra, laddr);
 	rtnl_addr_set_broadcast(ra, bcast);
 
-	if ((err = (add ? rtnl_addr_add(sk, ra, 0) : rtnl_addr_delete(sk, ra, 0))) < 0) {
-		if (add && err == -NLE_EXIST) {
-			err = 0;
-		} else if (add || verbosity > 1) {
-			nl_perror(err, add ? "rtnl_addr_add" : "rtnl_addr_delete");
-		}
+	if (add) {
+		err = rtnl_addr_build_add_request(ra, 0, &msg);
+	} else {
+		err = rtnl_addr_build_delete_request(ra, 0, &msg);
+	}
+
+	if (err < 0) {
+		nl_perror(err, "rtnl_addr_build_request");
+		msg = NULL;
 	}
 
 out:
 	rtnl_addr_put(ra);
 	nl_addr_put(laddr);
 	nl_addr_put(bcast);
-	nl_socket_free(sk);
 
-	return !err;
+	return msg;
+}
+
+static bool intf_add_del_ip(struct ethsock *sock, uint32_t ipaddr, uint32_t ipmask, bool add)
+{
+	struct nl_change change = {
+		.msg = intf_ip_msg(sock, ipaddr, ipmask, add),
+		.name = add ? "rtnl_addr_add" : "rtnl_addr_delete",
+		.add = add,
+	};
+
+	return change.msg && intf_apply(sock, &change, 1);
 }
 
-static bool intf_add_del_arp(const char *intf, uint32_t ipaddr, uint8_t *hwaddr, bool add)
+static bool intf_add_del_arp(struct ethsock *sock, uint32_t ipaddr, uint8_t *hwaddr, bool add)
 {
 #if 0
 	struct arpreq arp;
@@ -301,18 +534,16 @@ static bool intf_add_del_arp(const char *intf, uint32_t ipaddr, uint8_t *hwaddr,
 	close(fd);
 	return ret;
 #else
-	struct nl_sock *sk;
 	struct rtnl_neigh *neigh;
 	struct nl_addr *mac, *ip;
-	int err = 1;
+	struct nl_change changes[2];
+	size_t count = 0;
+	bool ret = false;
+	int err;
 
-	sk = NULL;
 	neigh = NULL;
 	mac = ip = NULL;
-
-	if (!(sk = xnl_socket_route())) {
-		goto out;
-	}
+	memset(changes, 0, sizeof(changes));
 
 	if (!(neigh = rtnl_neigh_alloc())) {
 		xperror("rtnl_neigh_alloc");
@@ -329,28 +560,44 @@ static bool intf_add_del_arp(const char *intf, uint32_t ipaddr, uint8_t *hwaddr,
 		goto out;
 	}
 
-	rtnl_neigh_set_ifindex(neigh, if_nametoindex(intf));
+	rtnl_neigh_set_ifindex(neigh, if_nametoindex(sock->intf));
 	rtnl_neigh_set_dst(neigh, ip);
 
-	err = rtnl_neigh_delete(sk, neigh, 0);
+	// when adding, the entry usually doesn't exist yet, so errors
+	// can be ignored.
+	if ((err = rtnl_neigh_build_delete_request(neigh, 0, &changes[count].msg)) < 0) {
+		nl_perror(err, "rtnl_neigh_build_delete_request");
+		goto out;
+	}
+
+	changes[count++].name = add ? NULL : "rtnl_neigh_delete";
 
 	if (add) {
 		rtnl_neigh_set_lladdr(neigh, mac);
 		rtnl_neigh_set_state(neigh, NUD_PERMANENT);
-		err = rtnl_neigh_add(sk, neigh, NLM_F_CREATE);
-	}
 
-	if (err && add) {
-		nl_perror(err, "rtnl_neigh_add");
+		if ((err = rtnl_neigh_build_add_request(neigh, NLM_F_CREATE, &changes[count].msg)) < 0) {
+			nl_perror(err, "rtnl_neigh_build_add_request");
+			goto out;
+		}
+
+		changes[count].name = "rtnl_neigh_add";
+		changes[count++].add = true;
 	}
 
+	ret = intf_apply(sock, changes, count);
+	count = 0;
+
 out:
+	while (count) {
+		nlmsg_free(changes[--count].msg);
+	}
+
 	nl_addr_put(ip);
 	nl_addr_put(mac);
 	rtnl_neigh_put(neigh);
-	nl_socket_free(sk);
 
-	return !err;
+	return ret;
 #endif
 }
 
@@ -498,10 +745,8 @@ static bool intf_get_hwaddr_and_index(const char *intf, uint8_t *hwaddr, DWORD *
 	return found;
 }
 
-static const char *intf_name_to_wpcap(const char *intf)
+static const char *intf_name_to_wpcap(const char *intf, char *buf, size_t size)
 {
-	static char buf[128];
-
 	if (intf[0] == '\\') {
 		return intf;
 	}
@@ -537,7 +782,7 @@ static const char *intf_name_to_wpcap(const char *intf)
 			break;
 		}
 
-		snprintf(buf, sizeof(buf),
+		snprintf(buf, size,
 			"\\Device\\NPF_{%08lX-%04X-%04X-%02X%02X-%02X%02X%02X%02X%02X%02X}",
 			guid.Data1, guid.Data2, guid.Data3,
 			guid.Data4[0], guid.Data4[1], guid.Data4[2],
@@ -708,8 +953,46 @@ inline uint8_t *ethsock_get_hwaddr(struct ethsock *sock)
 	return sock->hwaddr;
 }
 
+unsigned ethsock_get_mtu(struct ethsock *sock)
+{
+#ifndef NMRPFLASH_WINDOWS
+	struct ifreq ifr;
+	unsigned mtu = 0;
+	int fd;
+
+	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (fd < 0) {
+		xperror("socket");
+		return 0;
+	}
+
+	memset(&ifr, 0, sizeof(ifr));
+	strncpy(ifr.ifr_name, sock->intf, sizeof(ifr.ifr_name) - 1);
+
+	if (ioctl(fd, SIOCGIFMTU, &ifr) == 0) {
+		mtu = ifr.ifr_mtu;
+	} else if (verbosity > 1) {
+		xperror("ioctl(SIOCGIFMTU)");
+	}
+
+	close(fd);
+	return mtu;
+#else
+	MIB_IF_ROW2 row;
+	return intf_get_if_row(sock->index, &row) ? row.Mtu : 0;
+#endif
+}
+
 bool ethsock_is_wifi(struct ethsock *sock)
 {
+#ifdef NMRPFLASH_TPACKET
+	// avoid pcap_findalldevs, which probes every single interface
+	if (sock->tp || sock->trunk) {
+		return intf_sys_exists(sock->intf, "wireless")
+			|| intf_sys_exists(sock->intf, "phy80211");
+	}
+#endif
+
 #ifdef PCAP_IF_WIRELESS
 	bpf_u_int32 flags;
 
@@ -726,6 +1009,13 @@ bool ethsock_is_wifi(struct ethsock *sock)
 
 bool ethsock_is_unplugged(struct ethsock *sock)
 {
+#ifdef NMRPFLASH_TPACKET
+	if (sock->tp || sock->trunk) {
+		// reading "carrier" fails if the interface is down
+		return !intf_sys_read(sock->intf, "carrier", false);
+	}
+#endif
+
 #ifdef PCAP_IF_CONNECTION_STATUS
 	bpf_u_int32 flags;
 
@@ -741,121 +1031,863 @@ bool ethsock_is_unplugged(struct ethsock *sock)
 #endif
 }
 
-struct ethsock *ethsock_create(const char *intf, uint16_t protocol)
+// link state and address change notifications. link notifications only
+// serve to wake up ethsock_wait_link early, the actual state is always
+// obtained using ethsock_is_unplugged. address notifications tell
+// ethsock_for_each_ip when to refresh its cache.
+enum intf_watch_type
 {
-	char buf[PCAP_ERRBUF_SIZE];
-	struct bpf_program fp;
-	struct ethsock *sock;
-	bool is_bridge = false;
-	int err;
+	WATCH_LINK,
+	WATCH_ADDR
+};
 
-#ifdef NMRPFLASH_WINDOWS
-	intf = intf_name_to_wpcap(intf);
-	if (!intf) {
-		return NULL;
-	}
+struct intf_watch
+{
+#if defined(NMRPFLASH_LINUX)
+	struct nl_sock *sk;
+	int index;
+#elif defined(NMRPFLASH_WINDOWS)
+	HANDLE event;
+	HANDLE notify;
+	NET_IFINDEX index;
+#else
+	int fd;
+	unsigned short index;
 #endif
+	enum intf_watch_type type;
+	bool changed;
+};
 
-	sock = malloc(sizeof(struct ethsock));
-	if (!sock) {
-		xperror("malloc");
-		return NULL;
-	}
+#if defined(NMRPFLASH_LINUX)
+static int intf_watch_cb(struct nl_msg *msg, void *arg)
+{
+	struct intf_watch *w = arg;
+	struct nlmsghdr *nlh = nlmsg_hdr(msg);
 
-	buf[0] = '\0';
-	sock->intf = intf;
-	sock->pcap = pcap_create(sock->intf, buf);
-	if (!sock->pcap) {
-		fprintf(stderr, "pcap_create: %s\n", buf);
+	if (w->type == WATCH_LINK && nlh->nlmsg_type == RTM_NEWLINK) {
+		struct ifinfomsg *ifi = nlmsg_data(nlh);
+		if (ifi->ifi_index == w->index) {
+			w->changed = true;
+		}
+	} else if (w->type == WATCH_ADDR && (nlh->nlmsg_type == RTM_NEWADDR
+				|| nlh->nlmsg_type == RTM_DELADDR)) {
+		struct ifaddrmsg *ifa = nlmsg_data(nlh);
+		if (ifa->ifa_index == w->index) {
+			w->changed = true;
+		}
 	}
 
-	if (*buf) {
-		fprintf(stderr, "Warning: %s.\n", buf);
-	}
+	return NL_OK;
+}
+#elif defined(NMRPFLASH_WINDOWS)
+static VOID WINAPI link_watch_cb(PVOID ctx, PMIB_IPINTERFACE_ROW row, MIB_NOTIFICATION_TYPE type)
+{
+	struct intf_watch *w = ctx;
 
-	err = pcap_set_snaplen(sock->pcap, BUFSIZ);
-	if (err) {
-		pcap_perror(sock->pcap, "pcap_set_snaplen");
-		goto cleanup;
+	if (!row || row->InterfaceIndex == w->index) {
+		SetEvent(w->event);
 	}
+}
 
-	err = pcap_set_promisc(sock->pcap, 1);
-	if (err) {
-		pcap_perror(sock->pcap, "pcap_set_promisc");
-		goto cleanup;
+static VOID WINAPI addr_watch_cb(PVOID ctx, PMIB_UNICASTIPADDRESS_ROW row, MIB_NOTIFICATION_TYPE type)
+{
+	struct intf_watch *w = ctx;
+
+	if (!row || row->InterfaceIndex == w->index) {
+		SetEvent(w->event);
 	}
+}
+#endif
 
-	err = pcap_set_timeout(sock->pcap, 200);
-	if (err) {
-		pcap_perror(sock->pcap, "pcap_set_timeout");
-		goto cleanup;
+static bool intf_watch_open(struct ethsock *sock, struct intf_watch *w, enum intf_watch_type type)
+{
+	memset(w, 0, sizeof(*w));
+	w->type = type;
+
+#if defined(NMRPFLASH_LINUX)
+	int err;
+
+	w->index = if_nametoindex(sock->intf);
+
+	w->sk = nl_socket_alloc();
+	if (!w->sk) {
+		xperror("nl_socket_alloc");
+		return false;
 	}
 
-	err = pcap_set_immediate_mode(sock->pcap, 1);
-	if (err) {
-		pcap_perror(sock->pcap, "pcap_set_immediate_mode");
-		goto cleanup;
+	nl_socket_disable_seq_check(w->sk);
+	nl_socket_modify_cb(w->sk, NL_CB_VALID, NL_CB_CUSTOM, intf_watch_cb, w);
+
+	if ((err = nl_connect(w->sk, NETLINK_ROUTE)) < 0) {
+		nl_perror(err, "nl_connect");
+		goto err;
 	}
 
-	err = pcap_activate(sock->pcap);
+	err = nl_socket_add_membership(w->sk,
+			type == WATCH_LINK ? RTNLGRP_LINK : RTNLGRP_IPV4_IFADDR);
 	if (err < 0) {
-		pcap_perror(sock->pcap, "pcap_activate");
-		goto cleanup;
-	} else if (err > 0) {
-		fprintf(stderr, "Warning: %s.\n", pcap_geterr(sock->pcap));
+		nl_perror(err, "nl_socket_add_membership");
+		goto err;
 	}
 
-	if (pcap_datalink(sock->pcap) != DLT_EN10MB) {
-		fprintf(stderr, "%s is not an ethernet interface.\n",
-				intf);
-		goto cleanup;
-	}
+	nl_socket_set_nonblocking(w->sk);
+	return true;
+err:
+	nl_socket_free(w->sk);
+	return false;
+#elif defined(NMRPFLASH_WINDOWS)
+	DWORD err;
 
-#ifndef NMRPFLASH_WINDOWS
-	err = !intf_get_hwaddr_and_bridge(intf, sock->hwaddr, &is_bridge);
-#else
-	err = !intf_get_hwaddr_and_index(intf, sock->hwaddr, &sock->index);
-#endif
-	if (err) {
-		fprintf(stderr, "Failed to get interface info.\n");
-		goto cleanup;
+	w->index = sock->index;
+
+	w->event = CreateEvent(NULL, FALSE, FALSE, NULL);
+	if (!w->event) {
+		win_perror2("CreateEvent", GetLastError());
+		return false;
 	}
 
-#ifdef NMRPFLASH_WINDOWS
-	err = pcap_setmintocopy(sock->pcap, 0);
-	if (err) {
-		pcap_perror(sock->pcap, "pcap_setmintocopy");
-		goto cleanup;
+	if (type == WATCH_LINK) {
+		err = NotifyIpInterfaceChange(AF_UNSPEC, link_watch_cb, w, FALSE, &w->notify);
+	} else {
+		err = NotifyUnicastIpAddressChange(AF_INET, addr_watch_cb, w, FALSE, &w->notify);
 	}
 
-	sock->handle = pcap_getevent(sock->pcap);
-	if (!sock->handle) {
-		pcap_perror(sock->pcap, "pcap_getevent");
-		goto cleanup;
+	if (err != NO_ERROR) {
+		win_perror2(type == WATCH_LINK ? "NotifyIpInterfaceChange"
+				: "NotifyUnicastIpAddressChange", err);
+		CloseHandle(w->event);
+		return false;
 	}
+
+	return true;
 #else
-	sock->fd = pcap_get_selectable_fd(sock->pcap);
-	if (sock->fd == -1) {
-		pcap_perror(sock->pcap, "pcap_get_selectable_fd");
-		goto cleanup;
+	w->index = if_nametoindex(sock->intf);
+
+	w->fd = socket(PF_ROUTE, SOCK_RAW, AF_UNSPEC);
+	if (w->fd < 0) {
+		xperror("socket(PF_ROUTE)");
+		return false;
 	}
 
+	return true;
 #endif
+}
 
-	snprintf(buf, sizeof(buf), "ether proto 0x%04x and not ether src %s",
-			protocol, mac_to_str(sock->hwaddr));
+// returns 1 if the link state or addresses of the watched interface might
+// have changed, 0 on timeout, and -1 on error.
+static int intf_watch_wait(struct intf_watch *w, unsigned msec)
+{
+	w->changed = false;
+
+#if defined(NMRPFLASH_LINUX)
+	int err = select_fd(nl_socket_get_fd(w->sk), msec);
+	if (err <= 0) {
+		return err;
+	}
+
+	while ((err = nl_recvmsgs_default(w->sk)) >= 0) {
+		;
+	}
+
+	if (err == -NLE_NOMEM) {
+		// we've missed some notifications (ENOBUFS)
+		w->changed = true;
+	} else if (err != -NLE_AGAIN) {
+		nl_perror(err, "nl_recvmsgs");
+		return -1;
+	}
+#elif defined(NMRPFLASH_WINDOWS)
+	DWORD ret = WaitForSingleObject(w->event, msec);
+	if (ret == WAIT_TIMEOUT) {
+		return 0;
+	} else if (ret != WAIT_OBJECT_0) {
+		win_perror2("WaitForSingleObject", GetLastError());
+		return -1;
+	}
+
+	w->changed = true;
+#else
+	union {
+		struct if_msghdr ifm;
+		struct ifa_msghdr ifam;
+		char buf[2048];
+	} msg;
+	ssize_t len;
+
+	len = select_fd(w->fd, msec);
+	if (len <= 0) {
+		return len;
+	}
+
+	while ((len = recv(w->fd, &msg, sizeof(msg), MSG_DONTWAIT)) > 0) {
+		if (w->type == WATCH_LINK) {
+			if (msg.ifm.ifm_type == RTM_IFINFO && msg.ifm.ifm_index == w->index) {
+				w->changed = true;
+			}
+		} else if (msg.ifam.ifam_type == RTM_NEWADDR || msg.ifam.ifam_type == RTM_DELADDR) {
+			if (msg.ifam.ifam_index == w->index) {
+				w->changed = true;
+			}
+		}
+	}
+
+	if (len < 0 && errno == ENOBUFS) {
+		w->changed = true;
+	} else if (len < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+		xperror("recv");
+		return -1;
+	}
+#endif
+
+	return w->changed ? 1 : 0;
+}
+
+static void intf_watch_close(struct intf_watch *w)
+{
+#if defined(NMRPFLASH_LINUX)
+	nl_socket_free(w->sk);
+#elif defined(NMRPFLASH_WINDOWS)
+	CancelMibChangeNotify2(w->notify);
+	CloseHandle(w->event);
+#else
+	close(w->fd);
+#endif
+}
+
+int ethsock_wait_link(struct ethsock *sock, unsigned msec)
+{
+	struct intf_watch w;
+	long long now, deadline;
+	bool watching, check = true;
+	int ret;
+
+	// subscribing before the first check, so we can't miss a change
+	watching = intf_watch_open(sock, &w, WATCH_LINK);
+	deadline = millis() + msec;
+
+	while (!nmrp_interrupted()) {
+		// on some platforms, this is expensive (pcap_findalldevs), so
+		// it's only done if the link might actually have changed.
+		if (check && !ethsock_is_unplugged(sock)) {
+			ret = 1;
+			goto out;
+		}
+
+		now = millis();
+		if (now >= deadline) {
+			break;
+		}
+
+		// wake up regularly, so that we notice nmrp_interrupted; if we're not
+		// getting notifications, this doubles as a polling interval.
+		unsigned slice = MIN(deadline - now, ETHSOCK_LINK_POLL_MS);
+
+		if (watching) {
+			ret = intf_watch_wait(&w, slice);
+			if (ret < 0) {
+				intf_watch_close(&w);
+				watching = false;
+			}
+			check = ret != 0;
+		} else {
+#ifndef NMRPFLASH_WINDOWS
+			poll(NULL, 0, slice);
+#else
+			Sleep(slice);
+#endif
+		}
+	}
+
+	ret = 0;
+
+out:
+	if (watching) {
+		intf_watch_close(&w);
+	}
+
+	return ret;
+}
+
+static bool ethsock_pcap_filter(struct ethsock *sock, uint16_t protocol, bool ipv4)
+{
+	char macbuf[MAC_STR_LEN];
+	char proto[64];
+	char buf[256];
+	struct bpf_program fp;
+	int err;
+
+	if (ipv4) {
+		snprintf(proto, sizeof(proto), "(ether proto 0x%04x or ip or arp)", protocol);
+	} else {
+		snprintf(proto, sizeof(proto), "ether proto 0x%04x", protocol);
+	}
+
+#ifdef NMRPFLASH_LINUX
+	if (sock->vlan) {
+		// "vlan" changes the offsets of everything that follows
+		snprintf(buf, sizeof(buf), "not ether src %s and vlan and %s",
+				mac_to_str(sock->hwaddr, macbuf), proto);
+	} else
+#endif
+	snprintf(buf, sizeof(buf), "%s and not ether src %s",
+			proto, mac_to_str(sock->hwaddr, macbuf));
 
 	err = pcap_compile(sock->pcap, &fp, buf, 0, 0);
 	if (err) {
 		pcap_perror(sock->pcap, "pcap_compile");
+		return false;
+	}
+
+	err = pcap_setfilter(sock->pcap, &fp);
+	pcap_freecode(&fp);
+
+	if (err) {
+		pcap_perror(sock->pcap, "pcap_setfilter");
+		return false;
+	}
+
+	return true;
+}
+
+static bool ethsock_open_pcap(struct ethsock *sock, uint16_t protocol, unsigned bufsize, bool *is_bridge)
+{
+	char buf[PCAP_ERRBUF_SIZE];
+	const char *intf = sock->intf;
+	int err;
+
+	buf[0] = '\0';
+	sock->pcap = pcap_create(sock->intf, buf);
+	if (!sock->pcap) {
+		fprintf(stderr, "pcap_create: %s\n", buf);
+		return false;
+	}
+
+	if (*buf) {
+		fprintf(stderr, "Warning: %s.\n", buf);
+	}
+
+	err = pcap_set_snaplen(sock->pcap, ETHSOCK_SNAPLEN);
+	if (err) {
+		pcap_perror(sock->pcap, "pcap_set_snaplen");
+		return false;
+	}
+
+	if (bufsize) {
+		err = pcap_set_buffer_size(sock->pcap, bufsize);
+		if (err) {
+			pcap_perror(sock->pcap, "pcap_set_buffer_size");
+			return false;
+		}
+	}
+
+	err = pcap_set_promisc(sock->pcap, 1);
+	if (err) {
+		pcap_perror(sock->pcap, "pcap_set_promisc");
+		return false;
+	}
+
+	err = pcap_set_timeout(sock->pcap, 200);
+	if (err) {
+		pcap_perror(sock->pcap, "pcap_set_timeout");
+		return false;
+	}
+
+	err = pcap_set_immediate_mode(sock->pcap, 1);
+	if (err) {
+		pcap_perror(sock->pcap, "pcap_set_immediate_mode");
+		return false;
+	}
+
+	err = pcap_activate(sock->pcap);
+	if (err < 0) {
+		pcap_perror(sock->pcap, "pcap_activate");
+		return false;
+	} else if (err > 0) {
+		fprintf(stderr, "Warning: %s.\n", pcap_geterr(sock->pcap));
+	}
+
+	if (pcap_datalink(sock->pcap) != DLT_EN10MB) {
+		fprintf(stderr, "%s is not an ethernet interface.\n",
+				intf);
+		return false;
+	}
+
+#ifndef NMRPFLASH_WINDOWS
+	err = !intf_get_hwaddr_and_bridge(intf, sock->hwaddr, is_bridge);
+#else
+	err = !intf_get_hwaddr_and_index(intf, sock->hwaddr, &sock->index);
+#endif
+	if (err) {
+		fprintf(stderr, "Failed to get interface info.\n");
+		return false;
+	}
+
+#ifdef NMRPFLASH_WINDOWS
+	err = pcap_setmintocopy(sock->pcap, 0);
+	if (err) {
+		pcap_perror(sock->pcap, "pcap_setmintocopy");
+		return false;
+	}
+
+	sock->handle = pcap_getevent(sock->pcap);
+	if (!sock->handle) {
+		pcap_perror(sock->pcap, "pcap_getevent");
+		return false;
+	}
+#else
+	sock->fd = pcap_get_selectable_fd(sock->pcap);
+	if (sock->fd == -1) {
+		pcap_perror(sock->pcap, "pcap_get_selectable_fd");
+		return false;
+	}
+
+#endif
+
+	return ethsock_pcap_filter(sock, protocol, false);
+}
+
+#ifdef NMRPFLASH_TPACKET
+static bool ethsock_open_tpacket(struct ethsock *sock, uint16_t protocol, unsigned bufsize, bool *is_bridge)
+{
+	if (!intf_get_hwaddr_and_bridge(sock->intf, sock->hwaddr, is_bridge)) {
+		return false;
+	}
+
+	sock->tp = tpacket_open(sock->intf, protocol, sock->hwaddr, ETHSOCK_SNAPLEN,
+			bufsize, sock->vlan);
+	if (!sock->tp) {
+		return false;
+	}
+
+	sock->fd = tpacket_fd(sock->tp);
+	return true;
+}
+#endif
+
+#ifdef NMRPFLASH_LINUX
+struct trunk_frame
+{
+	size_t len;
+	uint8_t buf[ETHSOCK_SNAPLEN];
+};
+
+// a capture handle on the parent of one or more VLAN interfaces. a single
+// reader thread hands the frames to the session using each VLAN.
+struct trunk
+{
+	char *intf;
+	struct ethsock *sock;
+	xthread_t thread;
+	// protects `socks`, their queues, `done`, and sending on `sock`
+	xmutex_t lock;
+	struct ethsock *socks;
+	bool done;
+	unsigned refs;
+	struct trunk *next;
+};
+
+static struct trunk *trunks = NULL;
+static xmutex_t trunks_lock = XMUTEX_INITIALIZER;
+
+static ssize_t ethsock_recv_next(struct ethsock *sock, const uint8_t **buf);
+
+static bool intf_get_vlan(const char *intf, char *parent, uint16_t *vid)
+{
+	struct rtnl_link *link = NULL;
+	struct nl_sock *sk;
+	bool ret = false;
+	int err = -NLE_FAILURE;
+
+	xmutex_lock(&nl_route_lock);
+	if ((sk = xnl_socket_route())) {
+		err = rtnl_link_get_kernel(sk, 0, intf, &link);
+	}
+	xmutex_unlock(&nl_route_lock);
+
+	if (err < 0) {
+		nl_perror(err, intf);
+		return false;
+	}
+
+	if (!rtnl_link_is_vlan(link)) {
+		fprintf(stderr, "Error: %s is not a VLAN interface.\n", intf);
+	} else if (!if_indextoname(rtnl_link_get_link(link), parent)) {
+		xperror("if_indextoname");
+	} else {
+		*vid = rtnl_link_vlan_get_id(link);
+		ret = true;
+	}
+
+	rtnl_link_put(link);
+	return ret;
+}
+
+// must be called with the trunk's lock held
+static void trunk_queue(struct ethsock *sock, const uint8_t *buf, size_t len)
+{
+	struct trunk_frame *f;
+
+	if (sock->queue_len == TRUNK_QUEUE_LEN) {
+		// the session isn't keeping up. NMRP retransmits anyway.
+		return;
+	}
+
+	f = &sock->queue[(sock->queue_head + sock->queue_len) % TRUNK_QUEUE_LEN];
+	f->len = MIN(len, sizeof(f->buf));
+	memcpy(f->buf, buf, f->len);
+
+	if (write(sock->trunk_pipe[1], "", 1) == 1) {
+		++sock->queue_len;
+	}
+}
+
+static void *trunk_thread(void *arg)
+{
+	struct trunk *t = arg;
+	struct ethsock *s;
+	const uint8_t *buf;
+	ssize_t len;
+	bool done = false;
+
+	while (!done) {
+		len = ethsock_recv_next(t->sock, &buf);
+		if (len < 0) {
+			// the sessions will time out
+			fprintf(stderr, "Error: receiving on %s failed.\n", t->intf);
+			break;
+		}
+
+		xmutex_lock(&t->lock);
+
+		for (s = t->socks; len && s; s = s->trunk_next) {
+			if (s->vid == t->sock->rx_vid) {
+				trunk_queue(s, buf, len);
+				break;
+			}
+		}
+
+		done = t->done;
+		xmutex_unlock(&t->lock);
+	}
+
+	return NULL;
+}
+
+static struct ethsock *ethsock_open_vlan(const char *intf, uint16_t protocol, unsigned bufsize)
+{
+	struct ethsock *sock;
+	bool is_bridge;
+	bool ok = false;
+
+	sock = calloc(1, sizeof(struct ethsock));
+	if (!sock) {
+		xperror("calloc");
+		return NULL;
+	}
+
+	sock->intf = strdup(intf);
+	if (!sock->intf) {
+		xperror("strdup");
+		free(sock);
+		return NULL;
+	}
+
+	sock->vlan = true;
+	sock->timeout = TRUNK_POLL_MS;
+
+#ifdef NMRPFLASH_TPACKET
+	ok = ethsock_open_tpacket(sock, protocol, bufsize, &is_bridge);
+#endif
+
+	if (!ok && !ethsock_open_pcap(sock, protocol, bufsize, &is_bridge)) {
+		ethsock_close(sock);
+		return NULL;
+	}
+
+	return sock;
+}
+
+static struct trunk *trunk_get(const char *intf, uint16_t protocol, unsigned bufsize)
+{
+	struct trunk *t;
+
+	xmutex_lock(&trunks_lock);
+
+	for (t = trunks; t; t = t->next) {
+		if (!strcmp(t->intf, intf)) {
+			++t->refs;
+			goto out;
+		}
+	}
+
+	t = calloc(1, sizeof(*t));
+	if (!t) {
+		xperror("calloc");
+		goto out;
+	}
+
+	t->lock = (xmutex_t)XMUTEX_INITIALIZER;
+	t->refs = 1;
+	t->intf = strdup(intf);
+	if (!t->intf) {
+		xperror("strdup");
+		goto err;
+	}
+
+	t->sock = ethsock_open_vlan(intf, protocol, bufsize);
+	if (!t->sock) {
+		goto err;
+	}
+
+	if (xthread_create(&t->thread, &trunk_thread, t) != 0) {
+		goto err;
+	}
+
+	if (verbosity > 1) {
+		printf("Opened VLAN trunk on %s.\n", intf);
+	}
+
+	t->next = trunks;
+	trunks = t;
+	goto out;
+
+err:
+	ethsock_close(t->sock);
+	free(t->intf);
+	free(t);
+	t = NULL;
+out:
+	xmutex_unlock(&trunks_lock);
+	return t;
+}
+
+static void trunk_put(struct trunk *t)
+{
+	struct trunk **p;
+
+	xmutex_lock(&trunks_lock);
+
+	if (--t->refs) {
+		xmutex_unlock(&trunks_lock);
+		return;
+	}
+
+	for (p = &trunks; *p != t; p = &(*p)->next)
+		;
+
+	*p = t->next;
+	xmutex_unlock(&trunks_lock);
+
+	xmutex_lock(&t->lock);
+	t->done = true;
+	xmutex_unlock(&t->lock);
+
+	xthread_join(t->thread);
+	ethsock_close(t->sock);
+	free(t->intf);
+	free(t);
+}
+
+static void trunk_detach(struct ethsock *sock)
+{
+	struct trunk *t = sock->trunk;
+	struct ethsock **p;
+
+	xmutex_lock(&t->lock);
+
+	for (p = &t->socks; *p; p = &(*p)->trunk_next) {
+		if (*p == sock) {
+			*p = sock->trunk_next;
+			break;
+		}
+	}
+
+	xmutex_unlock(&t->lock);
+	trunk_put(t);
+}
+
+// NMRP frames on `sock->intf`, a VLAN interface, are received through a
+// capture handle on its parent, shared by all sessions on that trunk,
+// instead of one handle per VLAN interface. everything else (IP, TFTP,
+// ARP) still uses the VLAN interface.
+static bool ethsock_open_trunk(struct ethsock *sock, uint16_t protocol, unsigned bufsize, bool *is_bridge)
+{
+	char parent[IFNAMSIZ];
+	struct ethsock *s;
+	int fds[2];
+
+	if (!intf_get_vlan(sock->intf, parent, &sock->vid)) {
+		return false;
+	}
+
+	if (!intf_get_hwaddr_and_bridge(sock->intf, sock->hwaddr, is_bridge)) {
+		return false;
+	}
+
+	if (pipe(fds) != 0) {
+		xperror("pipe");
+		return false;
+	}
+
+	sock->queue = calloc(TRUNK_QUEUE_LEN, sizeof(*sock->queue));
+	if (!sock->queue) {
+		xperror("calloc");
+		close(fds[0]);
+		close(fds[1]);
+		return false;
+	}
+
+	// the reader thread must never block
+	fcntl(fds[1], F_SETFL, O_NONBLOCK);
+	sock->trunk_pipe[0] = fds[0];
+	sock->trunk_pipe[1] = fds[1];
+	sock->fd = fds[0];
+
+	sock->trunk = trunk_get(parent, protocol, bufsize);
+	if (!sock->trunk) {
+		return false;
+	}
+
+	xmutex_lock(&sock->trunk->lock);
+
+	for (s = sock->trunk->socks; s; s = s->trunk_next) {
+		if (s->vid == sock->vid) {
+			break;
+		}
+	}
+
+	if (!s) {
+		sock->trunk_next = sock->trunk->socks;
+		sock->trunk->socks = sock;
+	}
+
+	xmutex_unlock(&sock->trunk->lock);
+
+	if (s) {
+		fprintf(stderr, "Error: VLAN %u on %s is already in use by %s.\n",
+				sock->vid, parent, s->intf);
+		return false;
+	}
+
+	if (verbosity > 1) {
+		printf("Using VLAN %u on %s.\n", sock->vid, parent);
+	}
+
+	return true;
+}
+
+static ssize_t trunk_recv(struct ethsock *sock, const uint8_t **buf)
+{
+	struct trunk_frame *f;
+	ssize_t len;
+	int status;
+	char c;
+
+	if (sock->timeout) {
+		status = select_fd(sock->fd, sock->timeout);
+		if (status <= 0) {
+			return status;
+		}
+	}
+
+	if (read(sock->fd, &c, 1) != 1) {
+		if (errno == EINTR) {
+			return 0;
+		}
+		xperror("read");
+		return -1;
+	}
+
+	xmutex_lock(&sock->trunk->lock);
+	f = &sock->queue[sock->queue_head];
+	memcpy(sock->rxbuf, f->buf, f->len);
+	len = f->len;
+	sock->queue_head = (sock->queue_head + 1) % TRUNK_QUEUE_LEN;
+	--sock->queue_len;
+	xmutex_unlock(&sock->trunk->lock);
+
+	*buf = sock->rxbuf;
+	return len;
+}
+
+static int trunk_send(struct ethsock *sock, const uint8_t *buf, size_t len)
+{
+	uint8_t frame[ETHSOCK_SNAPLEN + 4];
+	int ret;
+
+	if (len < 14 || len > ETHSOCK_SNAPLEN) {
+		fprintf(stderr, "Error: invalid frame size %zu.\n", len);
+		return -1;
+	}
+
+	memcpy(frame, buf, 12);
+	frame[12] = 0x81;
+	frame[13] = 0x00;
+	frame[14] = sock->vid >> 8;
+	frame[15] = sock->vid & 0xff;
+	memcpy(frame + 16, buf + 12, len - 12);
+
+	xmutex_lock(&sock->trunk->lock);
+	ret = ethsock_send(sock->trunk->sock, frame, len + 4);
+	xmutex_unlock(&sock->trunk->lock);
+
+	return ret;
+}
+#endif
+
+struct ethsock *ethsock_create(const char *intf, uint16_t protocol, unsigned bufsize, bool trunk)
+{
+	struct ethsock *sock;
+	bool is_bridge = false;
+	bool ok = false;
+
+#ifdef NMRPFLASH_WINDOWS
+	char wpcap[128];
+
+	intf = intf_name_to_wpcap(intf, wpcap, sizeof(wpcap));
+	if (!intf) {
+		return NULL;
+	}
+#endif
+
+	sock = calloc(1, sizeof(struct ethsock));
+	if (!sock) {
+		xperror("calloc");
+		return NULL;
+	}
+
+	// the caller's string might not outlive the socket
+	sock->intf = strdup(intf);
+	if (!sock->intf) {
+		xperror("strdup");
+		free(sock);
+		return NULL;
+	}
+
+	intf = sock->intf;
+	sock->protocol = protocol;
+
+	if (trunk) {
+#ifdef NMRPFLASH_LINUX
+		if (!ethsock_open_trunk(sock, protocol, bufsize, &is_bridge)) {
+			goto cleanup;
+		}
+		ok = true;
+#else
+		fprintf(stderr, "Error: VLAN trunks are only supported on Linux.\n");
 		goto cleanup;
+#endif
 	}
 
-	err = pcap_setfilter(sock->pcap, &fp);
-	pcap_freecode(&fp);
+#ifdef NMRPFLASH_TPACKET
+	if (!ok && !(ok = ethsock_open_tpacket(sock, protocol, bufsize, &is_bridge))) {
+		printf("Warning: falling back to libpcap.\n");
+	} else if (verbosity > 1) {
+		printf("Using TPACKET_V3 socket.\n");
+	}
+#endif
 
-	if (err) {
-		pcap_perror(sock->pcap, "pcap_setfilter");
+	if (!ok && !ethsock_open_pcap(sock, protocol, bufsize, &is_bridge)) {
 		goto cleanup;
 	}
 
@@ -867,23 +1899,10 @@ struct ethsock *ethsock_create(const char *intf, uint16_t protocol)
 		}
 	}
 
-	err = system("nmcli -v > /dev/null");
-	if (!err) {
-		err = systemf("nmcli -f GENERAL.STATE device show %s | grep -q unmanaged", sock->intf);
-		if (!err) {
-			sock->nm_managed = false;
-		} else {
-			sock->nm_managed = true;
-			err = systemf("nmcli device set ifname %s managed no", sock->intf);
-			if (err) {
-				printf("Warning: failed to temporarily disable NetworkManager\n");
-			} else if (verbosity > 1) {
-				printf("Temporarily disabling NetworkManager on interface.\n");
-			}
-		}
-	} else {
-		sock->nm_managed = false;
-	}
+	// when flashing multiple interfaces, this has already been done for
+	// all of them at once, so this only takes another reference.
+	nm_unmanage((const char**)&sock->intf, 1);
+	sock->nm_managed = true;
 #else
 	if (is_bridge) {
 		fprintf(stderr, "Warning: bridge interfaces are not fully "
@@ -898,11 +1917,21 @@ cleanup:
 	return NULL;
 }
 
-ssize_t ethsock_recv(struct ethsock *sock, void *buf, size_t len)
+static ssize_t ethsock_recv_next(struct ethsock *sock, const uint8_t **buf)
 {
 	struct pcap_pkthdr* hdr;
 	const u_char *capbuf;
 	int status;
+#ifdef NMRPFLASH_LINUX
+	if (sock->trunk) {
+		return trunk_recv(sock, buf);
+	}
+#endif
+#ifdef NMRPFLASH_TPACKET
+	if (sock->tp) {
+		return tpacket_recv_ref(sock->tp, buf, &sock->rx_vid, sock->timeout ? sock->timeout : -1);
+	}
+#endif
 #ifdef NMRPFLASH_WINDOWS
 	DWORD ret;
 
@@ -929,7 +1958,22 @@ ssize_t ethsock_recv(struct ethsock *sock, void *buf, size_t len)
 	status = pcap_next_ex(sock->pcap, &hdr, &capbuf);
 	switch (status) {
 		case 1:
-			memcpy(buf, capbuf, MIN(len, hdr->caplen));
+#ifdef NMRPFLASH_LINUX
+			if (sock->vlan) {
+				// libpcap puts the tag back into the frame. the filter
+				// has made sure that there is one.
+				if (hdr->caplen < 18) {
+					return 0;
+				}
+
+				sock->rx_vid = ((capbuf[14] << 8) | capbuf[15]) & 0xfff;
+				memcpy(sock->rxbuf, capbuf, 12);
+				memcpy(sock->rxbuf + 12, capbuf + 16, hdr->caplen - 16);
+				*buf = sock->rxbuf;
+				return hdr->caplen - 4;
+			}
+#endif
+			*buf = capbuf;
 			return hdr->caplen;
 		case 0:
 			return 0;
@@ -942,8 +1986,163 @@ ssize_t ethsock_recv(struct ethsock *sock, void *buf, size_t len)
 	}
 }
 
+ssize_t ethsock_recv_ref(struct ethsock *sock, const uint8_t **buf)
+{
+	ssize_t bytes = ethsock_recv_next(sock, buf);
+
+	if (bytes > 0 && sock->capture) {
+		capture_frame(sock->capture, sock->capture_intf, false, *buf, bytes);
+	}
+
+	return bytes;
+}
+
+ssize_t ethsock_recv(struct ethsock *sock, void *buf, size_t len)
+{
+	const uint8_t *p;
+	ssize_t bytes = ethsock_recv_ref(sock, &p);
+
+	if (bytes > 0) {
+		memcpy(buf, p, MIN(len, (size_t)bytes));
+	}
+
+	return bytes;
+}
+
+int ethsock_wait(struct ethsock *sock, int fd, unsigned msec)
+{
+	int ready = 0;
+#ifndef NMRPFLASH_WINDOWS
+	struct pollfd fds[2] = {
+		{ .fd = sock->fd, .events = POLLIN },
+		{ .fd = fd, .events = POLLIN },
+	};
+
+	int status = poll(fds, fd >= 0 ? 2 : 1, msec);
+	if (status < 0) {
+		if (errno == EINTR) {
+			return 0;
+		}
+		xperror("poll");
+		return -1;
+	}
+
+	if (fds[0].revents) {
+		ready |= ETHSOCK_READY;
+	}
+
+	if (fd >= 0 && fds[1].revents) {
+		ready |= ETHSOCK_READY_FD;
+	}
+#else
+	HANDLE handles[2];
+	WSANETWORKEVENTS events;
+	DWORD ret, count = 1;
+
+	handles[0] = sock->handle;
+
+	if (fd >= 0) {
+		if (!sock->fd_event) {
+			sock->fd_event = WSACreateEvent();
+			if (sock->fd_event == WSA_INVALID_EVENT) {
+				sock->fd_event = NULL;
+				win_perror2("WSACreateEvent", WSAGetLastError());
+				return -1;
+			}
+		}
+
+		// (re)associating on each call is cheap, and means we don't have
+		// to care if the caller has closed and reopened its socket. if
+		// a datagram is already queued, the event is signaled right away.
+		if (WSAEventSelect(fd, sock->fd_event, FD_READ) != 0) {
+			win_perror2("WSAEventSelect", WSAGetLastError());
+			return -1;
+		}
+
+		handles[count++] = sock->fd_event;
+	}
+
+	ret = WaitForMultipleObjects(count, handles, FALSE, msec);
+	if (ret == WAIT_TIMEOUT) {
+		return 0;
+	} else if (ret >= WAIT_OBJECT_0 + count) {
+		win_perror2("WaitForMultipleObjects", GetLastError());
+		return -1;
+	}
+
+	// more than one handle may be signaled, but only the lowest index
+	// is reported
+	if (ret == WAIT_OBJECT_0 || WaitForSingleObject(handles[0], 0) == WAIT_OBJECT_0) {
+		ready |= ETHSOCK_READY;
+	}
+
+	if (fd >= 0) {
+		// also resets the event
+		if (WSAEnumNetworkEvents(fd, sock->fd_event, &events) != 0) {
+			win_perror2("WSAEnumNetworkEvents", WSAGetLastError());
+			return -1;
+		}
+
+		if (events.lNetworkEvents & FD_READ) {
+			ready |= ETHSOCK_READY_FD;
+		}
+
+		// WSAEventSelect leaves the socket in non-blocking mode, which
+		// the caller doesn't expect when sending.
+		u_long nonblock = 0;
+		WSAEventSelect(fd, NULL, 0);
+		ioctlsocket(fd, FIONBIO, &nonblock);
+	}
+#endif
+
+	return ready;
+}
+
+#ifdef NMRPFLASH_WIN_OVERLAPPED
+int ethsock_wait_handle(struct ethsock *sock, HANDLE handle, unsigned msec)
+{
+	HANDLE handles[2] = { sock->handle, handle };
+	int ready = 0;
+	DWORD ret;
+
+	ret = WaitForMultipleObjects(2, handles, FALSE, msec);
+	if (ret == WAIT_TIMEOUT) {
+		return 0;
+	} else if (ret >= WAIT_OBJECT_0 + 2) {
+		win_perror2("WaitForMultipleObjects", GetLastError());
+		return -1;
+	}
+
+	// only the lowest signaled index is reported
+	if (ret == WAIT_OBJECT_0 || WaitForSingleObject(handles[0], 0) == WAIT_OBJECT_0) {
+		ready |= ETHSOCK_READY;
+	}
+
+	if (ret == WAIT_OBJECT_0 + 1 || WaitForSingleObject(handles[1], 0) == WAIT_OBJECT_0) {
+		ready |= ETHSOCK_READY_FD;
+	}
+
+	return ready;
+}
+#endif
+
 int ethsock_send(struct ethsock *sock, void *buf, size_t len)
 {
+	if (sock->capture) {
+		capture_frame(sock->capture, sock->capture_intf, true, buf, len);
+	}
+
+#ifdef NMRPFLASH_LINUX
+	if (sock->trunk) {
+		return trunk_send(sock, buf, len);
+	}
+#endif
+#ifdef NMRPFLASH_TPACKET
+	if (sock->tp) {
+		return tpacket_send(sock->tp, buf, len);
+	}
+#endif
+
 	if (pcap_inject(sock->pcap, buf, len) != len) {
 #ifdef NMRPFLASH_WINDOWS
 		// Npcap's pcap_inject fails in many cases where neither
@@ -976,13 +2175,40 @@ int ethsock_close(struct ethsock *sock)
 	}
 
 	if (sock->nm_managed) {
-		systemf("nmcli device set ifname %s managed yes", sock->intf);
+		nm_restore((const char**)&sock->intf, 1);
+	}
+
+	if (sock->trunk) {
+		trunk_detach(sock);
+	}
+
+	if (sock->queue) {
+		close(sock->trunk_pipe[0]);
+		close(sock->trunk_pipe[1]);
+		free(sock->queue);
 	}
 #endif
+#ifdef NMRPFLASH_TPACKET
+	tpacket_close(sock->tp);
+#endif
+
 	if (sock->pcap) {
 		pcap_close(sock->pcap);
 	}
 
+#ifdef NMRPFLASH_WINDOWS
+	if (sock->fd_event) {
+		WSACloseEvent(sock->fd_event);
+	}
+#endif
+
+	if (sock->ips_watch) {
+		intf_watch_close(sock->ips_watch);
+		free(sock->ips_watch);
+	}
+
+	free(sock->ips);
+	free(sock->intf);
 	free(sock);
 	return 0;
 }
@@ -1002,6 +2228,7 @@ static int ethsock_arp(struct ethsock *sock, uint8_t *hwaddr, uint32_t ipaddr, s
 {
 #if defined(NMRPFLASH_UNIX) && !defined(NMRPFLASH_LINUX)
 	struct in_addr addr = { .s_addr = ipaddr };
+	char ipbuf[INET_ADDRSTRLEN], macbuf[MAC_STR_LEN];
 #elif defined(NMRPFLASH_WINDOWS)
 	DWORD err;
 	MIB_IPNETROW arp = {
@@ -1016,7 +2243,7 @@ static int ethsock_arp(struct ethsock *sock, uint8_t *hwaddr, uint32_t ipaddr, s
 
 	if (undo) {
 #if defined(NMRPFLASH_LINUX)
-		if (!intf_add_del_arp(sock->intf, ipaddr, hwaddr, true)) {
+		if (!intf_add_del_arp(sock, ipaddr, hwaddr, true)) {
 			return -1;
 		}
 #elif defined(NMRPFLASH_WINDOWS)
@@ -1026,7 +2253,8 @@ static int ethsock_arp(struct ethsock *sock, uint8_t *hwaddr, uint32_t ipaddr, s
 			return -1;
 		}
 #else
-		if (systemf("arp -s %s %s", inet_ntoa(addr), mac_to_str(hwaddr)) != 0) {
+		if (systemf("arp -s %s %s", inet_ntop(AF_INET, &addr, ipbuf, sizeof(ipbuf)),
+					mac_to_str(hwaddr, macbuf)) != 0) {
 			return -1;
 		}
 #endif
@@ -1041,13 +2269,14 @@ static int ethsock_arp(struct ethsock *sock, uint8_t *hwaddr, uint32_t ipaddr, s
 		memcpy((*undo)->hwaddr, hwaddr, 6);
 	} else {
 #if defined(NMRPFLASH_LINUX)
-		if (!intf_add_del_arp(sock->intf, ipaddr, hwaddr, false)) {
+		if (!intf_add_del_arp(sock, ipaddr, hwaddr, false)) {
 			return -1;
 		}
 #elif defined(NMRPFLASH_WINDOWS)
 		return DeleteIpNetEntry(&arp) ? 0 : -1;
 #else
-		return systemf("arp -d %s &> /dev/null", inet_ntoa(addr));
+		return systemf("arp -d %s &> /dev/null",
+				inet_ntop(AF_INET, &addr, ipbuf, sizeof(ipbuf)));
 #endif
 	}
 
@@ -1106,6 +2335,7 @@ int ethsock_list_all(void)
 	pcap_if_t *devs, *dev;
 	pcap_addr_t *addr;
 	uint8_t hwaddr[6];
+	char macbuf[MAC_STR_LEN];
 	unsigned dev_num = 0, dev_ok = 0;
 #if defined(NMRPFLASH_WINDOWS)
 	char* pretty;
@@ -1179,7 +2409,7 @@ int ethsock_list_all(void)
 			printf("  %-15s", "0.0.0.0");
 		}
 
-		printf("  %s", mac_to_str(hwaddr));
+		printf("  %s", mac_to_str(hwaddr, macbuf));
 
 #if defined(NMRPFLASH_WINDOWS) || defined(NMRPFLASH_MACOS)
 		if (pretty) {
@@ -1201,7 +2431,43 @@ int ethsock_list_all(void)
 	return 0;
 }
 
-int ethsock_for_each_ip(struct ethsock *sock, ethsock_ip_callback_t callback,
+#ifdef NMRPFLASH_TPACKET
+static int ethsock_for_each_ifaddr(struct ethsock *sock, ethsock_ip_callback_t callback,
+		void *arg)
+{
+	struct ethsock_ip_callback_args args;
+	struct ifaddrs *ifas, *ifa;
+	int status = 0;
+
+	if (getifaddrs(&ifas) != 0) {
+		xperror("getifaddrs");
+		return -1;
+	}
+
+	args.arg = arg;
+
+	for (ifa = ifas; ifa; ifa = ifa->ifa_next) {
+		if (!ifa->ifa_addr || ifa->ifa_addr->sa_family != AF_INET
+				|| strcmp(sock->intf, ifa->ifa_name)) {
+			continue;
+		}
+
+		args.ipaddr = &((struct sockaddr_in*)ifa->ifa_addr)->sin_addr;
+		args.ipmask = &((struct sockaddr_in*)ifa->ifa_netmask)->sin_addr;
+
+		status = callback(&args);
+		if (status <= 0) {
+			break;
+		}
+	}
+
+	freeifaddrs(ifas);
+
+	return status <= 0 ? status : 0;
+}
+#endif
+
+static int ethsock_enum_ip(struct ethsock *sock, ethsock_ip_callback_t callback,
 		void *arg)
 {
 	struct ethsock_ip_callback_args args;
@@ -1209,6 +2475,12 @@ int ethsock_for_each_ip(struct ethsock *sock, ethsock_ip_callback_t callback,
 	pcap_addr_t *addr;
 	int status = 0;
 
+#ifdef NMRPFLASH_TPACKET
+	if (sock->tp || sock->trunk) {
+		return ethsock_for_each_ifaddr(sock, callback, arg);
+	}
+#endif
+
 	if (x_pcap_findalldevs(&devs) != 0) {
 		return -1;
 	}
@@ -1240,6 +2512,77 @@ int ethsock_for_each_ip(struct ethsock *sock, ethsock_ip_callback_t callback,
 	return status <= 0 ? status : 0;
 }
 
+static int ethsock_ip_cache_add(struct ethsock_ip_callback_args *args)
+{
+	struct ethsock *sock = args->arg;
+	struct ethsock_ip *ips;
+
+	ips = realloc(sock->ips, (sock->ips_count + 1) * sizeof(*ips));
+	if (!ips) {
+		xperror("realloc");
+		return -1;
+	}
+
+	ips[sock->ips_count].addr = *args->ipaddr;
+	ips[sock->ips_count].mask = *args->ipmask;
+	sock->ips = ips;
+	++sock->ips_count;
+
+	return 1;
+}
+
+static int ethsock_ip_cache_update(struct ethsock *sock)
+{
+	if (!sock->ips_watch) {
+		// subscribing before enumerating the addresses, so we can't
+		// miss a change
+		sock->ips_watch = malloc(sizeof(*sock->ips_watch));
+		if (sock->ips_watch && !intf_watch_open(sock, sock->ips_watch, WATCH_ADDR)) {
+			free(sock->ips_watch);
+			sock->ips_watch = NULL;
+		}
+	} else if (sock->ips_valid && !intf_watch_wait(sock->ips_watch, 0)) {
+		return 0;
+	}
+
+	sock->ips_count = 0;
+	sock->ips_valid = false;
+
+	if (ethsock_enum_ip(sock, ethsock_ip_cache_add, sock) < 0) {
+		return -1;
+	}
+
+	// without notifications, we have to check every time
+	sock->ips_valid = sock->ips_watch != NULL;
+	return 0;
+}
+
+int ethsock_for_each_ip(struct ethsock *sock, ethsock_ip_callback_t callback,
+		void *arg)
+{
+	struct ethsock_ip_callback_args args;
+	size_t i;
+	int status = 0;
+
+	if (ethsock_ip_cache_update(sock) != 0) {
+		return -1;
+	}
+
+	args.arg = arg;
+
+	for (i = 0; i < sock->ips_count; ++i) {
+		args.ipaddr = &sock->ips[i].addr;
+		args.ipmask = &sock->ips[i].mask;
+
+		status = callback(&args);
+		if (status <= 0) {
+			break;
+		}
+	}
+
+	return status <= 0 ? status : 0;
+}
+
 static inline void set_addr(void *p, uint32_t addr)
 {
 	struct sockaddr_in* sin = p;
@@ -1305,7 +2648,7 @@ static int ethsock_ip_add_del(struct ethsock *sock, uint32_t ipaddr, uint32_t ip
 
 #ifndef NMRPFLASH_WINDOWS
 #ifdef NMRPFLASH_LINUX
-	if (!intf_add_del_ip(sock->intf, (*undo)->ip[0], (*undo)->ip[1], add)) {
+	if (!intf_add_del_ip(sock, (*undo)->ip[0], (*undo)->ip[1], add)) {
 		goto out;
 	}
 #else // NMRPFLASH_MACOS (or any other BSD)
@@ -1430,3 +2773,80 @@ int ethsock_ip_del(struct ethsock *sock, struct ethsock_ip_undo **undo)
 	*undo = NULL;
 	return ret;
 }
+
+struct ethsock_batch *ethsock_batch_new(void)
+{
+#ifdef NMRPFLASH_LINUX
+	struct ethsock_batch *batch = calloc(1, sizeof(*batch));
+	if (!batch) {
+		xperror("calloc");
+	}
+
+	return batch;
+#else
+	return NULL;
+#endif
+}
+
+void ethsock_set_batch(struct ethsock *sock, struct ethsock_batch *batch)
+{
+#ifdef NMRPFLASH_LINUX
+	sock->batch = batch;
+#endif
+}
+
+int ethsock_batch_commit(struct ethsock_batch *batch)
+{
+	int ret = 0;
+
+#ifdef NMRPFLASH_LINUX
+	if (!batch) {
+		return 0;
+	}
+
+	if (nl_changes_apply(batch->changes, batch->count)) {
+		ret = -1;
+	}
+
+	free(batch->changes);
+	free(batch);
+#endif
+
+	return ret;
+}
+
+void ethsock_set_capture(struct ethsock *sock, struct capture *cap)
+{
+	sock->capture = cap;
+	if (cap) {
+		sock->capture_intf = capture_add_intf(cap, sock->intf, "NMRP",
+				CAPTURE_LINKTYPE_ETHERNET);
+	}
+}
+
+int ethsock_add_ipv4(struct ethsock *sock)
+{
+	if (sock->ipv4) {
+		return 0;
+	}
+
+#ifdef NMRPFLASH_LINUX
+	if (sock->trunk) {
+		fprintf(stderr, "Error: userspace TFTP is not supported on VLAN trunks.\n");
+		return -1;
+	}
+#endif
+#ifdef NMRPFLASH_TPACKET
+	if (sock->tp) {
+		if (tpacket_add_ipv4(sock->tp) != 0) {
+			return -1;
+		}
+	} else
+#endif
+	if (!ethsock_pcap_filter(sock, sock->protocol, true)) {
+		return -1;
+	}
+
+	sock->ipv4 = true;
+	return 0;
+}
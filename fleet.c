@@ -0,0 +1,509 @@
+/**
+ * nmrpflash - Netgear Unbrick Utility
+ * Copyright (C) 2016 Joseph Lehner <joseph.c.lehner@gmail.com>
+ *
+ * nmrpflash is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * nmrpflash is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with nmrpflash.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <ctype.h>
+#include <stdio.h>
+#include "nmrpd.h"
+
+// ports are tracked in a bitmask
+#define FLEET_MAX_PORTS 32
+#define FLEET_MAX_LINE 4096
+// how often idle ports check g_interrupted [ms]
+#define FLEET_POLL_MS 500
+// failed attempts per job, or rounds over all ports without a response,
+// before giving up.
+#define FLEET_RETRIES 3
+
+enum fleet_col
+{
+	COL_MAC,
+	COL_FILE,
+	COL_REGION,
+	COL_OFFSET,
+	COL_REMOTE,
+	COL_COUNT
+};
+
+// these names are part of the manifest format, so don't change them
+static const char *col_names[COL_COUNT] = {
+	[COL_MAC] = "mac",
+	[COL_FILE] = "file",
+	[COL_REGION] = "region",
+	[COL_OFFSET] = "offset",
+	[COL_REMOTE] = "remote",
+};
+
+enum job_state
+{
+	JOB_PENDING,
+	JOB_RUNNING,
+	JOB_OK,
+	JOB_FAILED,
+};
+
+struct fleet_job
+{
+	// line number in the manifest
+	unsigned line;
+	char *cols[COL_COUNT];
+	off_t offset;
+	enum job_state state;
+	// ports on which the device didn't respond, in the current round
+	uint32_t tried;
+	// rounds over all ports without a response
+	unsigned rounds;
+	// failed attempts, other than those without a response
+	unsigned failures;
+	unsigned attempts;
+	int status;
+	int hints;
+	const char *intf;
+	long long elapsed;
+};
+
+struct fleet_port
+{
+	struct fleet *fleet;
+	unsigned index;
+	char ipaddr[INET_ADDRSTRLEN];
+	char ipaddr_intf[INET_ADDRSTRLEN];
+	const char *intf;
+	xthread_t thread;
+};
+
+struct fleet
+{
+	xmutex_t lock;
+	xcond_t cond;
+	struct nmrpd_args *args;
+	struct fleet_job *jobs;
+	unsigned count;
+	// jobs that are neither finished nor failed
+	unsigned left;
+	struct fleet_port *ports;
+	unsigned nports;
+	unsigned retries;
+	FILE *results;
+};
+
+static char *trim(char *s)
+{
+	char *end;
+
+	while (isspace((unsigned char)*s)) {
+		++s;
+	}
+
+	end = s + strlen(s);
+	while (end > s && isspace((unsigned char)end[-1])) {
+		*--end = '\0';
+	}
+
+	return s;
+}
+
+// splits a line into at most `max` comma-separated fields, and returns
+// their number, or -1 if there are more.
+static int split(char *line, char **fields, int max)
+{
+	int n = 0;
+	char *next;
+
+	for (; line; line = next) {
+		if ((next = strchr(line, ','))) {
+			*next++ = '\0';
+		}
+
+		if (n == max) {
+			return -1;
+		}
+
+		fields[n++] = trim(line);
+	}
+
+	return n;
+}
+
+static int fleet_load(struct fleet *f, const char *path)
+{
+	char buf[FLEET_MAX_LINE], *line, *fields[COL_COUNT], *end;
+	int cols[COL_COUNT], ncols, n, i, k;
+	unsigned lineno = 0;
+	struct fleet_job *job;
+	int ret = -1;
+	FILE *fp;
+
+	fp = fopen(path, "r");
+	if (!fp) {
+		fprintf(stderr, "Error opening file '%s': %s.\n", path, strerror(errno));
+		return -1;
+	}
+
+	ncols = 0;
+
+	while (fgets(buf, sizeof(buf), fp)) {
+		++lineno;
+
+		if (!strchr(buf, '\n') && !feof(fp)) {
+			fprintf(stderr, "%s:%u: line too long.\n", path, lineno);
+			goto out;
+		}
+
+		line = trim(buf);
+		if (!*line || *line == '#') {
+			continue;
+		}
+
+		n = split(line, fields, COL_COUNT);
+		if (n < 0) {
+			fprintf(stderr, "%s:%u: too many columns.\n", path, lineno);
+			goto out;
+		}
+
+		if (!ncols) {
+			// the first line names the columns
+			for (i = 0; i < n; ++i) {
+				for (k = 0; k < COL_COUNT && strcasecmp(fields[i], col_names[k]); ++k) {
+					;
+				}
+
+				if (k == COL_COUNT) {
+					fprintf(stderr, "%s:%u: unknown column '%s'.\n", path, lineno, fields[i]);
+					goto out;
+				}
+
+				cols[i] = k;
+			}
+
+			ncols = n;
+
+			for (k = 0; k <= COL_FILE; ++k) {
+				for (i = 0; i < ncols && cols[i] != k; ++i) {
+					;
+				}
+
+				if (i == ncols) {
+					fprintf(stderr, "%s:%u: missing column '%s'.\n", path, lineno, col_names[k]);
+					goto out;
+				}
+			}
+
+			continue;
+		}
+
+		if (n != ncols) {
+			fprintf(stderr, "%s:%u: expected %d columns.\n", path, lineno, ncols);
+			goto out;
+		}
+
+		job = realloc(f->jobs, (f->count + 1) * sizeof(*job));
+		if (!job) {
+			xperror("realloc");
+			goto out;
+		}
+
+		f->jobs = job;
+		job = &f->jobs[f->count++];
+		memset(job, 0, sizeof(*job));
+		job->line = lineno;
+
+		for (i = 0; i < ncols; ++i) {
+			// empty fields use the defaults from the command line
+			if (*fields[i] && !(job->cols[cols[i]] = strdup(fields[i]))) {
+				xperror("strdup");
+				goto out;
+			}
+		}
+
+		if (!job->cols[COL_MAC] || !job->cols[COL_FILE]) {
+			fprintf(stderr, "%s:%u: both mac and file are required.\n", path, lineno);
+			goto out;
+		}
+
+		job->offset = f->args->offset;
+
+		if (job->cols[COL_OFFSET]) {
+			job->offset = strtol(job->cols[COL_OFFSET], &end, 0);
+			if (*end || job->offset < 0) {
+				fprintf(stderr, "%s:%u: invalid offset '%s'.\n", path, lineno, job->cols[COL_OFFSET]);
+				goto out;
+			}
+		}
+	}
+
+	if (ferror(fp)) {
+		xperror("fgets");
+	} else if (!f->count) {
+		fprintf(stderr, "%s: no jobs.\n", path);
+	} else {
+		ret = 0;
+	}
+
+out:
+	fclose(fp);
+	return ret;
+}
+
+static void fleet_result(struct fleet *f, struct fleet_job *job)
+{
+	static const char *states[] = {
+		[JOB_PENDING] = "skipped",
+		[JOB_RUNNING] = "skipped",
+		[JOB_OK] = "ok",
+		[JOB_FAILED] = "failed",
+	};
+
+	if (!f->results) {
+		return;
+	}
+
+	// keep this in sync with the header written by fleet_run
+	fprintf(f->results, "%u,%s,%s,%s,%s,%u,%d,%d,%.3f\n", job->line,
+			job->cols[COL_MAC], job->cols[COL_FILE], states[job->state],
+			job->intf ? job->intf : "", job->attempts, job->status,
+			job->hints, job->elapsed / 1e6);
+	fflush(f->results);
+}
+
+static struct fleet_job *fleet_next(struct fleet *f, unsigned port)
+{
+	unsigned i;
+
+	for (i = 0; i < f->count; ++i) {
+		if (f->jobs[i].state == JOB_PENDING && !(f->jobs[i].tried & (1U << port))) {
+			return &f->jobs[i];
+		}
+	}
+
+	return NULL;
+}
+
+// decides whether to try again, based on what went wrong
+static void fleet_finish(struct fleet *f, struct fleet_job *job,
+		struct nmrpd_args *args, int status, unsigned port)
+{
+	uint32_t all = (f->nports == FLEET_MAX_PORTS) ? ~0U : (1U << f->nports) - 1;
+
+	job->status = status;
+	job->hints = args->hints;
+	job->state = JOB_PENDING;
+
+	if (!job->status) {
+		job->state = JOB_OK;
+	} else if (g_interrupted) {
+		// reported as skipped
+		return;
+	} else if (args->stats.phases[NMRP_PHASE_OPEN] < 0
+			|| (job->hints & NMRP_MAYBE_FIRMWARE_INVALID)) {
+		// bad arguments, an unreadable image, or one that was rejected
+		// by the device: trying again won't help.
+		job->state = JOB_FAILED;
+	} else if (job->hints & (NMRP_NO_NMRP_RESPONSE | NMRP_NO_ETHERNET_CONNECTION)) {
+		// the device is probably connected to another port, or hasn't
+		// been powered on yet.
+		job->tried |= 1U << port;
+		if ((job->tried & all) == all) {
+			job->tried = 0;
+			if (++job->rounds > f->retries) {
+				job->state = JOB_FAILED;
+			}
+		}
+	} else if (++job->failures > f->retries) {
+		job->state = JOB_FAILED;
+	}
+
+	if (job->state != JOB_PENDING) {
+		--f->left;
+		fleet_result(f, job);
+	}
+}
+
+static void *fleet_port_run(void *arg)
+{
+	struct fleet_port *p = arg;
+	struct fleet *f = p->fleet;
+	struct fleet_job *job;
+	struct nmrpd_args args;
+	long long beg;
+	int status;
+
+	xmutex_lock(&f->lock);
+
+	while (f->left && !g_interrupted) {
+		job = fleet_next(f, p->index);
+		if (!job) {
+			// everything left is either running, or has already been
+			// tried on this port in the current round.
+			xcond_timedwait(&f->cond, &f->lock, FLEET_POLL_MS);
+			continue;
+		}
+
+		job->state = JOB_RUNNING;
+		job->intf = p->intf;
+		++job->attempts;
+
+		args = *f->args;
+		args.intf = p->intf;
+		args.ipaddr = p->ipaddr;
+		args.ipaddr_intf = p->ipaddr_intf;
+		args.mac = job->cols[COL_MAC];
+		args.file_local = job->cols[COL_FILE];
+		args.offset = job->offset;
+		if (job->cols[COL_REGION]) {
+			args.region = job->cols[COL_REGION];
+		}
+		if (job->cols[COL_REMOTE]) {
+			args.file_remote = job->cols[COL_REMOTE];
+		}
+
+		printf("%s: flashing %s with %s (attempt %u).\n", p->intf,
+				args.mac, args.file_local, job->attempts);
+
+		xmutex_unlock(&f->lock);
+		beg = micros();
+		status = nmrp_do(&args);
+		xmutex_lock(&f->lock);
+
+		job->elapsed += micros() - beg;
+		fleet_finish(f, job, &args, status, p->index);
+		xcond_broadcast(&f->cond);
+	}
+
+	xcond_broadcast(&f->cond);
+	xmutex_unlock(&f->lock);
+	return NULL;
+}
+
+int fleet_run(struct nmrpd_args *args, const char *manifest, FILE *results)
+{
+	struct fleet f;
+	char *intfs, *intf;
+	const char **names;
+	uint32_t mask;
+	unsigned i, k, ok, started;
+	int ret = 1;
+
+	memset(&f, 0, sizeof(f));
+	f.lock = (xmutex_t)XMUTEX_INITIALIZER;
+	f.cond = (xcond_t)XCOND_INITIALIZER;
+	f.args = args;
+	f.retries = FLEET_RETRIES;
+	f.results = results;
+
+	if (args->ipaddr || args->ipaddr_intf) {
+		fprintf(stderr, "Error: cannot use -a or -A with a manifest.\n");
+		return 1;
+	}
+
+	mask = inet_addr(args->ipmask);
+	if (mask == INADDR_NONE || !mask) {
+		fprintf(stderr, "Invalid subnet mask '%s'.\n", args->ipmask);
+		return 1;
+	}
+
+	intfs = strdup(args->intf);
+	names = calloc(FLEET_MAX_PORTS, sizeof(*names));
+	f.ports = calloc(FLEET_MAX_PORTS, sizeof(*f.ports));
+	if (!intfs || !names || !f.ports) {
+		xperror("calloc");
+		goto out;
+	}
+
+	if (fleet_load(&f, manifest) != 0) {
+		goto out;
+	}
+
+	f.left = f.count;
+
+	for (intf = strtok(intfs, ","); intf; intf = strtok(NULL, ",")) {
+		struct fleet_port *p;
+
+		if (f.nports == FLEET_MAX_PORTS) {
+			fprintf(stderr, "Error: too many interfaces (max %d).\n", FLEET_MAX_PORTS);
+			goto out;
+		}
+
+		p = &f.ports[f.nports];
+		p->fleet = &f;
+		p->index = f.nports;
+		p->intf = names[f.nports] = intf;
+		subnet_addrs(mask, f.nports, p->ipaddr, p->ipaddr_intf);
+		++f.nports;
+	}
+
+	if (f.nports > 1) {
+		// concurrent progress displays would overwrite each other
+		args->quiet = true;
+	}
+
+	if (results) {
+		fprintf(results, "line,mac,file,result,interface,attempts,status,hints,elapsed_s\n");
+		fflush(results);
+	}
+
+#ifdef NMRPFLASH_LINUX
+	nm_unmanage(names, f.nports);
+#endif
+
+	for (started = 0; started < f.nports; ++started) {
+		if (xthread_create(&f.ports[started].thread, &fleet_port_run, &f.ports[started]) != 0) {
+			g_interrupted = 1;
+			break;
+		}
+	}
+
+	for (i = 0; i < started; ++i) {
+		xthread_join(f.ports[i].thread);
+	}
+
+#ifdef NMRPFLASH_LINUX
+	nm_restore(names, f.nports);
+#endif
+
+	printf("\n");
+
+	for (i = 0, ok = 0; i < f.count; ++i) {
+		struct fleet_job *job = &f.jobs[i];
+
+		if (job->state == JOB_OK) {
+			++ok;
+		} else if (job->state != JOB_FAILED) {
+			fleet_result(&f, job);
+		}
+	}
+
+	printf("%u of %u jobs succeeded.\n", ok, f.count);
+	ret = (ok == f.count) ? 0 : 1;
+
+out:
+	for (i = 0; i < f.count; ++i) {
+		for (k = 0; k < COL_COUNT; ++k) {
+			free(f.jobs[i].cols[k]);
+		}
+	}
+
+	free(f.jobs);
+	free(f.ports);
+	free(names);
+	free(intfs);
+	return ret;
+}
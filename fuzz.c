@@ -1,26 +1,210 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
 #include "nmrpd.h"
 
-int main(int argc, char** argv)
+// NMRPFLASH_FUZZ_TFTP: the input is the device's side of a TFTP upload of
+// a 4 KiB image, with one packet per (negotiated) blksize + 4 bytes.
+// NMRPFLASH_FUZZ_PARSE: the input is a single NMRP frame, and the same
+// bytes as a TFTP packet; only the parsers are run.
+// NMRPFLASH_FUZZ_CHK: the input is summed by the SSE2 and the scalar .chk
+// checksum code, at every length and alignment, which must agree.
+// otherwise, the input is a sequence of 60 byte NMRP frames, read by
+// nmrp_do.
+//
+// with libFuzzer (NMRPFLASH_LIBFUZZER), or AFL++'s persistent mode, all
+// inputs are run in-process. otherwise, each file given as an argument (or
+// stdin) is run once, or `n` times with -b <n>, to measure execs/s.
+
+static const uint8_t *fuzz_buf;
+static size_t fuzz_len;
+
+ssize_t fuzz_read(void *buf, size_t len)
 {
-	verbosity = 2;
+	len = MIN(len, fuzz_len);
+	memcpy(buf, fuzz_buf, len);
+	fuzz_buf += len;
+	fuzz_len -= len;
+	return len;
+}
+
+bool fuzz_pending(void)
+{
+	return fuzz_len > 0;
+}
 
+static int fuzz_one(const uint8_t *buf, size_t len)
+{
+#if !defined(NMRPFLASH_FUZZ_PARSE) && !defined(NMRPFLASH_FUZZ_CHK)
 	struct nmrpd_args args = {
 		.rx_timeout = 60,
 		.ul_timeout = 60,
 		.ipaddr = "10.10.10.10",
+		// so that the (missing) interface address isn't checked
+		.ipaddr_intf = "10.10.10.11",
 		.ipmask = "255.255.255.0",
 		.mac = "ff:ff:ff:ff:ff:ff",
 		.op = NMRP_UPLOAD_FW,
 		.port = 69,
+		.quiet = true,
 	};
+#endif
 #ifdef NMRPFLASH_FUZZ_TFTP
-	if (argc != 2) {
+	static uint8_t image[4096];
+	struct image *img;
+	int status;
+#endif
+
+	fuzz_buf = buf;
+	fuzz_len = len;
+	g_interrupted = 0;
+
+#if defined(NMRPFLASH_FUZZ_PARSE)
+	nmrp_fuzz_pkt(buf, len);
+	tftp_fuzz_pkt(buf, len);
+	return 0;
+#elif defined(NMRPFLASH_FUZZ_CHK)
+	chk_fuzz_sum(buf, len);
+	return 0;
+#elif defined(NMRPFLASH_FUZZ_TFTP)
+	if (!(img = image_from_buf(image, sizeof(image)))) {
 		return 1;
 	}
-	args.file_local = argv[1];
 
-	return tftp_put(&args);
+	args.image = img;
+	args.file_local = "firmware";
+	status = tftp_put(&args);
+	image_close(img);
+	return status;
 #else
 	return nmrp_do(&args);
 #endif
 }
+
+#ifdef NMRPFLASH_LIBFUZZER
+int LLVMFuzzerTestOneInput(const uint8_t *buf, size_t len)
+{
+	verbosity = 0;
+	fuzz_one(buf, len);
+	return 0;
+}
+#else
+#ifdef __AFL_FUZZ_TESTCASE_LEN
+__AFL_FUZZ_INIT();
+#endif
+
+static uint8_t *fuzz_slurp(int fd, size_t *len)
+{
+	uint8_t *buf = NULL, *p;
+	size_t size = 0;
+	ssize_t n;
+
+	*len = 0;
+
+	do {
+		if (*len == size) {
+			size = size ? size * 2 : 4096;
+			if (!(p = realloc(buf, size))) {
+				xperror("realloc");
+				free(buf);
+				return NULL;
+			}
+			buf = p;
+		}
+
+		n = read(fd, buf + *len, size - *len);
+		if (n < 0) {
+			xperror("read");
+			free(buf);
+			return NULL;
+		}
+
+		*len += n;
+	} while (n);
+
+	return buf;
+}
+
+static int fuzz_file(const char *path, unsigned runs)
+{
+	uint8_t *buf;
+	long long beg;
+	unsigned i;
+	size_t len;
+	int fd, status = 0;
+
+	fd = path ? open(path, O_RDONLY) : STDIN_FILENO;
+	if (fd < 0) {
+		fprintf(stderr, "Error opening '%s': %s.\n", path, strerror(errno));
+		return 1;
+	}
+
+	buf = fuzz_slurp(fd, &len);
+	if (path) {
+		close(fd);
+	}
+
+	if (!buf) {
+		return 1;
+	}
+
+	beg = micros();
+
+	for (i = 0; i < runs; ++i) {
+		status = fuzz_one(buf, len);
+	}
+
+	if (runs > 1) {
+		beg = micros() - beg;
+		fprintf(stderr, "%s: %u runs in %.1f ms (%.0f/s)\n", path ? path : "-",
+				runs, beg / 1000.0, runs * 1e6 / MAX(beg, 1));
+	}
+
+	free(buf);
+	return status;
+}
+
+int main(int argc, char** argv)
+{
+	unsigned runs = 1;
+	int i = 1, status = 0;
+
+	verbosity = 2;
+
+#ifdef __AFL_FUZZ_TESTCASE_LEN
+	__AFL_INIT();
+	const uint8_t *buf = __AFL_FUZZ_TESTCASE_BUF;
+
+	verbosity = 0;
+
+	while (__AFL_LOOP(10000)) {
+		fuzz_one(buf, __AFL_FUZZ_TESTCASE_LEN);
+	}
+
+	return 0;
+#endif
+
+	if (argc > 2 && !strcmp(argv[1], "-b")) {
+		runs = atoi(argv[2]);
+		verbosity = 0;
+		i = 3;
+		// not everything honors verbosity
+		if (!freopen("/dev/null", "w", stdout)) {
+			xperror("freopen");
+			return 1;
+		}
+	}
+
+	if (i == argc) {
+		return fuzz_file(NULL, runs);
+	}
+
+	for (; i < argc; ++i) {
+		status |= fuzz_file(argv[i], runs);
+	}
+
+	return status;
+}
+#endif
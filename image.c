@@ -0,0 +1,305 @@
+/**
+ * nmrpflash - Netgear Unbrick Utility
+ * Copyright (C) 2016 Joseph Lehner <joseph.c.lehner@gmail.com>
+ *
+ * nmrpflash is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * nmrpflash is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with nmrpflash.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <sys/stat.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include "nmrpd.h"
+
+#ifndef NMRPFLASH_WINDOWS
+#include <sys/mman.h>
+#else
+#include <io.h>
+#endif
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+// initial buffer size for files that can't be mapped
+#define IMAGE_READ_SIZE (1024 * 1024)
+
+// images are mapped once per process, and shared by all sessions
+// that use the same file.
+static struct image *images = NULL;
+static xmutex_t images_lock = XMUTEX_INITIALIZER;
+
+// reads at most `max` bytes into a buffer of `size` bytes, which is
+// doubled whenever it fills up. fails if there's more.
+static bool image_read_all(struct image *img, int fd, size_t size, size_t max)
+{
+	ssize_t len;
+	size_t pos = 0;
+	uint8_t *p;
+
+	img->buf = malloc(size ? size : 1);
+	if (!img->buf) {
+		xperror("malloc");
+		return false;
+	}
+
+	while (pos < max) {
+		if (pos == size) {
+			size = MIN(size * 2, max);
+			p = realloc(img->buf, size);
+			if (!p) {
+				xperror("realloc");
+				return false;
+			}
+			img->buf = p;
+		}
+
+		len = read(fd, img->buf + pos, size - pos);
+		if (len < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			xperror("read");
+			return false;
+		} else if (!len) {
+			break;
+		}
+
+		pos += len;
+	}
+
+	if (pos == max) {
+		// make sure we haven't just cut it off
+		uint8_t c;
+		do {
+			len = read(fd, &c, 1);
+		} while (len < 0 && errno == EINTR);
+
+		if (len > 0) {
+			fprintf(stderr, "Error: image too large (more than %zu b).\n", max);
+			return false;
+		}
+	}
+
+	img->base = img->buf;
+	img->len = pos;
+	return true;
+}
+
+static bool image_map(struct image *img, int fd, size_t size)
+{
+	if (!size) {
+		img->base = NULL;
+		img->len = 0;
+		return true;
+	}
+
+#ifndef NMRPFLASH_WINDOWS
+	void *p = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (p == MAP_FAILED) {
+		if (verbosity > 1) {
+			xperror("mmap");
+		}
+		return false;
+	}
+
+#ifdef MADV_SEQUENTIAL
+	madvise(p, size, MADV_SEQUENTIAL);
+	madvise(p, size, MADV_WILLNEED);
+#endif
+#else
+	HANDLE file = (HANDLE)_get_osfhandle(fd);
+	if (file == INVALID_HANDLE_VALUE) {
+		return false;
+	}
+
+	img->mapping = CreateFileMapping(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (!img->mapping) {
+		if (verbosity > 1) {
+			win_perror2("CreateFileMapping", GetLastError());
+		}
+		return false;
+	}
+
+	void *p = MapViewOfFile(img->mapping, FILE_MAP_READ, 0, 0, size);
+	if (!p) {
+		if (verbosity > 1) {
+			win_perror2("MapViewOfFile", GetLastError());
+		}
+		CloseHandle(img->mapping);
+		img->mapping = NULL;
+		return false;
+	}
+#endif
+
+	img->base = p;
+	img->len = size;
+	img->mapped = true;
+	return true;
+}
+
+static void image_free(struct image *img)
+{
+	if (img->mapped) {
+#ifndef NMRPFLASH_WINDOWS
+		munmap((void*)img->base, img->len);
+#else
+		UnmapViewOfFile(img->base);
+		CloseHandle(img->mapping);
+#endif
+	}
+
+	free(img->buf);
+	free(img->path);
+	free(img);
+}
+
+static struct image *image_load(const char *path, off_t offset)
+{
+	struct image *img;
+	struct stat st;
+	bool ok;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_BINARY);
+	if (fd < 0) {
+		fprintf(stderr, "Error accessing file '%s': %s.\n", path, strerror(errno));
+		return NULL;
+	}
+
+	img = calloc(1, sizeof(*img));
+	if (!img) {
+		xperror("calloc");
+		close(fd);
+		return NULL;
+	}
+
+	ok = false;
+
+	img->path = strdup(path);
+	if (!img->path) {
+		xperror("strdup");
+		goto out;
+	}
+
+	if (fstat(fd, &st) < 0) {
+		xperror("fstat");
+		goto out;
+	}
+
+	if (S_ISREG(st.st_mode)) {
+		ok = image_map(img, fd, st.st_size)
+			|| image_read_all(img, fd, st.st_size, st.st_size);
+	} else {
+		// not mappable (e.g. a pipe), so read it into memory, as long as
+		// it's not a monstrosity
+		ok = image_read_all(img, fd, IMAGE_READ_SIZE, IMAGE_MAX_SIZE);
+	}
+
+	if (!ok) {
+		fprintf(stderr, "Error reading file '%s'.\n", path);
+		goto out;
+	}
+
+	if (offset > img->len) {
+		fprintf(stderr, "Error: offset %lld exceeds size of file '%s'.\n",
+				(long long)offset, path);
+		ok = false;
+		goto out;
+	}
+
+	img->offset = offset;
+	img->data = img->base + offset;
+	img->size = img->len - offset;
+	img->refs = 1;
+
+out:
+	close(fd);
+
+	if (!ok) {
+		image_free(img);
+		return NULL;
+	}
+
+	return img;
+}
+
+struct image *image_open(const char *path, off_t offset)
+{
+	struct image *img;
+
+	xmutex_lock(&images_lock);
+
+	for (img = images; img; img = img->next) {
+		if (img->offset == offset && !strcmp(img->path, path)) {
+			++img->refs;
+			break;
+		}
+	}
+
+	if (!img && (img = image_load(path, offset))) {
+		img->next = images;
+		images = img;
+	}
+
+	xmutex_unlock(&images_lock);
+	return img;
+}
+
+struct image *image_from_buf(const void *buf, size_t len)
+{
+	struct image *img = calloc(1, sizeof(*img));
+	if (!img) {
+		xperror("calloc");
+		return NULL;
+	}
+
+	// not added to `images`, as there's no path to share it by
+	img->base = img->data = buf;
+	img->len = img->size = len;
+	img->refs = 1;
+	return img;
+}
+
+void image_close(struct image *img)
+{
+	struct image **p;
+
+	if (!img) {
+		return;
+	}
+
+	xmutex_lock(&images_lock);
+
+	if (--img->refs) {
+		img = NULL;
+	} else {
+		for (p = &images; *p; p = &(*p)->next) {
+			if (*p == img) {
+				*p = img->next;
+				break;
+			}
+		}
+	}
+
+	xmutex_unlock(&images_lock);
+
+	if (img) {
+		image_free(img);
+	}
+}
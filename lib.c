@@ -0,0 +1,157 @@
+/**
+ * nmrpflash - Netgear Unbrick Utility
+ * Copyright (C) 2016 Joseph Lehner <joseph.c.lehner@gmail.com>
+ *
+ * nmrpflash is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * nmrpflash is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with nmrpflash.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include "nmrpd.h"
+
+// the public values are passed through as they are
+typedef char lib_check_phases[(int)NMRPFLASH_PHASE_COUNT == (int)NMRP_PHASE_COUNT ? 1 : -1];
+typedef char lib_check_hints[
+	NMRPFLASH_HINT_FIRMWARE_INVALID == NMRP_MAYBE_FIRMWARE_INVALID
+	&& NMRPFLASH_HINT_NO_ETHERNET == NMRP_NO_ETHERNET_CONNECTION
+	&& NMRPFLASH_HINT_NO_RESPONSE == NMRP_NO_NMRP_RESPONSE
+	&& NMRPFLASH_HINT_TFTP_FAILURE == NMRP_TFTP_XMIT_BLK0_FAILURE ? 1 : -1];
+
+struct nmrpflash_session
+{
+	struct nmrpflash_opts opts;
+	struct nmrpflash_callbacks cb;
+	struct nmrpd_args args;
+	struct nmrp_cancel cancel;
+};
+
+int nmrpflash_init(void)
+{
+#ifdef NMRPFLASH_WINDOWS
+	WSADATA wsa;
+	int err = WSAStartup(MAKEWORD(2, 2), &wsa);
+	if (err != 0) {
+		win_perror2("WSAStartup", err);
+		return -1;
+	}
+#endif
+	return 0;
+}
+
+struct nmrpflash_session *nmrpflash_session_new(const struct nmrpflash_opts *opts,
+		const struct nmrpflash_callbacks *cb)
+{
+	struct nmrpflash_session *s;
+
+	if (!opts->intf) {
+		fprintf(stderr, "Error: no interface specified.\n");
+		return NULL;
+	} else if (!opts->image && !(cb && (cb->read || cb->upload))) {
+		fprintf(stderr, "Error: no image, read or upload callback specified.\n");
+		return NULL;
+	}
+
+	s = calloc(1, sizeof(*s));
+	if (!s) {
+		xperror("calloc");
+		return NULL;
+	}
+
+	s->opts = *opts;
+	if (cb) {
+		s->cb = *cb;
+	}
+
+	stats_init(&s->args.stats);
+	return s;
+}
+
+int nmrpflash_session_run(struct nmrpflash_session *s)
+{
+	struct nmrpd_args *args = &s->args;
+	const struct nmrpflash_opts *opts = &s->opts;
+	struct image *img = NULL;
+	int status;
+
+	memset(args, 0, sizeof(*args));
+	args->rx_timeout = opts->rx_timeout_ms ? opts->rx_timeout_ms : NMRP_DEFAULT_RX_TIMEOUT_MS;
+	args->ul_timeout = opts->ul_timeout_ms ? opts->ul_timeout_ms : NMRP_DEFAULT_UL_TIMEOUT_S * 1000;
+	args->ipaddr = opts->ipaddr;
+	args->ipaddr_intf = opts->ipaddr_intf;
+	args->ipmask = opts->ipmask ? opts->ipmask : NMRP_DEFAULT_SUBNET;
+	args->intf = opts->intf;
+	args->mac = opts->mac ? opts->mac : "ff:ff:ff:ff:ff:ff";
+	args->op = NMRP_UPLOAD_FW;
+	args->port = opts->port ? opts->port : NMRP_DEFAULT_TFTP_PORT;
+	args->region = opts->region;
+	args->file_remote = opts->file_remote;
+	args->adv_burst = NMRP_DEFAULT_ADV_BURST_MS;
+	args->adv_interval = NMRP_DEFAULT_ADV_INTERVAL_MS;
+	args->adv_max_interval = NMRP_DEFAULT_ADV_MAX_INTERVAL_MS;
+	args->quiet = true;
+	args->cb = &s->cb;
+
+	if (opts->image) {
+		img = image_from_buf(opts->image, opts->image_len);
+		if (!img) {
+			return 1;
+		}
+
+		args->image = img;
+		// only used for messages, and as the default remote filename
+		args->file_local = opts->file_remote ? opts->file_remote : "firmware";
+	} else if (s->cb.read) {
+		args->file_local = "-";
+	}
+
+	// earlier cancels and interrupts don't affect this run
+	s->cancel.cancel = 0;
+	s->cancel.interrupts = g_interrupts;
+	g_cancel = &s->cancel;
+
+	status = nmrp_do(args);
+
+	g_cancel = NULL;
+	image_close(img);
+	return status;
+}
+
+int nmrpflash_session_hints(struct nmrpflash_session *s)
+{
+	return s->args.hints;
+}
+
+long long nmrpflash_session_phase_time(struct nmrpflash_session *s,
+		enum nmrpflash_phase phase)
+{
+	return phase < NMRPFLASH_PHASE_COUNT ? s->args.stats.phases[phase] : -1;
+}
+
+void nmrpflash_session_free(struct nmrpflash_session *s)
+{
+	free(s);
+}
+
+void nmrpflash_session_cancel(struct nmrpflash_session *s)
+{
+	s->cancel.cancel = 1;
+}
+
+void nmrpflash_interrupt(void)
+{
+	// g_interrupted would stay set for all later sessions
+	++g_interrupts;
+}
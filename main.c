@@ -19,9 +19,11 @@
 
 #include <unistd.h>
 #include <getopt.h>
+#include <errno.h>
 #include <locale.h>
 #include <stdlib.h>
 #include <locale.h>
+#include <string.h>
 #include <stdio.h>
 #include <pcap.h>
 #include "nmrpd.h"
@@ -35,26 +37,48 @@ int usage(FILE *fp)
 	fprintf(fp,
 			"Usage: nmrpflash [OPTIONS...]\n"
 			"\n"
-			"Options (-i, and -f or -c are mandatory):\n"
+			"Options (-i, and -f, -d or -c are mandatory):\n"
 			" -a <ipaddr>     IP address to assign to target device [%s]\n"
 			" -A <ipaddr>     IP address to assign to selected interface [%s]\n"
+			" -b <size>       Capture buffer size (KiB) [system default]\n"
 			" -B [<timeout>]  Blind mode. Initial timeout (seconds) [%d s]\n"
 			" -c <command>    Command to run before (or instead of) TFTP upload\n"
+			" -d <directory>  Pick the firmware file from this directory, by the filename\n"
+			"                 the device requests, or its board ID\n"
+			" -D <b>,<i>,<m>  Send NMRP advertisements every <i> ms for the first <b> ms\n"
+			"                 after link-up, then back off to every <m> ms [%d,%d,%d]\n"
 			" -f <firmware>   Firmware file\n"
 			" -F <filename>   Remote filename to use during TFTP upload\n"
-			" -i <interface>  Network interface directly connected to device\n"
+			" -i <interface>  Network interface directly connected to device. Use a\n"
+			"                 comma-separated list to flash multiple devices at once\n"
+			" -j <file>       Append statistics (JSON, one line per session) to file\n"
+			" -l              Don't wait for Ethernet link before configuring interface\n"
 			" -m <mac>        MAC address of target device (xx:xx:xx:xx:xx:xx)\n"
 			" -M <netmask>    Subnet mask to assign to target device [%s]\n"
+			" -n              Upload .chk firmware even if its checksums or region\n"
+			"                 don't match\n"
 			" -t <timeout>    Timeout (in milliseconds) for NMRP packets [%d ms]\n"
 			" -T <timeout>    Time (seconds) to wait after successful TFTP upload [%d s]\n"
 			" -p <port>       Port to use for TFTP upload [%d]\n"
+			" -u              Upload using userspace UDP/IP over the NMRP socket, without\n"
+			"                 assigning the -A address to the interface\n"
+#ifdef NMRPFLASH_LINUX
+			" -Q              Interfaces are VLANs on a trunk; receive NMRP frames on the\n"
+			"                 parent interface\n"
+#endif
 #ifdef NMRPFLASH_SET_REGION
 			" -R <region>     Set device region (NA, WW, GR, PR, RU, BZ, IN, KO, JP, AU)\n"
 #endif
+			" -q              Don't show progress\n"
 			" -S <n>          Skip <n> bytes of the firmware file\n"
 			" -v              Be verbose\n"
 			" -V              Print version and exit\n"
 			" -L              List network interfaces\n"
+			" -w <file>       Write all NMRP and TFTP packets to file (pcapng)\n"
+			" -x <manifest>   Flash all devices listed in manifest (CSV), using all\n"
+			"                 interfaces specified by -i\n"
+			" -o <file>       Write the result of each job in -x manifest to file (CSV)\n"
+			" -X <file>       Append the packet trace of each failed session to file\n"
 			" -h              Show this screen\n"
 			"\n"
 			"Example: (run as "
@@ -83,6 +107,9 @@ int usage(FILE *fp)
 			NMRP_DEFAULT_IP_REMOTE,
 			NMRP_DEFAULT_IP_LOCAL,
 			NMRP_DEFAULT_BLIND_TIMEOUT_S,
+			NMRP_DEFAULT_ADV_BURST_MS,
+			NMRP_DEFAULT_ADV_INTERVAL_MS,
+			NMRP_DEFAULT_ADV_MAX_INTERVAL_MS,
 			NMRP_DEFAULT_SUBNET,
 			NMRP_DEFAULT_RX_TIMEOUT_MS,
 			NMRP_DEFAULT_UL_TIMEOUT_S,
@@ -149,6 +176,170 @@ void require_admin()
 }
 #endif
 
+static void sigh(int sig)
+{
+	g_interrupted = 1;
+}
+
+static void print_hints(struct nmrpd_args *args)
+{
+	if (args->hints & NMRP_MAYBE_FIRMWARE_INVALID) {
+		fprintf(stderr,
+				"Firmware file rejected by router. Possible causes:\n"
+				"- Wrong firmware file (model number correct?)\n"
+				"- Wrong file format (e.g. .chk vs .trx file)\n"
+				"- Downgrading to a lower version number\n");
+	} else if (args->hints & NMRP_NO_ETHERNET_CONNECTION) {
+		fprintf(stderr,
+				"No Ethernet connection detected. Possible causes:\n"
+				"- Wrong Ethernet port - try others there's more than one\n"
+				"- Bad Ethernet cable\n"
+				"- Hardware issue\n");
+	} else if ((args->hints & NMRP_NO_NMRP_RESPONSE) && !args->blind_timeout) {
+		fprintf(stderr,
+				"No response from router. Possible causes/fixes:\n"
+				"- Unsupported router\n"
+				"- Wrong Ethernet port - try others if there's more than one\n"
+				"- Hold reset button for a few seconds while powering on router\n"
+				"- Try blind mode (`-B` option)");
+	} else if (args->hints & NMRP_TFTP_XMIT_BLK0_FAILURE) {
+		fprintf(stderr,
+				"Failed to send/receive initial TFTP packet. Possible fixes:\n"
+				"- Disable firewall, or add an exception for nmrpflash\n"
+				"- Manually specify IP addresses using `-a` and/or `-A`\n");
+	}
+}
+
+struct session
+{
+	struct nmrpd_args args;
+	char ipaddr[INET_ADDRSTRLEN];
+	char ipaddr_intf[INET_ADDRSTRLEN];
+	xthread_t thread;
+	int status;
+};
+
+static void *session_run(void *arg)
+{
+	struct session *s = arg;
+	s->status = nmrp_do(&s->args);
+	return NULL;
+}
+
+// runs one NMRP session per interface, each in its own thread
+static int nmrp_do_multi(struct nmrpd_args *args)
+{
+	struct session *sessions;
+	char *intfs, *intf, *next;
+	const char **names;
+	uint32_t mask;
+	int i, count, started, failed;
+
+	if (args->ipaddr || args->ipaddr_intf) {
+		fprintf(stderr, "Error: cannot use -a or -A with multiple interfaces.\n");
+		return 1;
+	}
+
+	mask = inet_addr(args->ipmask);
+	if (mask == INADDR_NONE || !mask) {
+		fprintf(stderr, "Invalid subnet mask '%s'.\n", args->ipmask);
+		return 1;
+	}
+
+	intfs = strdup(args->intf);
+	if (!intfs) {
+		xperror("strdup");
+		return 1;
+	}
+
+	for (count = 1, next = intfs; (next = strchr(next, ',')); ++next) {
+		++count;
+	}
+
+	sessions = calloc(count, sizeof(*sessions));
+	names = calloc(count, sizeof(*names));
+	// remove all addresses and ARP entries in one go, once all sessions
+	// have finished.
+	args->batch = ethsock_batch_new();
+	if (!sessions || !names) {
+		xperror("calloc");
+		free(sessions);
+		free(names);
+		free(intfs);
+		ethsock_batch_commit(args->batch);
+		return 1;
+	}
+
+	for (i = 0, intf = strtok(intfs, ","); intf; intf = strtok(NULL, ","), ++i) {
+		struct session *s = &sessions[i];
+
+		s->args = *args;
+		s->args.intf = intf;
+		names[i] = intf;
+
+		subnet_addrs(mask, i, s->ipaddr, s->ipaddr_intf);
+		s->args.ipaddr = s->ipaddr;
+		s->args.ipaddr_intf = s->ipaddr_intf;
+	}
+
+	count = i;
+
+#ifdef NMRPFLASH_LINUX
+	// one batch for all interfaces, instead of one per session
+	nm_unmanage(names, count);
+#endif
+
+	for (i = 0; i < count; ++i) {
+		struct session *s = &sessions[i];
+
+		if (xthread_create(&s->thread, &session_run, s) != 0) {
+			s->status = -1;
+			g_interrupted = 1;
+			break;
+		}
+	}
+
+	started = i;
+	failed = 0;
+
+	for (i = 0; i < started; ++i) {
+		xthread_join(sessions[i].thread);
+	}
+
+	ethsock_batch_commit(args->batch);
+	args->batch = NULL;
+
+#ifdef NMRPFLASH_LINUX
+	nm_restore(names, count);
+#endif
+
+	printf("\n");
+
+	for (i = 0; i < count; ++i) {
+		struct session *s = &sessions[i];
+
+		if (i >= started) {
+			++failed;
+			fprintf(stderr, "%s: not started.\n", s->args.intf);
+		} else if (!s->status) {
+			printf("%s: OK\n", s->args.intf);
+		} else {
+			++failed;
+			fprintf(stderr, "%s: failed.\n", s->args.intf);
+			if (!g_interrupted && s->args.hints) {
+				print_hints(&s->args);
+				fprintf(stderr, "\n");
+			}
+		}
+	}
+
+	free(sessions);
+	free(names);
+	free(intfs);
+
+	return failed ? 1 : 0;
+}
+
 void print_version()
 {
 	printf("nmrpflash %s", NMRPFLASH_VERSION);
@@ -213,6 +404,13 @@ int main(int argc, char **argv)
 {
 	int c, val, max;
 	bool list = false, have_dest_mac = false;
+	const char *stats_file = NULL;
+	const char *trace_file = NULL;
+	const char *capture_file = NULL;
+	const char *manifest = NULL;
+	const char *results_file = NULL;
+	const char *catalog_dir = NULL;
+	FILE *results = NULL;
 	struct nmrpd_args args = {
 		.rx_timeout = NMRP_DEFAULT_RX_TIMEOUT_MS,
 		.ul_timeout = NMRP_DEFAULT_UL_TIMEOUT_S * 1000,
@@ -228,6 +426,9 @@ int main(int argc, char **argv)
 		.port = NMRP_DEFAULT_TFTP_PORT,
 		.region = NULL,
 		.blind_timeout = 0,
+		.adv_burst = NMRP_DEFAULT_ADV_BURST_MS,
+		.adv_interval = NMRP_DEFAULT_ADV_INTERVAL_MS,
+		.adv_max_interval = NMRP_DEFAULT_ADV_MAX_INTERVAL_MS,
 		.offset = 0,
 	};
 
@@ -272,7 +473,7 @@ int main(int argc, char **argv)
 
 	opterr = 0;
 
-	while ((c = getopt(argc, argv, ":a:A:Bc:f:F:i:m:M:p:R:S:t:T:hLVvU")) != -1) {
+	while ((c = getopt(argc, argv, ":a:A:b:Bc:d:D:f:F:i:j:lm:M:no:p:qQR:S:t:T:uw:x:X:hLVvU")) != -1) {
 		switch (c) {
 			case 'a':
 				args.ipaddr = optarg;
@@ -283,6 +484,17 @@ int main(int argc, char **argv)
 			case 'c':
 				args.tftpcmd = optarg;
 				break;
+			case 'd':
+				catalog_dir = optarg;
+				break;
+			case 'D':
+				if (sscanf(optarg, "%u,%u,%u", &args.adv_burst, &args.adv_interval,
+							&args.adv_max_interval) != 3 || !args.adv_interval
+						|| args.adv_max_interval < args.adv_interval) {
+					fprintf(stderr, "Invalid value for -D.\n");
+					return 1;
+				}
+				break;
 			case 'f':
 				args.file_local = optarg;
 				break;
@@ -292,6 +504,9 @@ int main(int argc, char **argv)
 			case 'i':
 				args.intf = optarg;
 				break;
+			case 'j':
+				stats_file = optarg;
+				break;
 			case 'm':
 				args.mac = optarg;
 				have_dest_mac = true;
@@ -299,11 +514,15 @@ int main(int argc, char **argv)
 			case 'M':
 				args.ipmask = optarg;
 				break;
+			case 'n':
+				args.no_check = true;
+				break;
 #ifdef NMRPFLASH_SET_REGION
 			case 'R':
 				args.region = optarg;
 				break;
 #endif
+			case 'b':
 			case 'B':
 			case 'p':
 			case 'S':
@@ -311,6 +530,8 @@ int main(int argc, char **argv)
 			case 't':
 				if (c == 'p') {
 					max = 0xffff;
+				} else if (c == 'b') {
+					max = 0x3fffff;
 				} else {
 					max = 0x7fffffff;
 				}
@@ -331,6 +552,8 @@ int main(int argc, char **argv)
 
 				if (c == 'B') {
 					args.blind_timeout = val;
+				} else if (c == 'b') {
+					args.bufsize = val * 1024;
 				} else if (c == 'p') {
 					args.port = val;
 				} else if (c == 't') {
@@ -348,9 +571,33 @@ int main(int argc, char **argv)
 			case 'v':
 				++verbosity;
 				break;
+			case 'q':
+				args.quiet = true;
+				break;
 			case 'L':
 				list = true;
 				break;
+			case 'l':
+				args.adv_early = true;
+				break;
+			case 'Q':
+				args.trunk = true;
+				break;
+			case 'u':
+				args.raw_tftp = true;
+				break;
+			case 'w':
+				capture_file = optarg;
+				break;
+			case 'x':
+				manifest = optarg;
+				break;
+			case 'X':
+				trace_file = optarg;
+				break;
+			case 'o':
+				results_file = optarg;
+				break;
 			case 'h':
 				return usage(stdout);
 			case ':':
@@ -373,13 +620,28 @@ int main(int argc, char **argv)
 		return 1;
 	}
 
+	if (manifest && (have_dest_mac || args.file_local || args.blind_timeout)) {
+		fprintf(stderr, "Error: cannot use -m, -f or -B with -x <manifest>.\n");
+		return 1;
+	}
+
+	if (catalog_dir && (args.file_local || manifest || args.offset)) {
+		fprintf(stderr, "Error: cannot use -f, -x or -S with -d <directory>.\n");
+		return 1;
+	}
+
+	if (results_file && !manifest) {
+		fprintf(stderr, "Error: cannot use -o <file> without using -x <manifest>.\n");
+		return 1;
+	}
+
 	if (args.blind_timeout && !have_dest_mac) {
 		fprintf(stderr, "Error: use of -B requires -m <mac>.\n");
 		return 1;
 	}
 
 #ifndef NMRPFLASH_FUZZ
-	if (!list && ((!args.file_local && !args.tftpcmd) || !args.intf)) {
+	if (!list && ((!args.file_local && !args.tftpcmd && !manifest && !catalog_dir) || !args.intf)) {
 		return usage(stderr);
 	}
 
@@ -390,35 +652,74 @@ int main(int argc, char **argv)
 	if (list) {
 		val = ethsock_list_all();
 	} else {
-		val = nmrp_do(&args);
-		if (val != 0 && !g_interrupted && args.hints) {
-			fprintf(stderr, "\n");
-			if (args.hints & NMRP_MAYBE_FIRMWARE_INVALID) {
-				fprintf(stderr,
-						"Firmware file rejected by router. Possible causes:\n"
-						"- Wrong firmware file (model number correct?)\n"
-						"- Wrong file format (e.g. .chk vs .trx file)\n"
-						"- Downgrading to a lower version number\n");
-			} else if (args.hints & NMRP_NO_ETHERNET_CONNECTION) {
-				fprintf(stderr,
-						"No Ethernet connection detected. Possible causes:\n"
-						"- Wrong Ethernet port - try others there's more than one\n"
-						"- Bad Ethernet cable\n"
-						"- Hardware issue\n");
-			} else if ((args.hints & NMRP_NO_NMRP_RESPONSE) && !args.blind_timeout) {
-				fprintf(stderr,
-						"No response from router. Possible causes/fixes:\n"
-						"- Unsupported router\n"
-						"- Wrong Ethernet port - try others if there's more than one\n"
-						"- Hold reset button for a few seconds while powering on router\n"
-						"- Try blind mode (`-B` option)");
-			} else if (args.hints & NMRP_TFTP_XMIT_BLK0_FAILURE) {
-				fprintf(stderr,
-						"Failed to send/receive initial TFTP packet. Possible fixes:\n"
-						"- Disable firewall, or add an exception for nmrpflash\n"
-						"- Manually specify IP addresses using `-a` and/or `-A`\n");
+		if (catalog_dir && !(args.catalog = catalog_open(catalog_dir, args.no_check))) {
+			return 1;
+		}
+
+		if (stats_file) {
+			args.stats_fp = strcmp(stats_file, "-") ? fopen(stats_file, "a") : stdout;
+			if (!args.stats_fp) {
+				fprintf(stderr, "Error opening file '%s': %s.\n", stats_file, strerror(errno));
+				val = 1;
+				goto cleanup;
 			}
 		}
+
+		if (trace_file) {
+			args.trace_fp = strcmp(trace_file, "-") ? fopen(trace_file, "a") : stderr;
+			if (!args.trace_fp) {
+				fprintf(stderr, "Error opening file '%s': %s.\n", trace_file, strerror(errno));
+				val = 1;
+				goto cleanup;
+			}
+		}
+
+		if (results_file) {
+			results = strcmp(results_file, "-") ? fopen(results_file, "w") : stdout;
+			if (!results) {
+				fprintf(stderr, "Error opening file '%s': %s.\n", results_file, strerror(errno));
+				val = 1;
+				goto cleanup;
+			}
+		}
+
+		if (capture_file && !(args.capture = capture_open(capture_file))) {
+			val = 1;
+			goto cleanup;
+		}
+
+		signal(SIGINT, sigh);
+
+		if (manifest) {
+			val = fleet_run(&args, manifest, results);
+		} else if (args.intf && strchr(args.intf, ',')) {
+			val = nmrp_do_multi(&args);
+		} else {
+			val = nmrp_do(&args);
+			if (val != 0 && !g_interrupted && args.hints) {
+				fprintf(stderr, "\n");
+				print_hints(&args);
+			}
+		}
+
+		if (capture_close(args.capture) != 0 && !val) {
+			val = 1;
+		}
+
+cleanup:
+		catalog_close(args.catalog);
+
+		if (args.stats_fp && args.stats_fp != stdout) {
+			fclose(args.stats_fp);
+		}
+
+		if (args.trace_fp && args.trace_fp != stderr) {
+			fclose(args.trace_fp);
+		}
+
+		if (results && results != stdout) {
+			fclose(results);
+		}
 	}
 
 	return val;
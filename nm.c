@@ -0,0 +1,781 @@
+/**
+ * nmrpflash - Netgear Unbrick Utility
+ * Copyright (C) 2016 Joseph Lehner <joseph.c.lehner@gmail.com>
+ *
+ * nmrpflash is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * nmrpflash is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with nmrpflash.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "nmrpd.h"
+
+#ifdef NMRPFLASH_LINUX
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <net/if.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <errno.h>
+
+// NetworkManager control, using a minimal D-Bus client that speaks just
+// enough of the protocol to get and set the "Managed" property of a
+// device. the system bus is connected once per process, and requests
+// for multiple interfaces are pipelined.
+
+#define DBUS_SYSTEM_BUS_PATH "/run/dbus/system_bus_socket"
+#define DBUS_TIMEOUT_MS 2000
+#define DBUS_MAX_MSG_LEN 65536
+
+#define NM_DEST "org.freedesktop.NetworkManager"
+#define NM_PATH "/org/freedesktop/NetworkManager"
+#define NM_DEVICE_IFACE NM_DEST ".Device"
+#define DBUS_PROPS_IFACE "org.freedesktop.DBus.Properties"
+
+#define NM_MAX_BATCH 64
+
+enum dbus_msg_type {
+	DBUS_METHOD_CALL = 1,
+	DBUS_METHOD_RETURN = 2,
+	DBUS_ERROR = 3,
+	DBUS_SIGNAL = 4
+};
+
+enum dbus_hdr_field {
+	DBUS_HDR_PATH = 1,
+	DBUS_HDR_INTERFACE = 2,
+	DBUS_HDR_MEMBER = 3,
+	DBUS_HDR_ERROR_NAME = 4,
+	DBUS_HDR_REPLY_SERIAL = 5,
+	DBUS_HDR_DESTINATION = 6,
+	DBUS_HDR_SIGNATURE = 8
+};
+
+struct dbus_buf
+{
+	uint8_t buf[512];
+	size_t len;
+	bool overflow;
+};
+
+struct dbus_reply
+{
+	uint32_t serial;
+	bool error;
+	// only the first argument is decoded
+	char sig[8];
+	union {
+		char str[128];
+		bool b;
+	} val;
+};
+
+struct nm_dev
+{
+	char intf[IFNAMSIZ];
+	char path[128];
+	unsigned refs;
+	struct nm_dev *next;
+};
+
+static struct {
+	int fd;
+	uint32_t serial;
+	bool connected;
+	// set after the first connection attempt, successful or not
+	bool tried;
+	// set once connected; if the first attempt failed, there's no
+	// system bus, and we don't try again.
+	bool reachable;
+	// interfaces on which we've disabled NetworkManager
+	struct nm_dev *devs;
+	// interfaces that NetworkManager doesn't manage, so that they're
+	// only queried once per process
+	struct nm_dev *unmanaged;
+} nm = { .fd = -1 };
+
+static xmutex_t nm_lock = XMUTEX_INITIALIZER;
+
+static inline char dbus_endian()
+{
+	const uint16_t one = 1;
+	return *(const uint8_t*)&one ? 'l' : 'B';
+}
+
+static void db_align(struct dbus_buf *b, size_t a)
+{
+	while (b->len % a) {
+		if (b->len >= sizeof(b->buf)) {
+			b->overflow = true;
+			return;
+		}
+		b->buf[b->len++] = 0;
+	}
+}
+
+static void db_put(struct dbus_buf *b, const void *p, size_t len)
+{
+	if (b->len + len > sizeof(b->buf)) {
+		b->overflow = true;
+		return;
+	}
+
+	memcpy(b->buf + b->len, p, len);
+	b->len += len;
+}
+
+static void db_u8(struct dbus_buf *b, uint8_t v)
+{
+	db_put(b, &v, 1);
+}
+
+static void db_u32(struct dbus_buf *b, uint32_t v)
+{
+	db_align(b, 4);
+	db_put(b, &v, 4);
+}
+
+// 's' or 'o'
+static void db_str(struct dbus_buf *b, const char *s)
+{
+	uint32_t len = strlen(s);
+	db_u32(b, len);
+	db_put(b, s, len + 1);
+}
+
+// 'g'
+static void db_sig(struct dbus_buf *b, const char *s)
+{
+	db_u8(b, strlen(s));
+	db_put(b, s, strlen(s) + 1);
+}
+
+static void db_field_str(struct dbus_buf *b, uint8_t code, const char *type, const char *val)
+{
+	db_align(b, 8);
+	db_u8(b, code);
+	db_sig(b, type);
+	if (*type == 'g') {
+		db_sig(b, val);
+	} else {
+		db_str(b, val);
+	}
+}
+
+static int dbus_write(const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+	ssize_t n;
+
+	while (len) {
+		n = send(nm.fd, p, len, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			xperror("send");
+			return -1;
+		}
+
+		p += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+static int dbus_read(void *buf, size_t len)
+{
+	uint8_t *p = buf;
+	ssize_t n;
+	int status;
+
+	while (len) {
+		status = select_fd(nm.fd, DBUS_TIMEOUT_MS);
+		if (status <= 0) {
+			if (!status) {
+				fprintf(stderr, "Timeout while talking to D-Bus.\n");
+			}
+			return -1;
+		}
+
+		n = recv(nm.fd, p, len, 0);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			xperror("recv");
+			return -1;
+		} else if (!n) {
+			fprintf(stderr, "Error: D-Bus closed the connection.\n");
+			return -1;
+		}
+
+		p += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+static int dbus_read_line(char *buf, size_t size)
+{
+	size_t i;
+
+	for (i = 0; i < size - 1; ++i) {
+		if (dbus_read(buf + i, 1) != 0) {
+			return -1;
+		} else if (buf[i] == '\n') {
+			break;
+		}
+	}
+
+	buf[i] = '\0';
+	return 0;
+}
+
+static int dbus_call(const char *dest, const char *path, const char *iface,
+		const char *member, const char *sig, const struct dbus_buf *body,
+		uint32_t *serial)
+{
+	struct dbus_buf msg = { .len = 0 };
+	uint32_t fields_len;
+
+	db_u8(&msg, dbus_endian());
+	db_u8(&msg, DBUS_METHOD_CALL);
+	db_u8(&msg, 0);
+	db_u8(&msg, 1);
+	db_u32(&msg, body ? body->len : 0);
+	db_u32(&msg, *serial = ++nm.serial);
+	// length of header fields array, patched below
+	db_u32(&msg, 0);
+
+	db_field_str(&msg, DBUS_HDR_PATH, "o", path);
+	db_field_str(&msg, DBUS_HDR_MEMBER, "s", member);
+	if (iface) {
+		db_field_str(&msg, DBUS_HDR_INTERFACE, "s", iface);
+	}
+	db_field_str(&msg, DBUS_HDR_DESTINATION, "s", dest);
+	if (sig && *sig) {
+		db_field_str(&msg, DBUS_HDR_SIGNATURE, "g", sig);
+	}
+
+	fields_len = msg.len - 16;
+	memcpy(msg.buf + 12, &fields_len, 4);
+	db_align(&msg, 8);
+
+	if (body) {
+		db_put(&msg, body->buf, body->len);
+	}
+
+	if (msg.overflow || (body && body->overflow)) {
+		fprintf(stderr, "Error: D-Bus message too long.\n");
+		return -1;
+	}
+
+	return dbus_write(msg.buf, msg.len);
+}
+
+// reads a uint32 in the message's byte order
+static uint32_t dbus_get_u32(const uint8_t *p, bool swap)
+{
+	uint32_t val;
+
+	memcpy(&val, p, 4);
+	if (swap) {
+		val = (val >> 24) | ((val >> 8) & 0xff00) | ((val << 8) & 0xff0000) | (val << 24);
+	}
+
+	return val;
+}
+
+// decodes the first argument, if it's a string, object path, or a
+// variant containing a boolean.
+static void dbus_decode_arg(struct dbus_reply *r, const uint8_t *body, size_t len, bool swap)
+{
+	uint32_t slen;
+
+	if (r->sig[0] == 's' || r->sig[0] == 'o') {
+		if (len < 4) {
+			return;
+		}
+		slen = dbus_get_u32(body, swap);
+		// the string is followed by a NUL
+		if (slen >= len - 4) {
+			return;
+		}
+		snprintf(r->val.str, sizeof(r->val.str), "%.*s", (int)slen, body + 4);
+	} else if (r->sig[0] == 'v') {
+		// variant: signature, then the value
+		if (len < 8 || body[0] != 1 || body[1] != 'b') {
+			return;
+		}
+		r->val.b = dbus_get_u32(body + 4, swap) != 0;
+		r->sig[1] = 'b';
+		r->sig[2] = '\0';
+	}
+}
+
+// reads the next message. returns 1 if it's a reply, 0 if it should be
+// ignored (e.g. a signal), or -1 on error.
+static int dbus_read_msg(struct dbus_reply *r)
+{
+	uint8_t hdr[16], *msg = NULL;
+	uint32_t body_len, fields_len, val;
+	size_t pos, end, total;
+	bool swap;
+	int ret = -1;
+
+	if (dbus_read(hdr, sizeof(hdr)) != 0) {
+		return -1;
+	}
+
+	if (hdr[0] != 'l' && hdr[0] != 'B') {
+		fprintf(stderr, "Error: invalid D-Bus byte order.\n");
+		return -1;
+	}
+
+	swap = hdr[0] != dbus_endian();
+	body_len = dbus_get_u32(hdr + 4, swap);
+	fields_len = dbus_get_u32(hdr + 12, swap);
+
+	if (fields_len > DBUS_MAX_MSG_LEN || body_len > DBUS_MAX_MSG_LEN) {
+		fprintf(stderr, "Error: D-Bus message too long.\n");
+		return -1;
+	}
+
+	total = ((16 + (size_t)fields_len + 7) & ~7) + body_len;
+	if (total > DBUS_MAX_MSG_LEN) {
+		fprintf(stderr, "Error: D-Bus message too long.\n");
+		return -1;
+	}
+
+	msg = malloc(total);
+	if (!msg) {
+		xperror("malloc");
+		return -1;
+	}
+
+	memcpy(msg, hdr, 16);
+	if (dbus_read(msg + 16, total - 16) != 0) {
+		goto out;
+	}
+
+	if (hdr[1] != DBUS_METHOD_RETURN && hdr[1] != DBUS_ERROR) {
+		ret = 0;
+		goto out;
+	}
+
+	memset(r, 0, sizeof(*r));
+	r->error = hdr[1] == DBUS_ERROR;
+
+	// walk header fields; each is a struct of (byte, variant). every
+	// length is checked against end before it's used, since they
+	// come straight from the wire.
+	pos = 16;
+	end = 16 + fields_len;
+	while (pos + 4 <= end) {
+		uint8_t code = msg[pos];
+		uint8_t slen = msg[pos + 1];
+		char type = msg[pos + 2];
+
+		// the variant's signature is a single type code
+		if (slen != 1 || msg[pos + 3]) {
+			break;
+		}
+
+		pos += 4;
+
+		if (type == 'u') {
+			pos = (pos + 3) & ~3;
+			if (pos + 4 > end) {
+				break;
+			}
+			val = dbus_get_u32(msg + pos, swap);
+			if (code == DBUS_HDR_REPLY_SERIAL) {
+				r->serial = val;
+			}
+			pos += 4;
+		} else if (type == 'g') {
+			if (pos >= end) {
+				break;
+			}
+			slen = msg[pos];
+			if (slen + 2 > end - pos) {
+				break;
+			}
+			if (code == DBUS_HDR_SIGNATURE) {
+				snprintf(r->sig, sizeof(r->sig), "%.*s", slen, msg + pos + 1);
+			}
+			pos += 1 + slen + 1;
+		} else if (type == 's' || type == 'o') {
+			pos = (pos + 3) & ~3;
+			if (pos + 4 > end) {
+				break;
+			}
+			val = dbus_get_u32(msg + pos, swap);
+			if (val >= end - pos - 4) {
+				break;
+			}
+			pos += 4 + val + 1;
+		} else {
+			break;
+		}
+
+		pos = (pos + 7) & ~7;
+	}
+
+	pos = (16 + fields_len + 7) & ~7;
+	dbus_decode_arg(r, msg + pos, body_len, swap);
+	ret = 1;
+
+out:
+	free(msg);
+	return ret;
+}
+
+// waits for the replies to all `serials`, in any order
+static int dbus_replies(const uint32_t *serials, struct dbus_reply *replies, size_t count)
+{
+	struct dbus_reply r;
+	size_t i, left = count;
+	int status;
+
+	for (i = 0; i < count; ++i) {
+		replies[i].serial = 0;
+	}
+
+	while (left) {
+		status = dbus_read_msg(&r);
+		if (status < 0) {
+			return -1;
+		} else if (!status) {
+			continue;
+		}
+
+		for (i = 0; i < count; ++i) {
+			if (serials[i] == r.serial && !replies[i].serial) {
+				replies[i] = r;
+				--left;
+				break;
+			}
+		}
+	}
+
+	return 0;
+}
+
+static void dbus_disconnect()
+{
+	if (nm.fd >= 0) {
+		close(nm.fd);
+	}
+
+	nm.fd = -1;
+	nm.connected = false;
+}
+
+static bool dbus_connect()
+{
+	struct sockaddr_un sun;
+	struct dbus_reply r;
+	const char *addr;
+	char line[128];
+	uint32_t serial;
+	char uid[16];
+	size_t i;
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+
+	addr = getenv("DBUS_SYSTEM_BUS_ADDRESS");
+	if (addr && !strncmp(addr, "unix:path=", 10)) {
+		snprintf(sun.sun_path, sizeof(sun.sun_path), "%s", addr + 10);
+		// ignore any further key=value pairs
+		sun.sun_path[strcspn(sun.sun_path, ",")] = '\0';
+	} else {
+		snprintf(sun.sun_path, sizeof(sun.sun_path), "%s", DBUS_SYSTEM_BUS_PATH);
+	}
+
+	nm.fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (nm.fd < 0) {
+		xperror("socket");
+		return false;
+	}
+
+	if (connect(nm.fd, (struct sockaddr*)&sun, sizeof(sun)) != 0) {
+		// no system bus, so no NetworkManager either
+		if (verbosity > 1) {
+			xperror("connect");
+		}
+		goto err;
+	}
+
+	// SASL EXTERNAL authentication, using our uid
+	snprintf(uid, sizeof(uid), "%u", (unsigned)getuid());
+	line[0] = '\0';
+	i = 1 + sprintf(line + 1, "AUTH EXTERNAL ");
+	for (const char *p = uid; *p && i < sizeof(line) - 3; ++p, i += 2) {
+		snprintf(line + i, 3, "%02x", *p);
+	}
+	memcpy(line + i, "\r\n", 2);
+
+	if (dbus_write(line, i + 2) != 0 || dbus_read_line(line, sizeof(line)) != 0) {
+		goto err;
+	}
+
+	if (strncmp(line, "OK ", 3)) {
+		fprintf(stderr, "Error: D-Bus authentication failed.\n");
+		goto err;
+	}
+
+	if (dbus_write("BEGIN\r\n", 7) != 0) {
+		goto err;
+	}
+
+	if (dbus_call("org.freedesktop.DBus", "/org/freedesktop/DBus",
+				"org.freedesktop.DBus", "Hello", NULL, NULL, &serial) != 0
+			|| dbus_replies(&serial, &r, 1) != 0 || r.error) {
+		goto err;
+	}
+
+	nm.connected = true;
+	nm.reachable = true;
+	return true;
+
+err:
+	dbus_disconnect();
+	return false;
+}
+
+// reconnects if a previous error closed the connection
+static bool nm_ensure_connected()
+{
+	if (!nm.connected && (!nm.tried || nm.reachable)) {
+		nm.tried = true;
+		dbus_connect();
+	}
+
+	return nm.connected;
+}
+
+static struct nm_dev *nm_find(struct nm_dev *dev, const char *intf)
+{
+	for (; dev; dev = dev->next) {
+		if (!strcmp(dev->intf, intf)) {
+			return dev;
+		}
+	}
+
+	return NULL;
+}
+
+static int nm_call_props(const char *path, const char *member, const char *prop,
+		int value, uint32_t *serial)
+{
+	struct dbus_buf body = { .len = 0 };
+
+	db_str(&body, NM_DEVICE_IFACE);
+	db_str(&body, prop);
+	if (value >= 0) {
+		db_sig(&body, "b");
+		db_u32(&body, value);
+	}
+
+	return dbus_call(NM_DEST, path, DBUS_PROPS_IFACE, member,
+			value >= 0 ? "ssv" : "ss", &body, serial);
+}
+
+static int nm_set_managed(struct nm_dev **devs, size_t count, bool managed)
+{
+	struct dbus_reply replies[NM_MAX_BATCH];
+	uint32_t serials[NM_MAX_BATCH];
+	size_t i;
+	int err = 0;
+
+	for (i = 0; i < count; ++i) {
+		if (nm_call_props(devs[i]->path, "Set", "Managed", managed, &serials[i]) != 0) {
+			return -1;
+		}
+	}
+
+	if (dbus_replies(serials, replies, count) != 0) {
+		return -1;
+	}
+
+	for (i = 0; i < count; ++i) {
+		if (replies[i].error) {
+			printf("Warning: failed to %s NetworkManager on %s\n",
+					managed ? "re-enable" : "temporarily disable", devs[i]->intf);
+			devs[i]->path[0] = '\0';
+			err = 1;
+		} else if (verbosity > 1) {
+			printf("%s NetworkManager on %s.\n", managed ? "Re-enabling" :
+					"Temporarily disabling", devs[i]->intf);
+		}
+	}
+
+	return err;
+}
+
+int nm_unmanage(const char **intfs, size_t count)
+{
+	struct nm_dev *devs[NM_MAX_BATCH], *known[NM_MAX_BATCH], *set[NM_MAX_BATCH], *dev;
+	struct dbus_reply replies[NM_MAX_BATCH];
+	uint32_t serials[NM_MAX_BATCH];
+	size_t i, n = 0, k = 0, m = 0;
+	int ret = -1;
+
+	xmutex_lock(&nm_lock);
+
+	if (!nm_ensure_connected()) {
+		ret = 0;
+		goto out;
+	}
+
+	count = MIN(count, NM_MAX_BATCH);
+
+	for (i = 0; i < count; ++i) {
+		if ((dev = nm_find(nm.devs, intfs[i]))) {
+			++dev->refs;
+			continue;
+		} else if (nm_find(nm.unmanaged, intfs[i])) {
+			continue;
+		}
+
+		dev = calloc(1, sizeof(*dev));
+		if (!dev) {
+			xperror("calloc");
+			goto cleanup;
+		}
+
+		snprintf(dev->intf, sizeof(dev->intf), "%s", intfs[i]);
+		devs[n++] = dev;
+	}
+
+	// all requests of a stage are sent before reading any reply, so
+	// each stage costs one round trip, regardless of the number of
+	// interfaces.
+
+	for (i = 0; i < n; ++i) {
+		struct dbus_buf body = { .len = 0 };
+		db_str(&body, devs[i]->intf);
+		if (dbus_call(NM_DEST, NM_PATH, NM_DEST, "GetDeviceByIpIface", "s", &body, &serials[i]) != 0) {
+			goto cleanup;
+		}
+	}
+
+	if (dbus_replies(serials, replies, n) != 0) {
+		goto cleanup;
+	}
+
+	for (i = 0; i < n; ++i) {
+		// an error means that either NetworkManager isn't running, or it
+		// doesn't know the interface; both are fine.
+		if (!replies[i].error && replies[i].sig[0] == 'o') {
+			snprintf(devs[i]->path, sizeof(devs[i]->path), "%s", replies[i].val.str);
+			known[k++] = devs[i];
+		}
+	}
+
+	for (i = 0; i < k; ++i) {
+		if (nm_call_props(known[i]->path, "Get", "Managed", -1, &serials[i]) != 0) {
+			goto cleanup;
+		}
+	}
+
+	if (dbus_replies(serials, replies, k) != 0) {
+		goto cleanup;
+	}
+
+	for (i = 0; i < k; ++i) {
+		if (!replies[i].error && !strcmp(replies[i].sig, "vb") && replies[i].val.b) {
+			// only change the ones that are actually managed
+			set[m++] = known[i];
+		} else {
+			known[i]->path[0] = '\0';
+		}
+	}
+
+	if (m && nm_set_managed(set, m, false) < 0) {
+		goto cleanup;
+	}
+
+	// nm_set_managed clears the path of devices it failed to change
+	for (i = 0; i < n; ++i) {
+		if (devs[i]->path[0]) {
+			devs[i]->refs = 1;
+			devs[i]->next = nm.devs;
+			nm.devs = devs[i];
+		} else {
+			devs[i]->next = nm.unmanaged;
+			nm.unmanaged = devs[i];
+		}
+		devs[i] = NULL;
+	}
+
+	ret = 0;
+
+cleanup:
+	for (i = 0; i < n; ++i) {
+		free(devs[i]);
+	}
+
+	if (ret != 0) {
+		// the connection is in an unknown state now
+		dbus_disconnect();
+	}
+out:
+	xmutex_unlock(&nm_lock);
+	return ret;
+}
+
+void nm_restore(const char **intfs, size_t count)
+{
+	struct nm_dev *devs[NM_MAX_BATCH], **p, *dev;
+	size_t i, n = 0;
+
+	xmutex_lock(&nm_lock);
+
+	count = MIN(count, NM_MAX_BATCH);
+
+	for (i = 0; i < count; ++i) {
+		if (!(dev = nm_find(nm.devs, intfs[i])) || --dev->refs) {
+			continue;
+		}
+
+		for (p = &nm.devs; *p; p = &(*p)->next) {
+			if (*p == dev) {
+				*p = dev->next;
+				break;
+			}
+		}
+
+		devs[n++] = dev;
+	}
+
+	if (n && (!nm_ensure_connected() || nm_set_managed(devs, n, true) < 0)) {
+		for (i = 0; i < n; ++i) {
+			printf("Warning: failed to re-enable NetworkManager on %s\n", devs[i]->intf);
+		}
+		dbus_disconnect();
+	}
+
+	for (i = 0; i < n; ++i) {
+		free(devs[i]);
+	}
+
+	xmutex_unlock(&nm_lock);
+}
+#endif
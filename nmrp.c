@@ -32,12 +32,33 @@
 
 #define ETH_P_NMRP 0x0912
 
+// lower bound of the timeout after which a CONF_ACK is resent. this
+// is deliberately high, since devices may need some time to set up
+// their network interface before sending a TFTP_UL_REQ.
+#define NMRP_MIN_RTO_MS 1000
+
+// CONF_REQ packets received before the first TFTP_UL_REQ that are answered
+// without complaint, see nmrp_do.
+#define NMRP_MAX_DUP_CONF_REQS 16
+
+// packets kept in each session's trace. a full-sized image, with the
+// default blksize, is a few thousand DATA blocks.
+#define NMRP_TRACE_EVENTS 8192
+
 #ifndef PACKED
 #define PACKED __attribute__((__packed__))
 #endif
 
 #ifdef NMRPFLASH_WINDOWS
-#define setenv(name, value, overwrite) SetEnvironmentVariable(name, value)
+#include <process.h>
+#define environ _environ
+// variable names are case insensitive on Windows only
+#define env_name_eq(a, b, n) !_strnicmp(a, b, n)
+#else
+#include <sys/wait.h>
+#include <spawn.h>
+extern char **environ;
+#define env_name_eq(a, b, n) !strncmp(a, b, n)
 #endif
 
 enum nmrp_code {
@@ -80,11 +101,11 @@ struct nmrp_pkt {
 	struct nmrp_msg msg;
 } PACKED;
 
-static const char *msg_code_str(uint16_t code)
+#define MSG_CODE_STR_LEN 16
+
+static const char *msg_code_str(uint16_t code, char *buf)
 {
 #define MSG_CODE(x) case NMRP_C_ ## x: return #x
-	static char buf[16];
-
 	switch (code) {
 		MSG_CODE(ADVERTISE);
 		MSG_CODE(CONF_REQ);
@@ -95,7 +116,7 @@ static const char *msg_code_str(uint16_t code)
 		MSG_CODE(KEEP_ALIVE_ACK);
 		MSG_CODE(TFTP_UL_REQ);
 		default:
-			snprintf(buf, sizeof(buf), "%04x", ntohs(code));
+			snprintf(buf, MSG_CODE_STR_LEN, "%04x", ntohs(code));
 			return buf;
 	}
 #undef MSG_CODE
@@ -135,7 +156,7 @@ static void *msg_opt(struct nmrp_msg *msg, uint16_t type, uint16_t* len)
 	size_t rem = ntohs(msg->len) - NMRP_HDR_LEN;
 	uint16_t olen;
 
-	do {
+	while (rem >= NMRP_OPT_HDR_LEN) {
 		olen = ntohs(opt->len);
 		if (olen < NMRP_OPT_HDR_LEN || olen > rem) {
 			break;
@@ -151,18 +172,17 @@ static void *msg_opt(struct nmrp_msg *msg, uint16_t type, uint16_t* len)
 
 		opt = (struct nmrp_opt*)(((char *)opt) + olen);
 		rem -= olen;
-	} while (rem);
+	}
 
 	return NULL;
 }
 
-static char *msg_filename(struct nmrp_msg *msg)
+static char *msg_filename(struct nmrp_msg *msg, char *buf, size_t size)
 {
-	static char buf[256];
 	uint16_t len;
 	char *p = msg_opt(msg, NMRP_O_FILE_NAME, &len);
 	if (p) {
-		len = MIN(sizeof(buf) - 1, len);
+		len = MIN(size - 1, len - NMRP_OPT_HDR_LEN);
 		memcpy(buf, p, len);
 		buf[len] = '\0';
 		return buf;
@@ -232,61 +252,229 @@ static void msg_mkconfack(struct nmrp_msg *msg, uint32_t ipaddr, uint32_t ipmask
 
 #ifdef NMRPFLASH_FUZZ
 #define NMRP_ADVERTISE_TIMEOUT 0
-#define ethsock_create(a, b) ((struct ethsock*)1)
+#define ethsock_create(a, b, c, d) ((struct ethsock*)1)
 #define ethsock_get_hwaddr(a) ethsock_get_hwaddr_fake(a)
-#define ethsock_recv(sock, buf, len) read(STDIN_FILENO, buf, len)
+#define ethsock_recv_ref(sock, buf) ethsock_recv_ref_fake(buf)
 #define ethsock_send(a, b, c) (0)
 #define ethsock_set_timeout(a, b) (0)
+#define ethsock_get_timeout(a) (0)
 #define ethsock_arp_add(a, b, c, d) (0)
 #define ethsock_arp_del(a, b) (0)
 #define ethsock_ip_add(a, b, c, d) (0)
 #define ethsock_ip_del(a, b) (0)
+#define ethsock_add_ipv4(a) (0)
+#define ethsock_set_batch(a, b)
+#define ethsock_set_capture(a, b)
 #define ethsock_close(a) (0)
 #define ethsock_for_each_ip(a, b, c) (1)
+#define ethsock_is_unplugged(a) (false)
+#define ethsock_is_wifi(a) (false)
+#define ethsock_wait_link(a, b) (true)
 #define tftp_put(a) (0)
+// every timer expires on the first receive that doesn't return a packet
+#define millis() millis_fake()
 
 static uint8_t *ethsock_get_hwaddr_fake(struct ethsock* sock)
 {
 	static uint8_t hwaddr[6] = { 0xfa, 0xfa, 0xfa, 0xfa, 0xfa, 0xfa };
 	return hwaddr;
 }
+
+static long long millis_fake(void)
+{
+	static long long now;
+	return now += 1000000;
+}
+
+// the input is a sequence of minimum-sized (60 byte) ethernet frames, as
+// in fuzzin/nmrp; the parsers alone are fuzzed with longer ones.
+static ssize_t ethsock_recv_ref_fake(const uint8_t **buf)
+{
+	static uint8_t pkt[256];
+	memset(pkt, 0, sizeof(pkt));
+	*buf = pkt;
+	return fuzz_read(pkt, 60);
+}
 #else
 #define NMRP_ADVERTISE_TIMEOUT 60
 #endif
 
-static int pkt_send(struct ethsock *sock, struct nmrp_pkt *pkt)
+static int pkt_send(struct ethsock *sock, struct nmrp_pkt *pkt, struct trace *trace)
 {
-	return ethsock_send(sock, pkt, sizeof(pkt->eh) + ntohs(pkt->msg.len));
+	size_t len = sizeof(pkt->eh) + ntohs(pkt->msg.len);
+
+	trace_add(trace, TRACE_NMRP_TX, pkt->msg.code, 0, len);
+	return ethsock_send(sock, pkt, len);
 }
 
-static int pkt_recv(struct ethsock *sock, struct nmrp_pkt *pkt)
+static int pkt_check(const uint8_t *buf, ssize_t bytes, const struct nmrp_pkt **pkt,
+		size_t *len)
 {
-	ssize_t bytes, mlen;
+	ssize_t mlen;
 
-	memset(pkt, 0, sizeof(*pkt));
-	bytes = ethsock_recv(sock, pkt, sizeof(*pkt));
-	if (bytes < 0) {
+	if (bytes < NMRP_MIN_PKT_LEN) {
+		fprintf(stderr, "Short packet (%d raw)\n", (int)bytes);
 		return 1;
-	} else if (!bytes) {
-		return 2;
 	}
 
-	mlen = ntohs(pkt->msg.len);
+	*pkt = (const struct nmrp_pkt*)buf;
+	mlen = ntohs((*pkt)->msg.len);
 
-	if (bytes < (mlen + sizeof(pkt->eh))
-			|| bytes < NMRP_MIN_PKT_LEN
-			|| mlen < NMRP_HDR_LEN) {
+	if (bytes < (mlen + sizeof((*pkt)->eh)) || mlen < NMRP_HDR_LEN) {
 		fprintf(stderr, "Short packet (%d raw, %d message)\n",
 				(int)bytes, (int)mlen);
 		return 1;
-	} else if (mlen > sizeof(pkt->msg)) {
-		printf("Truncating %d byte message.\n", (int)mlen);
-		pkt->msg.len = htons(sizeof(pkt->msg));
 	}
 
+	*len = sizeof((*pkt)->eh) + mlen;
 	return 0;
 }
 
+// validates the received packet in place; *pkt points into the ethsock's
+// receive buffer, and remains valid until the next receive.
+static int pkt_recv_ref(struct ethsock *sock, const struct nmrp_pkt **pkt, size_t *len,
+		struct trace *trace)
+{
+	const uint8_t *buf;
+	ssize_t bytes;
+	uint16_t type;
+
+	do {
+		bytes = ethsock_recv_ref(sock, &buf);
+		if (bytes < 0) {
+			return 1;
+		} else if (!bytes) {
+			return 2;
+		}
+
+		// with raw_tftp, the ethsock also receives IPv4 and ARP frames,
+		// such as late TFTP ACKs, which are ignored here.
+		type = bytes >= 14 ? ntohs(((const struct eth_hdr*)buf)->ether_type) : 0;
+	} while (type == 0x0800 || type == 0x0806);
+
+	trace_add(trace, TRACE_NMRP_RX, bytes > 16 ? buf[16] : 0, 0, bytes);
+	return pkt_check(buf, bytes, pkt, len);
+}
+
+static void pkt_copy(struct nmrp_pkt *pkt, const struct nmrp_pkt *ref, size_t len)
+{
+	memset(pkt, 0, sizeof(*pkt));
+	memcpy(pkt, ref, MIN(len, sizeof(*pkt)));
+
+	if (len > sizeof(*pkt)) {
+		printf("Truncating %d byte message.\n", (int)ntohs(ref->msg.len));
+		pkt->msg.len = htons(sizeof(pkt->msg));
+	}
+}
+
+static int pkt_recv(struct ethsock *sock, struct nmrp_pkt *pkt, struct trace *trace)
+{
+	const struct nmrp_pkt *ref;
+	size_t len;
+	int status;
+
+	status = pkt_recv_ref(sock, &ref, &len, trace);
+	if (!status) {
+		pkt_copy(pkt, ref, len);
+	}
+
+	return status;
+}
+
+#ifdef NMRPFLASH_FUZZ
+void nmrp_fuzz_pkt(const uint8_t *buf, size_t len)
+{
+	static const uint16_t types[] = {
+		NMRP_O_MAGIC_NO, NMRP_O_DEV_IP, NMRP_O_DEV_REGION,
+		NMRP_O_FW_UP, NMRP_O_ST_UP, NMRP_O_FILE_NAME
+	};
+	const struct nmrp_pkt *ref;
+	struct nmrp_pkt pkt;
+	char filename[256];
+	uint16_t olen;
+	size_t i;
+
+	if (pkt_check(buf, len, &ref, &len) != 0) {
+		return;
+	}
+
+	pkt_copy(&pkt, ref, len);
+	msg_filename(&pkt.msg, filename, sizeof(filename));
+
+	for (i = 0; i < sizeof(types) / sizeof(types[0]); ++i) {
+		msg_opt(&pkt.msg, types[i], &olen);
+	}
+}
+#endif
+
+// like pkt_recv, but waits until a packet has been received, or one of the
+// timers in `w` has expired, which is then stored in *expired. returns 2
+// with *expired set to NULL if the session was interrupted.
+static int pkt_recv_until(struct ethsock *sock, struct nmrp_pkt *pkt,
+		struct timer_wheel *w, struct timer **expired, struct trace *trace)
+{
+	long long next;
+	int status;
+
+	*expired = NULL;
+
+	while (true) {
+		next = timer_wheel_next(w, millis());
+		// 0 would wait forever
+		ethsock_set_timeout(sock, next < 0 ? 0 : MAX(next, 1));
+
+		status = pkt_recv(sock, pkt, trace);
+		if (status != 2) {
+			return status;
+		}
+
+		// a receive may return early, and a timer that's far off may be
+		// reported a little early, so this isn't necessarily a timeout.
+		*expired = timer_wheel_expire(w, millis());
+		if (*expired || nmrp_interrupted()) {
+			return 2;
+		}
+	}
+}
+
+// like pkt_recv_until, but resends `tx` each time the retransmission
+// timeout expires.
+static int pkt_recv_rto(struct ethsock *sock, struct nmrp_pkt *rx,
+		struct nmrp_pkt *tx, struct rto *rto, struct timer_wheel *w,
+		struct trace *trace)
+{
+	struct timer resend = { 0 }, *expired;
+	long long sent;
+	bool resent = false;
+	int status;
+
+	sent = micros();
+	timer_set(w, &resend, millis() + rto->timeout);
+
+	while (true) {
+		status = pkt_recv_until(sock, rx, w, &expired, trace);
+		if (status != 2 || expired != &resend) {
+			timer_cancel(w, &resend);
+			if (!status && !resent) {
+				rto_update(rto, micros() - sent);
+			}
+			return status;
+		}
+
+		if (verbosity > 1) {
+			printf("Resending packet after %u ms.\n", rto->timeout);
+		}
+
+		if (pkt_send(sock, tx, trace) != 0) {
+			return 1;
+		}
+
+		rto_backoff(rto);
+		resent = true;
+		timer_set(w, &resend, millis() + rto->timeout);
+	}
+}
+
 static int mac_parse(const char *str, uint8_t *hwaddr)
 {
 	int i;
@@ -356,35 +544,34 @@ static int is_valid_ip(struct ethsock *sock, struct in_addr *ipaddr,
 	return status < 0 ? status : arg.result;
 }
 
-static void sigh(int sig)
-{
-	g_interrupted = 1;
-}
-
-bool nmrp_discard(struct ethsock *sock)
+bool nmrp_discard(struct ethsock *sock, struct trace *trace)
 {
 	// between nmrpflash sending the TFTP WRQ packet, and the router
 	// responding with ACK(0)/OACK, some devices send extraneous
 	// CONF_REQ and/or TFTP_UL_REQ packets.
 	//
-	// the TFTP code thus calls this function in each loop iteration,
-	// to discard any late NMRP packets.
+	// the TFTP code thus calls this function whenever the ethsock becomes
+	// readable while it's waiting for an ACK, to discard any late NMRP
+	// packets.
 	//
 	// without this it might seem  as if these packets arrived after
 	// the TFTP upload completed successfuly, confusing the NMRP code.
 
 	unsigned timeout = ethsock_get_timeout(sock);
-	// don't set this to 0, as this would cause pkt_recv to block!
+	// don't set this to 0, as this would cause pkt_recv to block! since
+	// a packet is usually pending, this doesn't actually wait for 1 ms.
 	ethsock_set_timeout(sock, 1);
 
-	struct nmrp_pkt rx;
+	const struct nmrp_pkt *rx;
+	char codebuf[MSG_CODE_STR_LEN];
+	size_t len;
 
-	int ret = pkt_recv(sock, &rx);
+	int ret = pkt_recv_ref(sock, &rx, &len, trace);
 	if (ret == 0) {
-		if (rx.msg.code != NMRP_C_CONF_REQ && rx.msg.code != NMRP_C_TFTP_UL_REQ) {
-			printf("Discarding unexpected %s packet.\n", msg_code_str(rx.msg.code));
+		if (rx->msg.code != NMRP_C_CONF_REQ && rx->msg.code != NMRP_C_TFTP_UL_REQ) {
+			printf("Discarding unexpected %s packet.\n", msg_code_str(rx->msg.code, codebuf));
 		} else if (verbosity > 1) {
-			printf("Discarding late %s packet.\n", msg_code_str(rx.msg.code));
+			printf("Discarding late %s packet.\n", msg_code_str(rx->msg.code, codebuf));
 		}
 	}
 
@@ -392,7 +579,108 @@ bool nmrp_discard(struct ethsock *sock)
 	return ret == 0;
 }
 
-static const char *spinner = "\\|/-";
+static void nmrp_phase(struct nmrpd_args *args, enum nmrp_phase phase)
+{
+	if (stats_phase(&args->stats, phase) && args->cb && args->cb->phase) {
+		args->cb->phase(args->cb->arg, (enum nmrpflash_phase)phase);
+	}
+}
+
+// the in-process equivalent of -c
+static int nmrp_upload_cb(struct nmrpd_args *args, struct in_addr ipaddr,
+		struct in_addr ipmask, uint8_t *mac)
+{
+	char ipbuf[INET_ADDRSTRLEN], maskbuf[INET_ADDRSTRLEN], macbuf[MAC_STR_LEN];
+	struct nmrpflash_device dev = {
+		.intf = args->intf,
+		.ipaddr = inet_ntop(AF_INET, &ipaddr, ipbuf, sizeof(ipbuf)),
+		.ipmask = inet_ntop(AF_INET, &ipmask, maskbuf, sizeof(maskbuf)),
+		.mac = mac_to_str(mac, macbuf),
+		.port = args->port,
+	};
+
+	return args->cb->upload(args->cb->arg, &dev);
+}
+
+// runs cmd through the shell, with vars ("NAME=value", NULL terminated)
+// added to a copy of our environment: the environment itself is shared
+// by all sessions. returns the exit status, or -1.
+static int nmrp_run_cmd(const char *cmd, char **vars)
+{
+	char **envp, **e, **v;
+	size_t n, len;
+	int status;
+
+	for (n = 0, e = environ; *e; ++e) {
+		++n;
+	}
+
+	for (v = vars; *v; ++v) {
+		++n;
+	}
+
+	envp = malloc((n + 1) * sizeof(*envp));
+	if (!envp) {
+		xperror("malloc");
+		return -1;
+	}
+
+	n = 0;
+
+	for (e = environ; *e; ++e) {
+		for (v = vars; *v; ++v) {
+			len = strchr(*v, '=') - *v + 1;
+			if (env_name_eq(*e, *v, len)) {
+				break;
+			}
+		}
+
+		if (!*v) {
+			envp[n++] = *e;
+		}
+	}
+
+	for (v = vars; *v; ++v) {
+		envp[n++] = *v;
+	}
+
+	envp[n] = NULL;
+
+#ifndef NMRPFLASH_WINDOWS
+	char *argv[] = { "sh", "-c", (char*)cmd, NULL };
+	pid_t pid;
+
+	status = posix_spawn(&pid, "/bin/sh", NULL, NULL, argv, envp);
+	if (status) {
+		fprintf(stderr, "posix_spawn: %s\n", strerror(status));
+		status = -1;
+	} else {
+		while (waitpid(pid, &status, 0) < 0) {
+			if (errno != EINTR) {
+				xperror("waitpid");
+				status = -1;
+				break;
+			}
+		}
+
+		if (status > 0) {
+			status = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+		}
+	}
+#else
+	const char *comspec = getenv("COMSPEC");
+	const char *argv[] = { "cmd", "/c", cmd, NULL };
+
+	status = _spawnve(_P_WAIT, comspec ? comspec : "cmd.exe", argv,
+			(const char* const*)envp);
+	if (status == -1) {
+		xperror("_spawnve");
+	}
+#endif
+
+	free(envp);
+	return status;
+}
 
 int nmrp_do(struct nmrpd_args *args)
 {
@@ -400,21 +688,34 @@ int nmrp_do(struct nmrpd_args *args)
 	uint8_t *src, dest[6];
 	uint16_t region;
 	char *filename;
-	time_t beg;
-	int i, timeout, status, ulreqs, expect, upload_ok, autoip, ka_reqs;
+	int timeout, status, ulreqs, expect, upload_ok, autoip, ka_reqs;
 	unsigned unexpected;
-	bool was_plugged_in;
+	bool was_plugged_in, plugged, check_link, dup, adv, from_catalog = false;
+	unsigned dups;
+	unsigned interval, adv_interval, adv_burst, adv_max_interval;
+	long long burst;
 	ssize_t bytes;
-	struct ethsock *sock;
+	struct ethsock *sock = NULL;
 	struct ethsock_ip_undo *ip_undo = NULL;
 	struct ethsock_arp_undo *arp_undo = NULL;
 	uint32_t intf_addr = 0;
-	void (*sigh_orig)(int);
 	struct in_addr ipaddr;
 	struct in_addr ipmask;
 	uint8_t* arp_mac = NULL;
+	struct image *image = NULL;
+	struct progress *prog = NULL;
+	struct rto rto;
+	struct timer_wheel timers;
+	struct timer adv_tx = { 0 }, adv_end = { 0 }, rx_end = { 0 }, *expired;
+	char macbuf[2][MAC_STR_LEN];
+	char codebuf[2][MSG_CODE_STR_LEN];
+	char portbuf[XLLTOSTR_LEN];
+	char ipbuf[2][INET_ADDRSTRLEN];
+	char envbuf[5][256];
+	char *vars[] = { envbuf[0], envbuf[1], envbuf[2], envbuf[3], envbuf[4], NULL };
 
 	args->hints = 0;
+	stats_init(&args->stats);
 
 	if (args->op != NMRP_UPLOAD_FW) {
 		fprintf(stderr, "Operation not implemented.\n");
@@ -454,10 +755,9 @@ int nmrp_do(struct nmrpd_args *args)
 	if (args->ipaddr_intf && (intf_addr = inet_addr(args->ipaddr_intf)) == INADDR_NONE) {
 		fprintf(stderr, "Invalid IP address '%s'.\n", args->ipaddr_intf);
 		return 1;
-	}
-
-	if (args->file_local && strcmp(args->file_local, "-") && access(args->file_local, R_OK) == -1) {
-		fprintf(stderr, "Error accessing file '%s'.\n", args->file_local);
+	} else if (args->raw_tftp && !args->ipaddr_intf) {
+		// there's no interface address to send from
+		fprintf(stderr, "Userspace TFTP requires a local IP address (-A).\n");
 		return 1;
 	}
 
@@ -481,54 +781,89 @@ int nmrp_do(struct nmrpd_args *args)
 
 	status = 1;
 
-	sock = ethsock_create(args->intf, ETH_P_NMRP);
+	// map the image now, so we don't find out that it's unreadable
+	// after the device has already asked for it.
+	if (args->file_local && strcmp(args->file_local, "-") && !args->image) {
+		if (!(image = args->image = image_open(args->file_local, args->offset))) {
+			return 1;
+		}
+	}
+
+	// a mismatched image is only rejected by the bootloader once it has
+	// been uploaded completely
+	if (args->image && !args->no_check && chk_validate(args->image, args->region, NULL) < 0) {
+		fprintf(stderr, "Refusing to upload image (use -n to override).\n");
+		goto out;
+	}
+
+	// always recorded, so that it's there once something has gone wrong;
+	// -X and -vvv only decide where it's written.
+	if (!(args->trace = trace_open(NMRP_TRACE_EVENTS))) {
+		goto out;
+	}
+
+	sock = ethsock_create(args->intf, ETH_P_NMRP, args->bufsize, args->trunk);
 	if (!sock) {
-		return 1;
+		goto out;
 	}
 
 	args->sock = sock;
+	nmrp_phase(args, NMRP_PHASE_OPEN);
+
+	if (args->raw_tftp && ethsock_add_ipv4(sock) != 0) {
+		goto out;
+	}
 
-	sigh_orig = signal(SIGINT, sigh);
+	if (args->capture) {
+		ethsock_set_capture(sock, args->capture);
+		args->capture_tftp = capture_add_intf(args->capture, args->intf,
+				"TFTP", CAPTURE_LINKTYPE_RAW);
+	}
 
 	was_plugged_in = !ethsock_is_unplugged(sock);
+	check_link = true;
 
-	if (!was_plugged_in) {
-		if (ethsock_is_wifi(sock)) {
-			fprintf(stderr, "Error: Wi-Fi not connected.\n");
-			goto out;
-		}
-
+	if (!was_plugged_in && ethsock_is_wifi(sock)) {
+		fprintf(stderr, "Error: Wi-Fi not connected.\n");
+		goto out;
+	} else if (!was_plugged_in && !args->adv_early) {
 		printf("Waiting for Ethernet connection (Ctrl-C to skip).\n");
 
-		bool unplugged = true;
-		time_t beg = time_monotonic();
-
-		while (!g_interrupted && (time_monotonic() - beg) < NMRP_ETH_TIMEOUT_S) {
-			if (!ethsock_is_unplugged(sock)) {
-				unplugged = false;
-				break;
-			}
-		}
-
+		bool unplugged = !ethsock_wait_link(sock, NMRP_ETH_TIMEOUT_S * 1000);
 		was_plugged_in = !unplugged;
 
 		if (unplugged) {
-			if (!g_interrupted) {
+			if (!nmrp_interrupted()) {
 				args->hints |= NMRP_NO_ETHERNET_CONNECTION;
 				fprintf(stderr, "Error: Ethernet cable is unplugged.\n");
 				goto out;
+			} else if (!g_interrupted) {
+				// cancelled, rather than Ctrl-C
+				goto out;
 			} else {
 				printf("\rSkipped.\n");
 				g_interrupted = false;
+				// the link state is probably wrong
+				check_link = false;
 			}
 		}
 	}
 
+	if (was_plugged_in) {
+		nmrp_phase(args, NMRP_PHASE_LINK);
+	}
+
 	if (ethsock_is_wifi(sock)) {
 		printf("Warning: using a Wi-Fi interface. Make sure you know what you're doing!\n");
 	}
 
-	if (!autoip) {
+	if (args->raw_tftp) {
+		// udp_recvfrom answers ARP requests for ipaddr_intf instead
+		if (verbosity) {
+			printf("Using %s on interface %s, without adding it.\n",
+					args->ipaddr_intf, args->intf);
+		}
+	} else if (!autoip) {
 		status = is_valid_ip(sock, &ipaddr, &ipmask);
 		if (status <= 0) {
 			if (!status) {
@@ -547,6 +882,8 @@ int nmrp_do(struct nmrpd_args *args)
 		}
 	}
 
+	nmrp_phase(args, NMRP_PHASE_IP);
+
 	if (ethsock_set_timeout(sock, NMRP_ETH_TIMEOUT_S)) {
 		goto out;
 	}
@@ -562,43 +899,100 @@ int nmrp_do(struct nmrpd_args *args)
 
 	msg_mkadvertise(&tx.msg, "NTGR");
 
-	i = 0;
 	upload_ok = 0;
 	timeout = args->blind_timeout ? args->blind_timeout : NMRP_ADVERTISE_TIMEOUT;
-	beg = time_monotonic();
+	timer_wheel_init(&timers, millis());
+	timer_set(&timers, &adv_end, millis() + timeout * 1000LL);
+	rto_init(&rto, NMRP_MIN_RTO_MS, NMRP_MIN_RTO_MS, args->rx_timeout);
 
 	printf("Advertising NMRP server on %s ... ", args->intf);
+	fflush(stdout);
 
-	while (!g_interrupted) {
-		i = (i + 1) & 3;
+	if (!args->quiet) {
+		prog = progress_start(0, true);
+	}
 
-		printf("%c ", spinner[i]);
-		fflush(stdout);
-		printf("\b\b");
+	adv_interval = args->adv_interval ? args->adv_interval : NMRP_DEFAULT_ADV_INTERVAL_MS;
+	adv_max_interval = MAX(adv_interval, args->adv_max_interval ? args->adv_max_interval
+			: NMRP_DEFAULT_ADV_MAX_INTERVAL_MS);
+	adv_burst = args->adv_burst;
+	plugged = !check_link || !ethsock_is_unplugged(sock);
+	burst = millis();
+	interval = adv_interval;
+	adv = true;
+
+	while (!nmrp_interrupted()) {
+		if (check_link && ethsock_is_unplugged(sock)) {
+			if (plugged && verbosity) {
+				printf("\nEthernet link is down.\n");
+			}
 
-		was_plugged_in |= !ethsock_is_unplugged(sock);
+			plugged = false;
+			// don't advertise into the void, but be ready to start as soon
+			// as the link comes up, since some bootloaders only listen for
+			// a second or two after power-on.
+			ethsock_wait_link(sock, adv_max_interval);
+			// handled like a receive timeout
+			expired = timer_wheel_expire(&timers, millis());
+			status = 2;
+		} else {
+			if (!plugged) {
+				if (!was_plugged_in) {
+					// start the timeout now, rather than counting the
+					// time spent waiting for the link.
+					timer_set(&timers, &adv_end, millis() + timeout * 1000LL);
+					was_plugged_in = true;
+					nmrp_phase(args, NMRP_PHASE_LINK);
+				} else if (verbosity) {
+					printf("\nEthernet link is up again.\n");
+				}
 
-		if (pkt_send(sock, &tx) < 0) {
-			goto out;
+				plugged = true;
+				burst = millis();
+				interval = adv_interval;
+				adv = true;
+			}
+
+			if (adv) {
+				if (pkt_send(sock, &tx, args->trace) < 0) {
+					goto out;
+				}
+
+				++args->stats.advertise;
+				timer_set(&timers, &adv_tx, millis() + interval);
+				adv = false;
+			}
+
+			status = pkt_recv_until(sock, &rx, &timers, &expired, args->trace);
 		}
 
-		status = pkt_recv(sock, &rx);
 		if (status == 0) {
 			if (memcmp(rx.eh.ether_dhost, src, 6) == 0) {
+				// not a round trip: the device may only answer once it
+				// has finished booting, so this doesn't go into the RTO.
+				nmrp_phase(args, NMRP_PHASE_ADVERTISE);
 				// don't continue in blind mode if we've received a response
 				args->blind_timeout = 0;
 				break;
 			} else if (verbosity) {
 				printf("\nIgnoring bogus response: %s -> %s.\n",
-						mac_to_str(rx.eh.ether_shost),
-						mac_to_str(rx.eh.ether_dhost));
+						mac_to_str(rx.eh.ether_shost, macbuf[0]),
+						mac_to_str(rx.eh.ether_dhost, macbuf[1]));
 			}
 		} else if (status == 1) {
 			goto out;
 		} else {
 			/* because we don't want nmrpflash's exit status to be zero */
 			status = 1;
-			if ((time_monotonic() - beg) >= timeout) {
+			if (expired == &adv_tx) {
+				// after the initial burst, back off exponentially
+				if ((millis() - burst) >= adv_burst) {
+					interval = MIN(interval * 2, adv_max_interval);
+				}
+				adv = true;
+			} else if (expired == &adv_end) {
+				progress_stop(prog);
+				prog = NULL;
 				printf("\nNo response after %d seconds. ", timeout);
 				args->hints |= NMRP_NO_NMRP_RESPONSE;
 
@@ -621,6 +1015,8 @@ int nmrp_do(struct nmrpd_args *args)
 		}
 	}
 
+	progress_stop(prog);
+	prog = NULL;
 	printf("\n");
 
 	memcpy(tx.eh.ether_dhost, rx.eh.ether_shost, 6);
@@ -628,23 +1024,38 @@ int nmrp_do(struct nmrpd_args *args)
 	// a manually specified MAC address (using `-m`) takes precedence over
 	// the NMRP response packets' MAC.
 	arp_mac = !mac_is_broadcast(dest) ? dest : rx.eh.ether_shost;
-	if (ethsock_arp_add(sock, arp_mac, ipaddr.s_addr, &arp_undo) != 0) {
+	memcpy(args->hwaddr, arp_mac, 6);
+	// with raw_tftp, datagrams are sent to args->hwaddr directly
+	if (!args->raw_tftp && ethsock_arp_add(sock, arp_mac, ipaddr.s_addr, &arp_undo) != 0) {
 		goto out;
 	}
 
-	if (ethsock_set_timeout(sock, args->rx_timeout)) {
-		goto out;
-	}
+	nmrp_phase(args, NMRP_PHASE_ARP);
+
+	timer_cancel(&timers, &adv_tx);
+	timer_cancel(&timers, &adv_end);
+	timer_set(&timers, &rx_end, millis() + args->rx_timeout);
 
 	expect = NMRP_C_CONF_REQ;
+	dups = 0;
 	ulreqs = 0;
 	ka_reqs = 0;
 	unexpected = 0;
 
-	while (!g_interrupted) {
-		if (expect != NMRP_C_NONE && rx.msg.code != expect) {
+	while (!nmrp_interrupted()) {
+		// with a dense ADVERTISE burst, and a slow device, more than one
+		// CONF_REQ may be on its way by the time we've received the first.
+		dup = expect == NMRP_C_TFTP_UL_REQ && rx.msg.code == NMRP_C_CONF_REQ
+			&& !ulreqs && ++dups <= NMRP_MAX_DUP_CONF_REQS;
+
+		if (dup) {
+			if (verbosity > 1) {
+				printf("Received duplicate CONF_REQ.\n");
+			}
+		} else if (expect != NMRP_C_NONE && rx.msg.code != expect) {
 			fprintf(stderr, "Received %s while waiting for %s!\n",
-					msg_code_str(rx.msg.code), msg_code_str(expect));
+					msg_code_str(rx.msg.code, codebuf[0]),
+					msg_code_str(expect, codebuf[1]));
 
 			if (ulreqs && expect == NMRP_C_TFTP_UL_REQ && rx.msg.code == NMRP_C_CONF_REQ) {
 				args->hints |= NMRP_MAYBE_FIRMWARE_INVALID;
@@ -665,16 +1076,19 @@ int nmrp_do(struct nmrpd_args *args)
 		switch (rx.msg.code) {
 			case NMRP_C_ADVERTISE:
 				printf("Received NMRP advertisement from %s.\n",
-						mac_to_str(rx.eh.ether_shost));
+						mac_to_str(rx.eh.ether_shost, macbuf[0]));
 				status = 1;
 				goto out;
 			case NMRP_C_CONF_REQ:
 				msg_mkconfack(&tx.msg, ipaddr.s_addr, ipmask.s_addr, region);
 				expect = NMRP_C_TFTP_UL_REQ;
 
-				if (!args->blind_timeout) {
+				if (dup) {
+					// answered anyway, in case our CONF_ACK was lost
+					break;
+				} else if (!args->blind_timeout) {
 					printf("Received configuration request from %s.\n",
-							mac_to_str(rx.eh.ether_shost));
+							mac_to_str(rx.eh.ether_shost, macbuf[0]));
 				}
 
 				printf("Sending configuration: %s/%d.\n",
@@ -686,13 +1100,29 @@ int nmrp_do(struct nmrpd_args *args)
 					args->hints |= NMRP_MAYBE_FIRMWARE_INVALID;
 				}
 
+				args->stats.ul_reqs = ulreqs;
+				nmrp_phase(args, NMRP_PHASE_UL_REQ);
+
 				if (ulreqs > NMRP_MAX_UL_REQS) {
 					printf("Bailing out after %d upload requests.\n", ulreqs);
 					tx.msg.code = NMRP_C_CLOSE_REQ;
 					break;
 				}
 
-				filename = msg_filename(&rx.msg);
+				filename = msg_filename(&rx.msg, args->filename, sizeof(args->filename));
+
+				if (args->catalog && !args->file_local) {
+					args->image = catalog_find(args->catalog, filename, args->region,
+							&args->file_local);
+					if (!args->image) {
+						tx.msg.code = NMRP_C_CLOSE_REQ;
+						break;
+					}
+
+					from_catalog = true;
+					printf("Using image '%s'.\n", leafname(args->file_local));
+				}
+
 				if (filename) {
 					if (!args->file_remote) {
 						args->file_remote = filename;
@@ -705,15 +1135,25 @@ int nmrp_do(struct nmrpd_args *args)
 					}
 				}
 
-				if (args->tftpcmd) {
+				if (args->cb && args->cb->upload) {
+					status = nmrp_upload_cb(args, ipaddr, ipmask, arp_mac);
+					if (status != 0) {
+						fprintf(stderr, "Upload callback failed: status %d.\n", status);
+						goto out;
+					}
+				} else if (args->tftpcmd) {
 					printf("Executing '%s' ... \n", args->tftpcmd);
-					setenv("IP", inet_ntoa(ipaddr), 1);
-					setenv("PORT", xlltostr(args->port, 10), 1);
-					setenv("MAC", mac_to_str(arp_mac), 1);
-					setenv("NETMASK", inet_ntoa(ipmask), 1);
-					//setenv("FILENAME", args->file_remote ? args->file_remote : "", 1);
-					setenv("INTERFACE", args->intf, 1);
-					status = system(args->tftpcmd);
+					snprintf(envbuf[0], sizeof(envbuf[0]), "IP=%s",
+							inet_ntop(AF_INET, &ipaddr, ipbuf[0], sizeof(ipbuf[0])));
+					snprintf(envbuf[1], sizeof(envbuf[1]), "PORT=%s",
+							xlltostr(args->port, 10, portbuf));
+					snprintf(envbuf[2], sizeof(envbuf[2]), "MAC=%s",
+							mac_to_str(arp_mac, macbuf[0]));
+					snprintf(envbuf[3], sizeof(envbuf[3]), "NETMASK=%s",
+							inet_ntop(AF_INET, &ipmask, ipbuf[1], sizeof(ipbuf[1])));
+					snprintf(envbuf[4], sizeof(envbuf[4]), "INTERFACE=%s", args->intf);
+
+					status = nmrp_run_cmd(args->tftpcmd, vars);
 
 					if (status != 0) {
 						fprintf(stderr, "Command failed: status %d.\n", status);
@@ -722,7 +1162,7 @@ int nmrp_do(struct nmrpd_args *args)
 				}
 
 				if (args->file_local) {
-					if (!autoip) {
+					if (!autoip && !args->raw_tftp) {
 						status = is_valid_ip(sock, &ipaddr, &ipmask);
 						if (status < 0) {
 							goto out;
@@ -739,7 +1179,9 @@ int nmrp_do(struct nmrpd_args *args)
 								args->file_remote);
 					}
 
-					if (!strcmp(args->file_local, "-")) {
+					if (args->cb && args->cb->read) {
+						printf("Uploading ... ");
+					} else if (!strcmp(args->file_local, "-")) {
 						printf("Uploading from stdin ... ");
 					} else {
 						printf("Uploading %s ... ", leafname(args->file_local));
@@ -750,6 +1192,7 @@ int nmrp_do(struct nmrpd_args *args)
 
 					if (bytes > 0) {
 						printf("OK (%zd b)\n", bytes);
+						nmrp_phase(args, NMRP_PHASE_UPLOAD);
 						upload_ok = 1;
 
 						if (args->blind_timeout) {
@@ -774,7 +1217,7 @@ int nmrp_do(struct nmrpd_args *args)
 
 				if (upload_ok) {
 					printf("Waiting for remote to respond.\n");
-					ethsock_set_timeout(sock, args->ul_timeout);
+					timer_set(&timers, &rx_end, millis() + args->ul_timeout);
 					tx.msg.code = NMRP_C_NONE;
 					expect = NMRP_C_NONE;
 				}
@@ -782,10 +1225,12 @@ int nmrp_do(struct nmrpd_args *args)
 				break;
 			case NMRP_C_KEEP_ALIVE_REQ:
 				tx.msg.code = NMRP_C_KEEP_ALIVE_ACK;
-				ethsock_set_timeout(sock, args->ul_timeout);
+				timer_set(&timers, &rx_end, millis() + args->ul_timeout);
 				printf("\rReceived keep-alive request (%d).  ", ++ka_reqs);
+				args->stats.ka_reqs = ka_reqs;
 				break;
 			case NMRP_C_CLOSE_REQ:
+				nmrp_phase(args, NMRP_PHASE_CLOSE);
 				tx.msg.code = NMRP_C_CLOSE_ACK;
 				break;
 			case NMRP_C_CLOSE_ACK:
@@ -798,7 +1243,7 @@ int nmrp_do(struct nmrpd_args *args)
 		}
 
 		if (tx.msg.code != NMRP_C_NONE) {
-			if (pkt_send(sock, &tx) != 0 || tx.msg.code == NMRP_C_CLOSE_REQ) {
+			if (pkt_send(sock, &tx, args->trace) != 0 || tx.msg.code == NMRP_C_CLOSE_REQ) {
 				goto out;
 			}
 		}
@@ -812,12 +1257,17 @@ int nmrp_do(struct nmrpd_args *args)
 			break;
 		}
 
-		status = pkt_recv(sock, &rx);
+		if (tx.msg.code == NMRP_C_CONF_ACK) {
+			status = pkt_recv_rto(sock, &rx, &tx, &rto, &timers, args->trace);
+		} else {
+			status = pkt_recv_until(sock, &rx, &timers, &expired, args->trace);
+		}
+
 		if (status) {
 			if (status == 2) {
 				if (!args->blind_timeout) {
 					fprintf(stderr, "Timeout while waiting for %s.\n",
-							msg_code_str(expect));
+							msg_code_str(expect, codebuf[0]));
 					goto out;
 				}
 
@@ -829,11 +1279,10 @@ int nmrp_do(struct nmrpd_args *args)
 			}
 		}
 
-		ethsock_set_timeout(sock, args->rx_timeout);
-
+		timer_set(&timers, &rx_end, millis() + args->rx_timeout);
 	}
 
-	if (!g_interrupted) {
+	if (!nmrp_interrupted()) {
 		status = 0;
 		if (ulreqs) {
 			printf("Reboot your device now.\n");
@@ -843,9 +1292,43 @@ int nmrp_do(struct nmrpd_args *args)
 	}
 
 out:
-	signal(SIGINT, sigh_orig);
-	ethsock_arp_del(sock, &arp_undo);
-	ethsock_ip_del(sock, &ip_undo);
-	ethsock_close(sock);
+	progress_stop(prog);
+
+	if (sock) {
+		ethsock_set_batch(sock, args->batch);
+		ethsock_arp_del(sock, &arp_undo);
+		ethsock_ip_del(sock, &ip_undo);
+		ethsock_close(sock);
+		args->sock = NULL;
+	}
+
+	if (image) {
+		image_close(image);
+		args->image = NULL;
+	}
+
+	if (from_catalog) {
+		// owned by the catalog
+		args->image = NULL;
+		args->file_local = NULL;
+	}
+
+	if (args->stats_fp) {
+		stats_write(args->stats_fp, args, status);
+	}
+
+	if (args->trace) {
+		if (status != 0 && args->trace_fp) {
+			trace_dump(args->trace, args->trace_fp, args->intf);
+		}
+
+		if (verbosity > 2) {
+			trace_dump(args->trace, stdout, args->intf);
+		}
+
+		trace_close(args->trace);
+		args->trace = NULL;
+	}
+
 	return status;
 }
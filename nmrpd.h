@@ -22,6 +22,8 @@
 #include <stdint.h>
 #include <signal.h>
 #include <stdbool.h>
+#include <stdio.h>
+#include "nmrpflash.h"
 
 #if defined(_WIN32) || defined(_WIN64)
 #  define NMRPFLASH_WINDOWS
@@ -42,12 +44,26 @@
 #	warning "nmrpflash is not supported on this platform"
 #endif
 
+// the TPACKET_V3 backend is Linux only
+#if defined(NMRPFLASH_TPACKET) && !defined(NMRPFLASH_LINUX)
+#  undef NMRPFLASH_TPACKET
+#endif
+
+// overlapped TFTP receives (NMRPFLASH_WIN_OVERLAPPED) and managing the TFTP
+// firewall rule through COM (NMRPFLASH_WIN_FW_COM) haven't been built on
+// Windows yet, so they're opt-in. otherwise, recvfrom and netsh are used.
+#ifndef NMRPFLASH_WINDOWS
+#  undef NMRPFLASH_WIN_OVERLAPPED
+#  undef NMRPFLASH_WIN_FW_COM
+#endif
+
 #ifndef NMRPFLASH_WINDOWS
 #  include <arpa/inet.h>
 #  include <sys/types.h>
 #  include <sys/socket.h>
 #  include <netinet/in.h>
 #  include <net/if.h>
+#  include <pthread.h>
 #  ifndef NMRPFLASH_LINUX
 #    include <net/if_dl.h>
 #  endif
@@ -75,6 +91,12 @@
 #define NMRP_DEFAULT_UL_TIMEOUT_S    (30 * 60)
 #define NMRP_DEFAULT_RX_TIMEOUT_MS   (10000)
 #define NMRP_DEFAULT_BLIND_TIMEOUT_S 5
+// ADVERTISE cadence, see struct nmrpd_args. the burst only restarts when
+// our link comes up, which it doesn't behind a switch, or on a VLAN, so
+// the interval backs off no further than the ~60 ms of older versions.
+#define NMRP_DEFAULT_ADV_BURST_MS        3000
+#define NMRP_DEFAULT_ADV_INTERVAL_MS     20
+#define NMRP_DEFAULT_ADV_MAX_INTERVAL_MS 60
 /*
  * These addresses should not cause collisions on most networks,
  * and if they do, the user is probably "poweruser" enough to
@@ -99,6 +121,28 @@ struct eth_hdr {
 	uint16_t ether_type;
 } PACKED;
 
+struct ip_hdr
+{
+	uint8_t ver_ihl;
+	uint8_t tos;
+	uint16_t len;
+	uint16_t id;
+	uint16_t frag;
+	uint8_t ttl;
+	uint8_t proto;
+	uint16_t sum;
+	uint32_t src;
+	uint32_t dst;
+} PACKED;
+
+struct udp_hdr
+{
+	uint16_t sport;
+	uint16_t dport;
+	uint16_t len;
+	uint16_t sum;
+} PACKED;
+
 enum nmrp_op {
 	NMRP_UPLOAD_FW = 0,
 	NMRP_UPLOAD_ST = 1,
@@ -107,6 +151,201 @@ enum nmrp_op {
 
 struct ethsock;
 
+// a read-only view of a firmware file, starting at `offset`
+struct image
+{
+	const uint8_t *data;
+	size_t size;
+	// private
+	char *path;
+	off_t offset;
+	const uint8_t *base;
+	size_t len;
+	uint8_t *buf;
+	bool mapped;
+#ifdef NMRPFLASH_WINDOWS
+	HANDLE mapping;
+#endif
+	unsigned refs;
+	struct image *next;
+};
+
+// maximum size of a firmware file that can't be memory-mapped
+#define IMAGE_MAX_SIZE (256 * 1024 * 1024)
+
+struct image *image_open(const char *path, off_t offset);
+// the buffer must outlive the image, and is not freed by image_close
+struct image *image_from_buf(const void *buf, size_t len);
+void image_close(struct image *img);
+
+#define CHK_MAX_BOARD_ID 64
+
+struct chk_info
+{
+	char board_id[CHK_MAX_BOARD_ID + 1];
+	// "WW", "NA", or NULL if the image doesn't specify one
+	const char *region;
+	// of the kernel and rootfs
+	uint32_t checksum;
+};
+
+// validates the Netgear .chk header and checksums of the image. returns 1
+// if the image is valid, 0 if it's not a .chk image, and -1 if it's
+// corrupt or its region doesn't match `region` (unless NULL). `info`, if
+// not NULL, is filled in unless 0 is returned.
+int chk_validate(const struct image *img, const char *region, struct chk_info *info);
+// Netgear's checksum, as used in .chk images
+uint32_t chk_checksum(const void *buf, size_t len);
+
+// a directory of firmware images, indexed by filename and board ID. the
+// index is cached in the directory, and all images remain mapped until
+// the catalog is closed. lookups are thread-safe. invalid .chk images are
+// skipped, unless no_check is set.
+struct catalog;
+struct catalog *catalog_open(const char *dir, bool no_check);
+// returns the image for a device that requested `filename` (NULL if it
+// didn't), and its path. region, unless NULL, excludes .chk images for
+// other regions. returns NULL if no image, or more than one, matches.
+struct image *catalog_find(struct catalog *cat, const char *filename,
+		const char *region, const char **path);
+void catalog_close(struct catalog *cat);
+
+// session milestones, in the order they're normally reached
+enum nmrp_phase
+{
+	NMRP_PHASE_OPEN,      // ethsock opened
+	NMRP_PHASE_LINK,      // Ethernet link is up
+	NMRP_PHASE_IP,        // interface address added or validated
+	NMRP_PHASE_ADVERTISE, // response to ADVERTISE received
+	NMRP_PHASE_ARP,       // ARP entry for the device added
+	NMRP_PHASE_UL_REQ,    // first TFTP_UL_REQ received
+	NMRP_PHASE_UPLOAD,    // TFTP upload finished
+	NMRP_PHASE_CLOSE,     // CLOSE_REQ received
+	NMRP_PHASE_COUNT
+};
+
+#define NMRP_STATS_RTT_BUCKETS 12
+
+struct nmrp_stats
+{
+	// start of the session [us]
+	long long start;
+	// time since start [us] at which each phase was reached, or -1
+	long long phases[NMRP_PHASE_COUNT];
+	// number of ADVERTISE packets sent
+	unsigned advertise;
+	unsigned ul_reqs;
+	unsigned ka_reqs;
+	struct {
+		unsigned long bytes;
+		unsigned long blocks;
+		unsigned long resends;
+		unsigned long dup_acks;
+		unsigned long timeouts;
+		unsigned long wrqs;
+		// transfers restarted from the first block
+		unsigned long restarts;
+		unsigned blksize;
+		unsigned windowsize;
+		// time from the first WRQ until the final ACK [us]
+		long long duration;
+		// rtt[0] counts round-trip times below 1 ms, rtt[i] those in
+		// [2^(i-1), 2^i) ms. the last bucket also counts everything above.
+		unsigned long rtt[NMRP_STATS_RTT_BUCKETS];
+	} tftp;
+};
+
+// pcapng link types
+#define CAPTURE_LINKTYPE_ETHERNET 1
+#define CAPTURE_LINKTYPE_RAW      101
+
+// a pcapng file, written to by a background thread. all functions are
+// thread-safe, and timestamps have nanosecond resolution.
+struct capture;
+struct capture *capture_open(const char *path);
+// returns the new interface's id. desc may be NULL.
+unsigned capture_add_intf(struct capture *cap, const char *name,
+		const char *desc, uint16_t linktype);
+void capture_frame(struct capture *cap, unsigned intf, bool out,
+		const void *buf, size_t len);
+// writes a datagram with synthesized IPv4 and UDP headers, on a
+// CAPTURE_LINKTYPE_RAW interface. the payload is hdr, followed by data.
+void capture_udp(struct capture *cap, unsigned intf, bool out,
+		const struct sockaddr_in *src, const struct sockaddr_in *dst,
+		const void *hdr, size_t hlen, const void *data, size_t dlen);
+// flushes all packets, and closes the file
+int capture_close(struct capture *cap);
+
+// progress display on stdout, redrawn by a background thread at a fixed
+// rate, so progress_update is cheap enough to call for every packet.
+// returns NULL if stdout isn't a terminal; all functions accept NULL.
+struct progress;
+// shows a spinner if `spinner` is set, otherwise the percentage of `total`
+// (or the byte count, if 0), throughput and ETA.
+struct progress *progress_start(size_t total, bool spinner);
+void progress_update(struct progress *p, size_t bytes);
+// erases the progress display
+void progress_stop(struct progress *p);
+
+// reads from a slow source (like a pipe) in a background thread, into a
+// ring buffer of `size` bytes.
+struct readahead;
+struct readahead *readahead_open(int fd, size_t size);
+// reads using `fn` instead, which returns 0 at the end of the file, and
+// -1 on error. readahead_close waits for a pending call to return.
+struct readahead *readahead_open_cb(ssize_t (*fn)(void *arg, void *buf, size_t len),
+		void *arg, size_t size);
+// reads exactly `len` bytes, unless the end of the file has been reached.
+// returns -1 on error, and -2 if interrupted while waiting (see nmrp_interrupted).
+ssize_t readahead_read(struct readahead *ra, void *buf, size_t len);
+// doesn't close the file descriptor
+void readahead_close(struct readahead *ra);
+
+void stats_init(struct nmrp_stats *stats);
+// records the time of the first call for each phase, and returns true
+// if this was the first one.
+bool stats_phase(struct nmrp_stats *stats, enum nmrp_phase phase);
+// rtt is in [us]
+void stats_rtt(struct nmrp_stats *stats, long long rtt);
+
+// hierarchical timer wheel with a resolution of 1 ms. setting, cancelling
+// and expiring a timer are O(1). times are absolute, as returned by millis().
+// not thread-safe; each session has its own.
+#define TIMER_SLOT_BITS 6
+#define TIMER_SLOTS (1 << TIMER_SLOT_BITS)
+// 64^4 ms is about 4.6 hours; later timers are cascaded more than once
+#define TIMER_LEVELS 4
+
+struct timer
+{
+	struct timer *next;
+	// NULL if the timer isn't pending
+	struct timer **pprev;
+	long long expires;
+	unsigned char level;
+	unsigned char slot;
+};
+
+struct timer_wheel
+{
+	long long now;
+	uint64_t used[TIMER_LEVELS];
+	struct timer *slots[TIMER_LEVELS][TIMER_SLOTS];
+	struct timer *due;
+};
+
+void timer_wheel_init(struct timer_wheel *w, long long now);
+// (re)starts the timer, which must be zero-initialized before first use
+void timer_set(struct timer_wheel *w, struct timer *t, long long expires);
+void timer_cancel(struct timer_wheel *w, struct timer *t);
+#define timer_pending(t) ((t)->pprev != NULL)
+// ms until the next timer expires (possibly a bit early for timers that
+// are far off), or -1 if none is pending
+long long timer_wheel_next(struct timer_wheel *w, long long now);
+// removes and returns a timer that has expired at `now`, or NULL. call
+// until it returns NULL.
+struct timer *timer_wheel_expire(struct timer_wheel *w, long long now);
+
 struct nmrpd_args {
 	unsigned rx_timeout;
 	unsigned ul_timeout;
@@ -122,22 +361,124 @@ struct nmrpd_args {
 	// time in [s] to wait for response to ADVERTISE packets before continuing.
 	// doubles as boolean flag: if 0, blind mode is disabled
 	unsigned blind_timeout;
+	// ADVERTISE packets are sent every `adv_interval` ms for `adv_burst` ms
+	// after the link comes up (again), then at exponentially increasing
+	// intervals, up to `adv_max_interval` ms. intervals of 0 mean default.
+	unsigned adv_burst;
+	unsigned adv_interval;
+	unsigned adv_max_interval;
+	// configure the interface without waiting for the link to come up,
+	// and start advertising as soon as it does
+	bool adv_early;
 	uint16_t port;
 	const char *region;
 	off_t offset;
 	int hints;
 	struct ethsock *sock;
+	// pcap kernel buffer size in bytes (0 = default)
+	unsigned bufsize;
+	// `intf` is a VLAN interface; NMRP frames are received on its parent
+	bool trunk;
+	// don't show progress (it's never shown if stdout isn't a terminal)
+	bool quiet;
+	// upload .chk images even if chk_validate() fails
+	bool no_check;
+	// send TFTP datagrams through `sock`, from `ipaddr_intf`, which isn't
+	// added to the interface (and no ARP entry either)
+	bool raw_tftp;
+	// if set, and file_local isn't, the image is picked from here once
+	// the device has requested one
+	struct catalog *catalog;
+	// if set, address and ARP entries are removed by the caller, all at
+	// once, rather than by each session
+	struct ethsock_batch *batch;
+	// if set, statistics are written here at the end of each session,
+	// as one JSON object per line
+	FILE *stats_fp;
+	// if set, the trace of each failed session is written here
+	FILE *trace_fp;
+	// the session's packet trace, owned by nmrp_do()
+	struct trace *trace;
+	// if set, all NMRP frames and TFTP datagrams are written here
+	struct capture *capture;
+	// capture interface for TFTP datagrams, added by nmrp_do(), and the
+	// local address of the TFTP socket
+	unsigned capture_tftp;
+	struct sockaddr_in capture_addr;
+	// used instead of a socket with raw_tftp, owned by tftp_put()
+	struct udp *tftp_udp;
+#ifdef NMRPFLASH_WIN_OVERLAPPED
+	// pending receive on the TFTP socket, owned by tftp_put()
+	struct tftp_ovl *tftp_ovl;
+#elif defined(NMRPFLASH_LINUX)
+	// batched sends and receives on the TFTP socket, owned by tftp_put()
+	struct tftp_mmsg *tftp_mmsg;
+#endif
+	struct nmrp_stats stats;
+	// MAC address of the device, once known (all zeroes otherwise)
+	uint8_t hwaddr[6];
+	// opened by nmrp_do(), unless already set
+	struct image *image;
+	// remote filename, as requested by the device. per-session
+	// storage, so that sessions can run concurrently.
+	char filename[256];
+	// set by libnmrpflash. with cb->read, file_local is "-".
+	const struct nmrpflash_callbacks *cb;
 };
 
 const char *leafname(const char *path);
 ssize_t tftp_put(struct nmrpd_args *args);
 bool tftp_is_valid_filename(const char *filename);
 
+// an IPv4/UDP endpoint on an ethsock, which must have been set up with
+// ethsock_add_ipv4. frames from and to `ipaddr` are built and parsed in
+// userspace, and ARP requests for it are answered, so nothing needs to be
+// configured on the interface. datagrams are always sent to peer_hwaddr.
+struct udp;
+struct udp *udp_open(struct ethsock *sock, uint32_t ipaddr, const uint8_t *peer_hwaddr);
+// a different one for each udp_open
+uint16_t udp_port(struct udp *u);
+// sends hdr, followed by data (if dlen)
+int udp_sendto(struct udp *u, const struct sockaddr_in *dst, const void *hdr,
+		size_t hlen, const void *data, size_t dlen);
+// returns the payload's length, 0 on timeout [ms], or -1 on error. other
+// frames received in the meantime are discarded.
+ssize_t udp_recvfrom(struct udp *u, void *buf, size_t len, struct sockaddr_in *src,
+		unsigned timeout);
+void udp_close(struct udp *u);
+
 int nmrp_do(struct nmrpd_args *args);
-bool nmrp_discard(struct ethsock *sock);
+// flashes each device listed in a CSV manifest, on whichever of the
+// interfaces in args->intf (a comma-separated list) is idle, and writes
+// one CSV line per job to `results`, if set.
+int fleet_run(struct nmrpd_args *args, const char *manifest, FILE *results);
+int stats_write(FILE *fp, struct nmrpd_args *args, int status);
+
+enum trace_kind
+{
+	TRACE_NMRP_RX,
+	TRACE_NMRP_TX,
+	TRACE_TFTP_RX,
+	TRACE_TFTP_TX,
+	// arg is the timeout [ms]
+	TRACE_TFTP_TIMEOUT,
+};
+
+// a ring of the last `count` (rounded up to a power of 2) packets of a
+// session, cheap enough to always be recorded. `op` is the NMRP code or
+// TFTP opcode, `arg` the TFTP block number or error code.
+struct trace;
+struct trace *trace_open(unsigned count);
+// does nothing if t is NULL
+void trace_add(struct trace *t, enum trace_kind kind, uint8_t op, uint16_t arg, size_t len);
+void trace_dump(struct trace *t, FILE *fp, const char *intf);
+void trace_close(struct trace *t);
+bool nmrp_discard(struct ethsock *sock, struct trace *trace);
 
 int select_fd(int fd, unsigned timeout);
-const char *mac_to_str(uint8_t *mac);
+
+#define MAC_STR_LEN 18
+const char *mac_to_str(uint8_t *mac, char *buf);
 
 #ifdef NMRPFLASH_WINDOWS
 void win_perror2(const char *msg, DWORD err);
@@ -153,15 +494,42 @@ extern int verbosity;
 struct ethsock_arp_undo;
 struct ethsock_ip_undo;
 
-struct ethsock *ethsock_create(const char *intf, uint16_t protocol);
+// bufsize is the kernel buffer size in bytes; 0 uses the pcap default. if
+// `trunk` is set, intf must be a VLAN interface, and frames are received
+// through a capture handle on its parent, shared by all such sockets
+// (Linux only).
+struct ethsock *ethsock_create(const char *intf, uint16_t protocol, unsigned bufsize, bool trunk);
 bool ethsock_is_unplugged(struct ethsock *sock);
+// waits up to msec milliseconds for the link to come up. returns 1 if it did,
+// 0 on timeout, or if interrupted.
+int ethsock_wait_link(struct ethsock *sock, unsigned msec);
 bool ethsock_is_wifi(struct ethsock *sock);
 int ethsock_close(struct ethsock *sock);
 int ethsock_send(struct ethsock *sock, void *buf, size_t len);
 ssize_t ethsock_recv(struct ethsock *sock, void *buf, size_t len);
+// like ethsock_recv, but without copying. *buf remains valid until the next
+// call to ethsock_recv*, or ethsock_close.
+ssize_t ethsock_recv_ref(struct ethsock *sock, const uint8_t **buf);
+// also receive IPv4 and ARP frames, for userspace TFTP (see udp_open).
+// not supported on VLAN trunks.
+int ethsock_add_ipv4(struct ethsock *sock);
+
+// ethsock_wait() result flags
+#define ETHSOCK_READY    (1 << 0)
+#define ETHSOCK_READY_FD (1 << 1)
+// waits until either the ethsock, or fd (if >= 0) is readable. returns a
+// combination of ETHSOCK_READY* flags, 0 on timeout, or -1 on error.
+int ethsock_wait(struct ethsock *sock, int fd, unsigned msec);
+#ifdef NMRPFLASH_WIN_OVERLAPPED
+// same as ethsock_wait, but with an event handle. ETHSOCK_READY_FD is
+// set if it's signaled.
+int ethsock_wait_handle(struct ethsock *sock, HANDLE handle, unsigned msec);
+#endif
 int ethsock_set_timeout(struct ethsock *sock, unsigned msec);
 unsigned ethsock_get_timeout(struct ethsock *sock);
 uint8_t *ethsock_get_hwaddr(struct ethsock *sock);
+// returns 0 if unknown
+unsigned ethsock_get_mtu(struct ethsock *sock);
 int ethsock_arp_add(struct ethsock *sock, uint8_t *hwaddr, uint32_t ipaddr, struct ethsock_arp_undo **undo);
 int ethsock_arp_del(struct ethsock *sock, struct ethsock_arp_undo **undo);
 int ethsock_list_all(void);
@@ -180,12 +548,135 @@ int ethsock_for_each_ip(struct ethsock *sock, ethsock_ip_callback_t callback,
 int ethsock_ip_add(struct ethsock *sock, uint32_t ipaddr, uint32_t ipmask, struct ethsock_ip_undo **undo);
 int ethsock_ip_del(struct ethsock *sock, struct ethsock_ip_undo **undo);
 
+// a batch collects address and ARP changes from any number of sockets, and
+// applies them all at once, when committed. ethsock_batch_new returns NULL
+// if batches aren't supported, in which case changes are applied right away.
+struct ethsock_batch;
+struct ethsock_batch *ethsock_batch_new(void);
+// queues all further address and ARP changes on batch (if not NULL)
+void ethsock_set_batch(struct ethsock *sock, struct ethsock_batch *batch);
+// applies all queued changes, and frees the batch
+int ethsock_batch_commit(struct ethsock_batch *batch);
+// writes all frames sent and received to cap (if not NULL)
+void ethsock_set_capture(struct ethsock *sock, struct capture *cap);
+
+#ifdef NMRPFLASH_LINUX
+// temporarily disables NetworkManager on the given interfaces, if running.
+// calls are reference counted per interface, and must be matched by calls
+// to nm_restore.
+int nm_unmanage(const char **intfs, size_t count);
+void nm_restore(const char **intfs, size_t count);
+#endif
+
+#ifdef NMRPFLASH_TPACKET
+// AF_PACKET socket with a TPACKET_V3 receive ring, used by ethsock
+// instead of libpcap if available.
+struct tpacket;
+// with `vlan`, only 802.1Q tagged frames are received.
+struct tpacket *tpacket_open(const char *intf, uint16_t protocol,
+		const uint8_t *hwaddr, unsigned snaplen, unsigned bufsize, bool vlan);
+int tpacket_fd(struct tpacket *tp);
+// also receive IPv4 and ARP frames
+int tpacket_add_ipv4(struct tpacket *tp);
+// *buf remains valid until the next call. timeout -1 waits forever. the
+// frame's VLAN ID (or 0) is stored in *vid, unless NULL.
+ssize_t tpacket_recv_ref(struct tpacket *tp, const uint8_t **buf, uint16_t *vid, int timeout);
+int tpacket_send(struct tpacket *tp, const void *buf, size_t len);
+void tpacket_close(struct tpacket *tp);
+#endif
+
 time_t time_monotonic();
 long long millis();
-char *xlltostr(long long ll, int base);
+long long micros();
+
+// retransmission timeout estimator
+struct rto
+{
+	unsigned samples;
+	// smoothed round-trip time, and its variation [us]
+	long long srtt;
+	long long rttvar;
+	// current timeout, including backoff [ms]
+	unsigned timeout;
+	unsigned min;
+	unsigned max;
+};
+
+void rto_init(struct rto *rto, unsigned initial, unsigned min, unsigned max);
+// feed a round-trip time [us] of a packet that wasn't retransmitted
+void rto_update(struct rto *rto, long long rtt);
+void rto_backoff(struct rto *rto);
+
+#define XLLTOSTR_LEN 32
+char *xlltostr(long long ll, int base, char *buf);
 uint32_t bitcount(uint32_t n);
 uint32_t netmask(uint32_t count);
+// the device's and our address on the `index`-th interface, when flashing
+// through several: each gets its own subnet (`mask`, in network byte order),
+// otherwise the host wouldn't know which interface to send TFTP packets on.
+void subnet_addrs(uint32_t mask, unsigned index, char *ipaddr, char *ipaddr_intf);
+// adds `len` bytes to a one's complement sum. all but the last buffer
+// added to a sum must have an even length.
+uint32_t ip_sum(uint32_t sum, const void *buf, size_t len);
+// returns the (network byte order) checksum of a sum
+uint16_t ip_sum_fold(uint32_t sum);
+uint16_t ip_checksum(const void *buf, size_t len);
 void xperror(const char *msg);
 
+#ifndef NMRPFLASH_WINDOWS
+typedef pthread_t xthread_t;
+typedef pthread_mutex_t xmutex_t;
+typedef pthread_cond_t xcond_t;
+#define XMUTEX_INITIALIZER PTHREAD_MUTEX_INITIALIZER
+#define XCOND_INITIALIZER PTHREAD_COND_INITIALIZER
+#else
+typedef HANDLE xthread_t;
+typedef SRWLOCK xmutex_t;
+typedef CONDITION_VARIABLE xcond_t;
+#define XMUTEX_INITIALIZER SRWLOCK_INIT
+#define XCOND_INITIALIZER CONDITION_VARIABLE_INIT
+#endif
+
+int xthread_create(xthread_t *thread, void *(*fn)(void *), void *arg);
+int xthread_join(xthread_t thread);
+void xthread_detach(xthread_t thread);
+void xmutex_lock(xmutex_t *mutex);
+void xmutex_unlock(xmutex_t *mutex);
+void xcond_wait(xcond_t *cond, xmutex_t *mutex);
+// may return early, so the caller must check its condition
+void xcond_timedwait(xcond_t *cond, xmutex_t *mutex, unsigned msec);
+void xcond_broadcast(xcond_t *cond);
+
 extern volatile sig_atomic_t g_interrupted;
+
+// cancellation of library sessions, which must neither affect each other,
+// nor outlive the session. set for the thread running the session.
+struct nmrp_cancel
+{
+	volatile sig_atomic_t cancel;
+	// g_interrupts when the session was started
+	sig_atomic_t interrupts;
+};
+
+// incremented by nmrpflash_interrupt
+extern volatile sig_atomic_t g_interrupts;
+extern __thread struct nmrp_cancel *g_cancel;
+
+// whether the current session should stop: on Ctrl-C, or if cancelled
+static inline bool nmrp_interrupted(void)
+{
+	return g_interrupted || (g_cancel && (g_cancel->cancel
+				|| g_cancel->interrupts != g_interrupts));
+}
+
+#ifdef NMRPFLASH_FUZZ
+// reads up to `len` bytes of the current input, like read(2)
+ssize_t fuzz_read(void *buf, size_t len);
+bool fuzz_pending(void);
+// run only the parsers on a single packet
+void nmrp_fuzz_pkt(const uint8_t *buf, size_t len);
+void tftp_fuzz_pkt(const uint8_t *buf, size_t len);
+// compare the .chk checksum's SSE2 and scalar paths, aborting on mismatch
+void chk_fuzz_sum(const uint8_t *buf, size_t len);
+#endif
 #endif
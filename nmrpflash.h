@@ -0,0 +1,132 @@
+/**
+ * nmrpflash - Netgear Unbrick Utility
+ * Copyright (C) 2016 Joseph Lehner <joseph.c.lehner@gmail.com>
+ *
+ * nmrpflash is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * nmrpflash is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with nmrpflash.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+// public interface of libnmrpflash. sessions on different interfaces can
+// be run concurrently, from any number of threads. messages are still
+// written to stdout and stderr.
+
+#ifndef NMRPFLASH_H
+#define NMRPFLASH_H
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// session milestones, in the order they're normally reached
+enum nmrpflash_phase
+{
+	NMRPFLASH_PHASE_OPEN,      // interface opened
+	NMRPFLASH_PHASE_LINK,      // Ethernet link is up
+	NMRPFLASH_PHASE_IP,        // interface address added or validated
+	NMRPFLASH_PHASE_ADVERTISE, // device responded
+	NMRPFLASH_PHASE_ARP,       // ARP entry for the device added
+	NMRPFLASH_PHASE_UL_REQ,    // device requested an upload
+	NMRPFLASH_PHASE_UPLOAD,    // TFTP upload finished
+	NMRPFLASH_PHASE_CLOSE,     // device closed the session
+	NMRPFLASH_PHASE_COUNT
+};
+
+// possible causes of a failed session, see nmrpflash_session_hints
+#define NMRPFLASH_HINT_FIRMWARE_INVALID     (1 << 0)
+#define NMRPFLASH_HINT_NO_ETHERNET          (1 << 1)
+#define NMRPFLASH_HINT_NO_RESPONSE          (1 << 2)
+#define NMRPFLASH_HINT_TFTP_FAILURE         (1 << 3)
+
+// the device, as passed to the upload callback. ipaddr and ipmask are
+// dotted-quad strings.
+struct nmrpflash_device
+{
+	const char *intf;
+	const char *ipaddr;
+	const char *ipmask;
+	const char *mac;
+	uint16_t port;
+};
+
+// all callbacks are optional, and are called from the thread running
+// nmrpflash_session_run, with `arg` as their first argument.
+struct nmrpflash_callbacks
+{
+	void *arg;
+	// called once for each phase that is reached
+	void (*phase)(void *arg, enum nmrpflash_phase phase);
+	// called for each TFTP block. total is 0 if the size isn't known.
+	void (*progress)(void *arg, size_t bytes, size_t total);
+	// called after the device has requested an upload, and before the
+	// image (if any) is sent. if there's no image, this callback does the
+	// upload itself. a non-zero return value aborts the session.
+	int (*upload)(void *arg, const struct nmrpflash_device *dev);
+	// reads the image, if it's not passed as a buffer. must fill `buf`
+	// completely, unless the end of the image has been reached. returns
+	// the number of bytes read, or -1 on error. called from a background
+	// thread, but never concurrently for the same session.
+	ssize_t (*read)(void *arg, void *buf, size_t len);
+};
+
+struct nmrpflash_opts
+{
+	// mandatory
+	const char *intf;
+	// all of the following are optional (NULL or 0 for the default)
+	const char *ipaddr;
+	const char *ipaddr_intf;
+	const char *ipmask;
+	const char *mac;
+	const char *file_remote;
+	const char *region;
+	uint16_t port;
+	unsigned rx_timeout_ms;
+	unsigned ul_timeout_ms;
+	// the image, unless it's read using the read callback. the buffer
+	// must remain valid until nmrpflash_session_run has returned.
+	const void *image;
+	size_t image_len;
+};
+
+struct nmrpflash_session;
+
+// must be called once, before any other function
+int nmrpflash_init(void);
+// copies opts and cb, but none of the strings
+struct nmrpflash_session *nmrpflash_session_new(const struct nmrpflash_opts *opts,
+		const struct nmrpflash_callbacks *cb);
+// returns 0 on success
+int nmrpflash_session_run(struct nmrpflash_session *s);
+// NMRPFLASH_HINT_* flags of the last run
+int nmrpflash_session_hints(struct nmrpflash_session *s);
+// microseconds since the start of the last run at which `phase` was
+// reached, or -1
+long long nmrpflash_session_phase_time(struct nmrpflash_session *s,
+		enum nmrpflash_phase phase);
+void nmrpflash_session_free(struct nmrpflash_session *s);
+// aborts a running session, from another thread. sessions started
+// afterwards aren't affected. safe to call from a signal handler.
+void nmrpflash_session_cancel(struct nmrpflash_session *s);
+// aborts all running sessions, but not those started afterwards. safe to
+// call from a signal handler.
+void nmrpflash_interrupt(void);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,200 @@
+/**
+ * nmrpflash - Netgear Unbrick Utility
+ * Copyright (C) 2016 Joseph Lehner <joseph.c.lehner@gmail.com>
+ *
+ * nmrpflash is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * nmrpflash is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with nmrpflash.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdio.h>
+#include "nmrpd.h"
+
+#ifdef NMRPFLASH_WINDOWS
+#include <io.h>
+#define isatty _isatty
+#define fileno _fileno
+#endif
+
+#define PROGRESS_HZ 10
+// throughput is averaged over this many samples
+#define PROGRESS_SAMPLES PROGRESS_HZ
+
+struct progress
+{
+	xthread_t thread;
+	xmutex_t lock;
+	xcond_t cond;
+	// written by the caller
+	size_t bytes;
+	bool done;
+	// owned by the renderer
+	size_t total;
+	bool spinner;
+	unsigned ticks;
+	size_t samples[PROGRESS_SAMPLES];
+	// width of the last output
+	int width;
+};
+
+static const char *spinner = "\\|/-";
+
+static void progress_back(int width)
+{
+	static const char backspaces[] = "\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b"
+		"\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b"
+		"\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b";
+	printf("%.*s", width, backspaces);
+}
+
+static void progress_size(char *buf, size_t len, double bytes, const char *suffix)
+{
+	if (bytes >= 1024 * 1024) {
+		snprintf(buf, len, "%.1f MiB%s", bytes / (1024 * 1024), suffix);
+	} else {
+		snprintf(buf, len, "%.0f KiB%s", bytes / 1024, suffix);
+	}
+}
+
+static void progress_render(struct progress *p, size_t bytes)
+{
+	char buf[64], size[24], rate[24];
+	unsigned n, eta;
+	double bps;
+	int len;
+
+	++p->ticks;
+
+	if (p->spinner) {
+		len = snprintf(buf, sizeof(buf), "%c ", spinner[p->ticks & 3]);
+	} else {
+		// bytes per second, over the last second (or less, at the start)
+		n = MIN(p->ticks, PROGRESS_SAMPLES);
+		bps = (double)(bytes - p->samples[p->ticks % PROGRESS_SAMPLES]) * PROGRESS_HZ / n;
+		p->samples[p->ticks % PROGRESS_SAMPLES] = bytes;
+
+		progress_size(rate, sizeof(rate), bps, "/s");
+
+		if (p->total) {
+			if (bps >= 1) {
+				eta = (p->total - MIN(bytes, p->total)) / bps;
+				len = snprintf(buf, sizeof(buf), "%3d %% %s, ETA %u:%02u ",
+						(int)(((double)bytes * 100) / p->total), rate, eta / 60, eta % 60);
+			} else {
+				len = snprintf(buf, sizeof(buf), "%3d %% ",
+						(int)(((double)bytes * 100) / p->total));
+			}
+		} else {
+			progress_size(size, sizeof(size), bytes, "");
+			len = snprintf(buf, sizeof(buf), "%c %s, %s ",
+					spinner[p->ticks & 3], size, rate);
+		}
+	}
+
+	// pad, to overwrite any leftovers from the last, longer output
+	printf("%s%*s", buf, MAX(p->width - len, 0), "");
+	fflush(stdout);
+	p->width = MAX(p->width, len);
+	// not flushed, so that whatever is printed next, including our
+	// next update, overwrites this one.
+	progress_back(p->width);
+}
+
+static void *progress_thread(void *arg)
+{
+	struct progress *p = arg;
+	long long next = millis();
+	long long now;
+	size_t bytes;
+
+	xmutex_lock(&p->lock);
+
+	while (!p->done) {
+		next += 1000 / PROGRESS_HZ;
+		while (!p->done && (now = millis()) < next) {
+			xcond_timedwait(&p->cond, &p->lock, next - now);
+		}
+
+		if (p->done) {
+			break;
+		}
+
+		bytes = p->bytes;
+		xmutex_unlock(&p->lock);
+		progress_render(p, bytes);
+		xmutex_lock(&p->lock);
+	}
+
+	xmutex_unlock(&p->lock);
+	return NULL;
+}
+
+struct progress *progress_start(size_t total, bool spinner)
+{
+	struct progress *p;
+
+	if (!isatty(fileno(stdout))) {
+		return NULL;
+	}
+
+	p = calloc(1, sizeof(*p));
+	if (!p) {
+		xperror("calloc");
+		return NULL;
+	}
+
+	p->lock = (xmutex_t)XMUTEX_INITIALIZER;
+	p->cond = (xcond_t)XCOND_INITIALIZER;
+	p->total = total;
+	p->spinner = spinner;
+
+	if (xthread_create(&p->thread, &progress_thread, p) != 0) {
+		free(p);
+		return NULL;
+	}
+
+	return p;
+}
+
+void progress_update(struct progress *p, size_t bytes)
+{
+	if (p) {
+		xmutex_lock(&p->lock);
+		p->bytes = bytes;
+		xmutex_unlock(&p->lock);
+	}
+}
+
+void progress_stop(struct progress *p)
+{
+	if (!p) {
+		return;
+	}
+
+	xmutex_lock(&p->lock);
+	p->done = true;
+	xcond_broadcast(&p->cond);
+	xmutex_unlock(&p->lock);
+
+	xthread_join(p->thread);
+
+	if (p->width) {
+		printf("%*s", p->width, "");
+		progress_back(p->width);
+	}
+
+	free(p);
+}
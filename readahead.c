@@ -0,0 +1,221 @@
+/**
+ * nmrpflash - Netgear Unbrick Utility
+ * Copyright (C) 2016 Joseph Lehner <joseph.c.lehner@gmail.com>
+ *
+ * nmrpflash is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * nmrpflash is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with nmrpflash.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include "nmrpd.h"
+
+// how often a blocking readahead_read checks nmrp_interrupted [ms]
+#define READAHEAD_POLL_MS 100
+
+struct readahead
+{
+	xthread_t thread;
+	xmutex_t lock;
+	xcond_t cond;
+	int fd;
+	// if set, used instead of read(fd)
+	ssize_t (*fn)(void *arg, void *buf, size_t len);
+	void *arg;
+	char *buf;
+	size_t size;
+	// bytes [tail, head) are buffered. both only ever grow, and
+	// are used modulo `size`.
+	size_t head;
+	size_t tail;
+	// errno of the failed read, if any
+	int err;
+	bool eof;
+	// set by readahead_close
+	bool done;
+	// the reader thread is blocked in read(), without holding `lock`
+	bool reading;
+};
+
+static void *readahead_thread(void *arg)
+{
+	struct readahead *ra = arg;
+	size_t off, len;
+	ssize_t ret;
+
+	xmutex_lock(&ra->lock);
+
+	while (!ra->done && !ra->eof && !ra->err) {
+		if (ra->head - ra->tail == ra->size) {
+			xcond_wait(&ra->cond, &ra->lock);
+			continue;
+		}
+
+		// only this thread writes to the free part of the buffer, so
+		// it can be filled without holding the lock.
+		off = ra->head % ra->size;
+		len = MIN(ra->size - off, ra->size - (ra->head - ra->tail));
+		ra->reading = true;
+		xmutex_unlock(&ra->lock);
+
+		if (ra->fn) {
+			errno = 0;
+			ret = ra->fn(ra->arg, ra->buf + off, len);
+		} else {
+			ret = read(ra->fd, ra->buf + off, len);
+		}
+
+		xmutex_lock(&ra->lock);
+		ra->reading = false;
+
+		if (ra->done) {
+			// readahead_close didn't wait for us
+			xmutex_unlock(&ra->lock);
+			free(ra->buf);
+			free(ra);
+			return NULL;
+		} else if (ret > 0) {
+			ra->head += ret;
+		} else if (!ret) {
+			ra->eof = true;
+		} else if (ra->fn || errno != EINTR) {
+			// the callback might not have set errno
+			ra->err = errno ? errno : EIO;
+		}
+
+		xcond_broadcast(&ra->cond);
+	}
+
+	xmutex_unlock(&ra->lock);
+	return NULL;
+}
+
+// frees `ra` on failure
+static struct readahead *readahead_start(struct readahead *ra, size_t size)
+{
+	ra->buf = malloc(size);
+	if (!ra->buf) {
+		xperror("malloc");
+		free(ra);
+		return NULL;
+	}
+
+	ra->lock = (xmutex_t)XMUTEX_INITIALIZER;
+	ra->cond = (xcond_t)XCOND_INITIALIZER;
+	ra->size = size;
+
+	if (xthread_create(&ra->thread, &readahead_thread, ra) != 0) {
+		free(ra->buf);
+		free(ra);
+		return NULL;
+	}
+
+	return ra;
+}
+
+struct readahead *readahead_open(int fd, size_t size)
+{
+	struct readahead *ra = calloc(1, sizeof(*ra));
+	if (!ra) {
+		xperror("calloc");
+		return NULL;
+	}
+
+	ra->fd = fd;
+	return readahead_start(ra, size);
+}
+
+struct readahead *readahead_open_cb(ssize_t (*fn)(void *arg, void *buf, size_t len),
+		void *arg, size_t size)
+{
+	struct readahead *ra = calloc(1, sizeof(*ra));
+	if (!ra) {
+		xperror("calloc");
+		return NULL;
+	}
+
+	ra->fd = -1;
+	ra->fn = fn;
+	ra->arg = arg;
+	return readahead_start(ra, size);
+}
+
+ssize_t readahead_read(struct readahead *ra, void *buf, size_t len)
+{
+	size_t off, n, chunk;
+	ssize_t ret;
+
+	xmutex_lock(&ra->lock);
+
+	while (ra->head - ra->tail < len && !ra->eof && !ra->err) {
+		if (nmrp_interrupted()) {
+			xmutex_unlock(&ra->lock);
+			return -2;
+		}
+
+		xcond_timedwait(&ra->cond, &ra->lock, READAHEAD_POLL_MS);
+	}
+
+	n = MIN(len, ra->head - ra->tail);
+
+	if (n < len && ra->err) {
+		// the upload can't be completed anyway
+		errno = ra->err;
+		ret = -1;
+	} else {
+		off = ra->tail % ra->size;
+		chunk = MIN(n, ra->size - off);
+		memcpy(buf, ra->buf + off, chunk);
+		memcpy((char*)buf + chunk, ra->buf, n - chunk);
+		ra->tail += n;
+		xcond_broadcast(&ra->cond);
+		ret = n;
+	}
+
+	xmutex_unlock(&ra->lock);
+	return ret;
+}
+
+void readahead_close(struct readahead *ra)
+{
+	xthread_t thread;
+	bool reading;
+
+	if (!ra) {
+		return;
+	}
+
+	thread = ra->thread;
+	xmutex_lock(&ra->lock);
+	ra->done = true;
+	reading = ra->reading;
+	xcond_broadcast(&ra->cond);
+	xmutex_unlock(&ra->lock);
+
+	if (reading && !ra->fn) {
+		// the thread may be stuck in read() indefinitely, so we let
+		// it clean up after itself once it returns. callbacks are
+		// waited for, as the caller may free their argument after
+		// this.
+		xthread_detach(thread);
+		return;
+	}
+
+	xthread_join(thread);
+	free(ra->buf);
+	free(ra);
+}
@@ -0,0 +1,146 @@
+/**
+ * nmrpflash - Netgear Unbrick Utility
+ * Copyright (C) 2016 Joseph Lehner <joseph.c.lehner@gmail.com>
+ *
+ * nmrpflash is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * nmrpflash is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with nmrpflash.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <string.h>
+#include <stdio.h>
+#include "nmrpd.h"
+
+// these names are part of the output format, so don't change them
+static const char *phase_names[NMRP_PHASE_COUNT] = {
+	[NMRP_PHASE_OPEN] = "open",
+	[NMRP_PHASE_LINK] = "link",
+	[NMRP_PHASE_IP] = "ip",
+	[NMRP_PHASE_ADVERTISE] = "advertise",
+	[NMRP_PHASE_ARP] = "arp",
+	[NMRP_PHASE_UL_REQ] = "ul_req",
+	[NMRP_PHASE_UPLOAD] = "upload",
+	[NMRP_PHASE_CLOSE] = "close",
+};
+
+// sessions write to the same file
+static xmutex_t stats_lock = XMUTEX_INITIALIZER;
+
+void stats_init(struct nmrp_stats *stats)
+{
+	int i;
+
+	memset(stats, 0, sizeof(*stats));
+	stats->start = micros();
+
+	for (i = 0; i < NMRP_PHASE_COUNT; ++i) {
+		stats->phases[i] = -1;
+	}
+}
+
+bool stats_phase(struct nmrp_stats *stats, enum nmrp_phase phase)
+{
+	if (stats->phases[phase] < 0) {
+		stats->phases[phase] = micros() - stats->start;
+		return true;
+	}
+
+	return false;
+}
+
+void stats_rtt(struct nmrp_stats *stats, long long rtt)
+{
+	int i;
+
+	for (i = 0, rtt /= 1000; rtt && i < NMRP_STATS_RTT_BUCKETS - 1; rtt >>= 1) {
+		++i;
+	}
+
+	++stats->tftp.rtt[i];
+}
+
+static void json_str(FILE *fp, const char *s)
+{
+	if (!s) {
+		fprintf(fp, "null");
+		return;
+	}
+
+	fputc('"', fp);
+
+	for (; *s; ++s) {
+		if (*s == '"' || *s == '\\') {
+			fprintf(fp, "\\%c", *s);
+		} else if ((unsigned char)*s < 0x20) {
+			fprintf(fp, "\\u%04x", *s);
+		} else {
+			fputc(*s, fp);
+		}
+	}
+
+	fputc('"', fp);
+}
+
+int stats_write(FILE *fp, struct nmrpd_args *args, int status)
+{
+	struct nmrp_stats *st = &args->stats;
+	long long elapsed = micros() - st->start;
+	int i, ret;
+
+	xmutex_lock(&stats_lock);
+
+	fprintf(fp, "{\"interface\":");
+	json_str(fp, args->intf);
+	fprintf(fp, ",\"ipaddr\":");
+	json_str(fp, args->ipaddr);
+	fprintf(fp, ",\"status\":%d,\"hints\":%d,\"elapsed_us\":%lld,\"phases_us\":{",
+			status, args->hints, elapsed);
+
+	for (i = 0; i < NMRP_PHASE_COUNT; ++i) {
+		fprintf(fp, i ? ",\"%s\":" : "\"%s\":", phase_names[i]);
+		if (st->phases[i] >= 0) {
+			fprintf(fp, "%lld", st->phases[i]);
+		} else {
+			fprintf(fp, "null");
+		}
+	}
+
+	fprintf(fp, "},\"nmrp\":{\"advertise\":%u,\"ul_reqs\":%u,\"keep_alive_reqs\":%u}",
+			st->advertise, st->ul_reqs, st->ka_reqs);
+
+	fprintf(fp, ",\"tftp\":{\"bytes\":%lu,\"blocks\":%lu,\"resends\":%lu,"
+			"\"dup_acks\":%lu,\"timeouts\":%lu,\"wrqs\":%lu,\"restarts\":%lu,"
+			"\"blksize\":%u,\"windowsize\":%u,\"duration_us\":%lld,"
+			"\"throughput_bps\":%lld,\"rtt_hist_ms\":[",
+			st->tftp.bytes, st->tftp.blocks, st->tftp.resends,
+			st->tftp.dup_acks, st->tftp.timeouts, st->tftp.wrqs,
+			st->tftp.restarts, st->tftp.blksize, st->tftp.windowsize,
+			st->tftp.duration,
+			st->tftp.duration ? (st->tftp.bytes * 8000000LL) / st->tftp.duration : 0);
+
+	for (i = 0; i < NMRP_STATS_RTT_BUCKETS; ++i) {
+		fprintf(fp, i ? ",%lu" : "%lu", st->tftp.rtt[i]);
+	}
+
+	fprintf(fp, "]}}\n");
+	ret = fflush(fp);
+
+	xmutex_unlock(&stats_lock);
+
+	if (ret != 0) {
+		xperror("fflush");
+		return -1;
+	}
+
+	return 0;
+}
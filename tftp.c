@@ -17,21 +17,86 @@
  *
  */
 
-#include <sys/stat.h>
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+// sendmmsg() and recvmmsg()
+#define _GNU_SOURCE
+#endif
+
 #include <string.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <errno.h>
-#include <fcntl.h>
 #include <ctype.h>
 #include "nmrpd.h"
 
-#ifndef O_BINARY
-#define O_BINARY 0
+#ifdef NMRPFLASH_WIN_FW_COM
+#define COBJMACROS
+#include <objbase.h>
+#include <oleauto.h>
+#include <netfw.h>
+#endif
+
+#if defined(NMRPFLASH_LINUX) && !defined(NMRPFLASH_FUZZ)
+#define TFTP_MMSG
+#include <netinet/udp.h>
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
 #endif
 
+// used if the interface MTU is unknown
 #define TFTP_BLKSIZE 1456
+// largest blksize that fits into a UDP datagram (RFC 2348)
+#define TFTP_MAX_BLKSIZE 65464
+// IPv4 (without options), UDP, and TFTP DATA headers
+#define TFTP_DATA_OVERHEAD (20 + 8 + 4)
+// TFTP error code: option negotiation refused (RFC 2347)
+#define TFTP_ERR_OPTION 8
+// number of blocks in flight (RFC 7440)
+#define TFTP_WINDOWSIZE 8
+// number of datagrams received at once, with recvmmsg
+#define TFTP_MMSG_RX 8
+// largest UDP payload that fits into an IPv4 datagram, and the maximum
+// number of segments of a UDP GSO send (UDP_MAX_SEGMENTS)
+#define TFTP_GSO_MAX_LEN 65507
+#define TFTP_GSO_MAX_SEGS 64
+// lower bound of the retransmission timeout [ms]
+#define TFTP_MIN_RTO_MS 10
+// how much is read ahead from stdin [b]
+#define TFTP_READAHEAD (4 * 1024 * 1024)
+
+// block sizes to fall back to if block 1 is never acknowledged (because
+// the remote, or something in between, drops large packets), or if the
+// remote refuses the option.
+static const uint16_t blksize_ladder[] = { 1456, 1024, 512 };
+
+// the options sent in the WRQ. fewer are sent each time the remote
+// refuses them, or never acknowledges block 1, see tftp_opts_refused and
+// tftp_opts_timeout.
+enum tftp_opts
+{
+	// blksize, tsize, windowsize, and rollover if needed
+	TFTP_OPTS_ALL,
+	// blksize only, as older versions sent
+	TFTP_OPTS_BLKSIZE,
+	TFTP_OPTS_NONE,
+	// blksize only, walking down blksize_ladder
+	TFTP_OPTS_LADDER,
+};
+
+#define BLKSIZE_CACHE_SIZE 64
+
+// remembers the blksize and options that worked for a device, so that
+// later sessions (and devices with the same OUI) can skip the ones that
+// didn't.
+static struct {
+	uint8_t hwaddr[6];
+	uint16_t blksize;
+	uint8_t opts;
+} blksize_cache[BLKSIZE_CACHE_SIZE];
+static unsigned blksize_cache_next = 0;
+static xmutex_t blksize_lock = XMUTEX_INITIALIZER;
 
 static const char *opcode_names[] = {
 	"RRQ", "WRQ", "DATA", "ACK", "ERR", "OACK"
@@ -132,8 +197,13 @@ static size_t pkt_xrqlen(char *pkt)
 	return 514 - rem;
 }
 
-static void pkt_mkwrq(char *pkt, const char *filename, unsigned blksize)
+// tsize is omitted if negative. the rollover option (0 meaning that block
+// numbers wrap around to 0) is only sent if `rollover` is set.
+static void pkt_mkwrq(char *pkt, const char *filename, unsigned blksize,
+		unsigned windowsize, off_t tsize, bool rollover)
 {
+	char buf[XLLTOSTR_LEN];
+
 	filename = leafname(filename);
 	if (!tftp_is_valid_filename(filename)) {
 		fprintf(stderr, "Overlong/illegal filename; using 'firmware'.\n");
@@ -146,8 +216,24 @@ static void pkt_mkwrq(char *pkt, const char *filename, unsigned blksize)
 	pkt = pkt_mkopt(pkt, filename, "octet");
 
 	if (blksize && blksize != 512) {
-		pkt = pkt_mkopt(pkt, "blksize", xlltostr(blksize, 10));
+		pkt = pkt_mkopt(pkt, "blksize", xlltostr(blksize, 10, buf));
+	}
+
+	if (tsize >= 0) {
+		pkt = pkt_mkopt(pkt, "tsize", xlltostr(tsize, 10, buf));
+	}
+
+	if (windowsize > 1) {
+		pkt = pkt_mkopt(pkt, "windowsize", xlltostr(windowsize, 10, buf));
+	}
+
+	if (rollover) {
+		pkt = pkt_mkopt(pkt, "rollover", "0");
 	}
+
+	// pkt_xrqlen stops here, rather than at the options of a previous,
+	// longer WRQ in the same buffer.
+	*pkt = '\0';
 }
 
 static inline void pkt_print(char *pkt, FILE *fp)
@@ -176,46 +262,315 @@ static inline void pkt_print(char *pkt, FILE *fp)
 	}
 }
 
-static ssize_t tftp_recvfrom(int sock, char *pkt, uint16_t* port,
-		unsigned timeout, size_t pktlen)
+// DATA and ACK packets are only traced, since printing each one would
+// slow down the upload, and change its timing. at -vvv, the trace is
+// printed once the session is over.
+static void tftp_trace(struct nmrpd_args *args, bool out, char *pkt, size_t len)
 {
-	ssize_t len;
-	struct sockaddr_in src;
+	uint16_t opcode = pkt_num(pkt);
+
+	trace_add(args->trace, out ? TRACE_TFTP_TX : TRACE_TFTP_RX, opcode,
+			pkt_num(pkt + 2), len);
+
+	// invalid ones are reported by tftp_check
+	if (verbosity > 2 && opcode && opcode <= OACK && opcode != DATA && opcode != ACK) {
+		printf(out ? "<< " : ">> ");
+		pkt_print(pkt, stdout);
+		printf("\n");
+	}
+}
+
+// the local address of an unconnected socket is unknown until the kernel
+// has picked a route, so ask it which one it would use for `peer`.
+static void tftp_capture_addr(int sock, struct sockaddr_in *peer,
+		struct sockaddr_in *local)
+{
+	struct sockaddr_in addr;
 #ifndef NMRPFLASH_WINDOWS
-	socklen_t alen;
+	socklen_t alen = sizeof(addr);
 #else
-	int alen;
+	int alen = sizeof(addr);
 #endif
+	int fd;
 
-	len = select_fd(sock, timeout);
-	if (len < 0) {
-		return -1;
-	} else if (!len) {
+	memset(local, 0, sizeof(*local));
+	local->sin_family = AF_INET;
+
+	if (getsockname(sock, (struct sockaddr*)&addr, &alen) == 0) {
+		local->sin_port = addr.sin_port;
+	}
+
+	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (fd < 0) {
+		return;
+	}
+
+	alen = sizeof(addr);
+	if (!connect(fd, (struct sockaddr*)peer, sizeof(*peer))
+			&& !getsockname(fd, (struct sockaddr*)&addr, &alen)) {
+		local->sin_addr = addr.sin_addr;
+	}
+
+#ifndef NMRPFLASH_WINDOWS
+	close(fd);
+#else
+	closesocket(fd);
+#endif
+}
+
+// the payload is pkt, followed by data (if not NULL)
+static void tftp_capture(int sock, bool out, struct sockaddr_in *peer,
+		const char *pkt, size_t len, const void *data, size_t dlen,
+		struct nmrpd_args *args)
+{
+	struct sockaddr_in *local = &args->capture_addr;
+
+	if (!local->sin_port) {
+		tftp_capture_addr(sock, peer, local);
+	}
+
+	if (out) {
+		capture_udp(args->capture, args->capture_tftp, true, local, peer,
+				pkt, len, data, dlen);
+	} else {
+		capture_udp(args->capture, args->capture_tftp, false, peer, local,
+				pkt, len, data, dlen);
+	}
+}
+
+#ifdef NMRPFLASH_WIN_OVERLAPPED
+// an overlapped receive on the TFTP socket. its event is waited for
+// together with the NMRP ethsock's, which select() can't do, and which
+// would otherwise require a WSAEventSelect (and switching the socket back
+// to blocking mode) for every single wait.
+struct tftp_ovl
+{
+	WSAOVERLAPPED ov;
+	bool pending;
+	char buf[2048];
+	struct sockaddr_in src;
+	int srclen;
+	DWORD flags;
+};
+
+static int tftp_ovl_post(struct tftp_ovl *o, int sock)
+{
+	WSABUF buf = { .len = sizeof(o->buf), .buf = o->buf };
+	WSAEVENT event = o->ov.hEvent;
+
+	if (o->pending) {
 		return 0;
 	}
 
-#ifndef NMRPFLASH_FUZZ
-	alen = sizeof(src);
-	len = recvfrom(sock, pkt, pktlen, 0, (struct sockaddr*)&src, &alen);
-	if (len < 0) {
-		sock_perror("recvfrom");
+	memset(&o->ov, 0, sizeof(o->ov));
+	o->ov.hEvent = event;
+	WSAResetEvent(event);
+	o->srclen = sizeof(o->src);
+	o->flags = 0;
+
+	// if the datagram is already there, the event is signaled right away
+	if (WSARecvFrom(sock, &buf, 1, NULL, &o->flags, (struct sockaddr*)&o->src,
+				&o->srclen, &o->ov, NULL) != 0 && WSAGetLastError() != WSA_IO_PENDING) {
+		sock_perror("WSARecvFrom");
 		return -1;
 	}
-#else
-	len = read(sock, pkt, pktlen);
-	if (len < 0) {
-		perror("read");
+
+	o->pending = true;
+	return 0;
+}
+
+// must only be called once the event is signaled
+static ssize_t tftp_ovl_complete(struct tftp_ovl *o, int sock, char *pkt,
+		size_t pktlen, struct sockaddr_in *src)
+{
+	DWORD bytes, flags;
+
+	o->pending = false;
+
+	if (!WSAGetOverlappedResult(sock, &o->ov, &bytes, FALSE, &flags)) {
+		sock_perror("WSARecvFrom");
 		return -1;
 	}
+
+	*src = o->src;
+	bytes = MIN(bytes, pktlen);
+	memcpy(pkt, o->buf, bytes);
+	return bytes;
+}
+
+static void tftp_ovl_cancel(struct tftp_ovl *o, int sock)
+{
+	DWORD bytes, flags;
+
+	if (o && o->pending) {
+		CancelIoEx((HANDLE)(uintptr_t)sock, &o->ov);
+		// the buffer is still owned by the kernel until this returns
+		WSAGetOverlappedResult(sock, &o->ov, &bytes, TRUE, &flags);
+		o->pending = false;
+	}
+}
 #endif
 
-	*port = ntohs(src.sin_port);
+#ifdef TFTP_MMSG
+// the DATA blocks of a window are queued by tftp_queue(), and handed to
+// the kernel at once by tftp_flush(): as a single UDP GSO datagram, which
+// the kernel (or NIC) splits into one datagram per block, or with
+// sendmmsg() if that's not possible. the payload is sent straight from
+// the image. received datagrams are drained with recvmmsg().
+struct tftp_mmsg
+{
+	// a header for each block, since all blocks from an image share `tx`
+	char hdrs[TFTP_WINDOWSIZE][4];
+	struct iovec tx_iov[TFTP_WINDOWSIZE][2];
+	struct mmsghdr tx[TFTP_WINDOWSIZE];
+	unsigned tx_count;
+	// cleared once the kernel refuses a GSO send
+	bool gso;
+
+	char rx_bufs[TFTP_MMSG_RX][2048];
+	struct sockaddr_in rx_src[TFTP_MMSG_RX];
+	struct iovec rx_iov[TFTP_MMSG_RX];
+	struct mmsghdr rx[TFTP_MMSG_RX];
+	// datagrams in [rx_next, rx_count) have yet to be returned
+	unsigned rx_count;
+	unsigned rx_next;
+};
+
+static void tftp_mmsg_init(struct tftp_mmsg *m)
+{
+	unsigned i;
+
+	memset(m, 0, sizeof(*m));
+	m->gso = true;
+
+	for (i = 0; i < TFTP_MMSG_RX; ++i) {
+		m->rx_iov[i].iov_base = m->rx_bufs[i];
+		m->rx_iov[i].iov_len = sizeof(m->rx_bufs[i]);
+	}
+}
+
+// drops everything that was queued for (or received on) the previous socket
+static void tftp_mmsg_reset(struct tftp_mmsg *m)
+{
+	if (m) {
+		m->tx_count = 0;
+		m->rx_count = m->rx_next = 0;
+	}
+}
+
+static bool tftp_mmsg_pending(struct tftp_mmsg *m)
+{
+	return m && m->rx_next < m->rx_count;
+}
+
+// must only be called if the socket is readable, or tftp_mmsg_pending()
+static ssize_t tftp_mmsg_recv(struct tftp_mmsg *m, int sock, char *pkt,
+		size_t pktlen, struct sockaddr_in *src)
+{
+	unsigned i;
+	int n;
+
+	if (m->rx_next == m->rx_count) {
+		for (i = 0; i < TFTP_MMSG_RX; ++i) {
+			memset(&m->rx[i].msg_hdr, 0, sizeof(m->rx[i].msg_hdr));
+			m->rx[i].msg_hdr.msg_name = &m->rx_src[i];
+			m->rx[i].msg_hdr.msg_namelen = sizeof(m->rx_src[i]);
+			m->rx[i].msg_hdr.msg_iov = &m->rx_iov[i];
+			m->rx[i].msg_hdr.msg_iovlen = 1;
+		}
+
+		n = recvmmsg(sock, m->rx, TFTP_MMSG_RX, MSG_WAITFORONE, NULL);
+		if (n < 0) {
+			sock_perror("recvmmsg");
+			return -1;
+		}
+
+		m->rx_count = n;
+		m->rx_next = 0;
+	}
+
+	i = m->rx_next++;
+	*src = m->rx_src[i];
+	pktlen = MIN(pktlen, m->rx[i].msg_len);
+	memcpy(pkt, m->rx_bufs[i], pktlen);
+	return pktlen;
+}
+#endif
+
+static int tftp_wait(int sock, unsigned timeout, struct nmrpd_args *args)
+{
+	long long now, deadline;
+	int ready;
+#ifdef NMRPFLASH_FUZZ
+	// nothing left means nothing will ever arrive
+	return fuzz_pending();
+#endif
+#ifdef NMRPFLASH_WIN_OVERLAPPED
+	struct tftp_ovl *o = args->tftp_ovl;
+	DWORD ret;
+
+	if (o) {
+		if (tftp_ovl_post(o, sock) != 0) {
+			return -1;
+		}
+
+		if (!args->sock) {
+			ret = WaitForSingleObject(o->ov.hEvent, timeout);
+			if (ret == WAIT_OBJECT_0) {
+				return 1;
+			} else if (ret == WAIT_TIMEOUT) {
+				return 0;
+			}
+
+			win_perror2("WaitForSingleObject", GetLastError());
+			return -1;
+		}
+	}
+#endif
+
+	if (!args->sock) {
+		return select_fd(sock, timeout);
+	}
+
+	// wait for the UDP socket and the NMRP ethsock at the same time, so
+	// that late NMRP packets are discarded as they arrive, without ever
+	// having to poll the ethsock.
+
+	now = millis();
+	deadline = now + timeout;
+
+	do {
+#ifdef NMRPFLASH_WIN_OVERLAPPED
+		if (o) {
+			ready = ethsock_wait_handle(args->sock, o->ov.hEvent, deadline - now);
+		} else
+#endif
+		ready = ethsock_wait(args->sock, sock, deadline - now);
+		if (ready < 0) {
+			return -1;
+		}
+
+		if (ready & ETHSOCK_READY) {
+			nmrp_discard(args->sock, args->trace);
+		}
+
+		if (ready & ETHSOCK_READY_FD) {
+			return 1;
+		}
+	} while ((now = millis()) < deadline);
+
+	return 0;
+}
 
+// validates a received packet, and returns its length, or one of the error
+// codes of tftp_recvfrom.
+static ssize_t tftp_check(char *pkt, ssize_t len)
+{
 	uint16_t opcode = pkt_num(pkt);
 
 	if (opcode == ERR) {
 		fprintf(stderr, "Error (%d): %.511s\n", pkt_num(pkt + 2), pkt + 4);
-		return -1;
+		return pkt_num(pkt + 2) == TFTP_ERR_OPTION ? -3 : -1;
 	} else if (isprint(pkt[0])) {
 		/* In case of a firmware checksum error, the EX2700 I've tested this
 		 * on sends a raw UDP packet containing just an error message starting
@@ -230,16 +585,129 @@ static ssize_t tftp_recvfrom(int sock, char *pkt, uint16_t* port,
 		return -1;
 	}
 
-	if (verbosity > 2) {
-		printf(">> ");
-		pkt_print(pkt, stdout);
-		printf("\n");
+	return len;
+}
+
+// returns the packet's length, 0 on timeout, -2 if the remote sent a raw
+// error message, -3 if it refused our options, or -1 on all other errors.
+static ssize_t tftp_recvfrom(int sock, char *pkt, uint16_t* port,
+		unsigned timeout, size_t pktlen, struct nmrpd_args *args)
+{
+	ssize_t len;
+	struct sockaddr_in src;
+#ifndef NMRPFLASH_WINDOWS
+	socklen_t alen;
+#else
+	int alen;
+#endif
+
+#ifndef NMRPFLASH_FUZZ
+	if (args->tftp_udp) {
+		// NMRP frames received in the meantime are discarded, as they would
+		// be by tftp_wait
+		len = udp_recvfrom(args->tftp_udp, pkt, pktlen, &src, timeout);
+		if (len <= 0) {
+			if (!len) {
+				trace_add(args->trace, TRACE_TFTP_TIMEOUT, 0, MIN(timeout, 0xffff), 0);
+			}
+			return len;
+		}
+
+		if ((size_t)len < pktlen) {
+			// see below
+			pkt[len] = '\0';
+		}
+
+		tftp_trace(args, false, pkt, len);
+		*port = ntohs(src.sin_port);
+		return tftp_check(pkt, len);
 	}
+#endif
 
-	return len;
+#ifdef TFTP_MMSG
+	if (!tftp_mmsg_pending(args->tftp_mmsg))
+#endif
+	{
+		len = tftp_wait(sock, timeout, args);
+		if (len < 0) {
+			return -1;
+		} else if (!len) {
+			trace_add(args->trace, TRACE_TFTP_TIMEOUT, 0, MIN(timeout, 0xffff), 0);
+			return 0;
+		}
+	}
+
+#ifndef NMRPFLASH_FUZZ
+#if defined(NMRPFLASH_WIN_OVERLAPPED)
+	if (args->tftp_ovl) {
+		len = tftp_ovl_complete(args->tftp_ovl, sock, pkt, pktlen, &src);
+		if (len < 0) {
+			return -1;
+		}
+	} else
+#elif defined(TFTP_MMSG)
+	if (args->tftp_mmsg) {
+		len = tftp_mmsg_recv(args->tftp_mmsg, sock, pkt, pktlen, &src);
+		if (len < 0) {
+			return -1;
+		}
+	} else
+#endif
+	{
+		alen = sizeof(src);
+		len = recvfrom(sock, pkt, pktlen, 0, (struct sockaddr*)&src, &alen);
+		if (len < 0) {
+			sock_perror("recvfrom");
+			return -1;
+		}
+	}
+#else
+	memset(&src, 0, sizeof(src));
+	src.sin_port = htons(args->port);
+	len = fuzz_read(pkt, pktlen);
+#endif
+
+	if ((size_t)len < pktlen) {
+		// so that the options of an earlier, longer OACK in the same
+		// buffer aren't mistaken for this one's.
+		pkt[len] = '\0';
+	}
+
+	tftp_trace(args, false, pkt, len);
+
+	if (args->capture) {
+		tftp_capture(sock, false, &src, pkt, len, NULL, 0, args);
+	}
+
+	*port = ntohs(src.sin_port);
+	return tftp_check(pkt, len);
+}
+
+#ifdef NMRPFLASH_FUZZ
+void tftp_fuzz_pkt(const uint8_t *buf, size_t len)
+{
+	static const char *opts[] = { "blksize", "windowsize", "rollover", "tsize" };
+	char pkt[2048];
+	size_t i;
+
+	// as in tftp_put, which receives into a buffer of the same size
+	memset(pkt, 0, sizeof(pkt));
+	len = MIN(len, sizeof(pkt));
+	memcpy(pkt, buf, len);
+
+	if (len < 4 || tftp_check(pkt, len) < 0 || pkt_num(pkt) != OACK) {
+		return;
+	}
+
+	for (i = 0; i < sizeof(opts) / sizeof(opts[0]); ++i) {
+		pkt_optval(pkt, opts[i]);
+	}
 }
+#endif
 
-static ssize_t tftp_sendto(int sock, char *pkt, size_t len,
+// if `data` is not NULL, the payload of a DATA packet is sent directly
+// from there, instead of from `pkt + 4`.
+static ssize_t tftp_sendto(int sock, char *pkt, const void *data, size_t len,
 		struct sockaddr_in *dst, struct nmrpd_args* args)
 {
 	ssize_t sent;
@@ -249,6 +717,7 @@ static ssize_t tftp_sendto(int sock, char *pkt, size_t len,
 		case RRQ:
 		case WRQ:
 			is_xrq = true;
+			// fallthrough
 		case OACK:
 			len = pkt_xrqlen(pkt);
 			break;
@@ -268,19 +737,59 @@ static ssize_t tftp_sendto(int sock, char *pkt, size_t len,
 			return -1;
 	}
 
-	if (verbosity > 2) {
-		printf("<< ");
-		pkt_print(pkt, stdout);
-		printf("\n");
-	}
+	tftp_trace(args, true, pkt, len);
 
 #ifndef NMRPFLASH_FUZZ
-	sent = sendto(sock, pkt, len, 0, (struct sockaddr*)dst, sizeof(*dst));
+	if (args->tftp_udp) {
+		if (udp_sendto(args->tftp_udp, dst, pkt, data ? 4 : len, data,
+					data ? len - 4 : 0) == 0) {
+			sent = len;
+		} else {
+			sent = -1;
+		}
+	} else if (!data) {
+		sent = sendto(sock, pkt, len, 0, (struct sockaddr*)dst, sizeof(*dst));
+	} else {
+#ifndef NMRPFLASH_WINDOWS
+		struct iovec iov[2] = {
+			{ .iov_base = pkt, .iov_len = 4 },
+			{ .iov_base = (void*)data, .iov_len = len - 4 },
+		};
+		struct msghdr msg = {
+			.msg_name = dst,
+			.msg_namelen = sizeof(*dst),
+			.msg_iov = iov,
+			.msg_iovlen = 2,
+		};
+
+		sent = sendmsg(sock, &msg, 0);
+#else
+		WSABUF bufs[2] = {
+			{ .len = 4, .buf = pkt },
+			{ .len = len - 4, .buf = (char*)data },
+		};
+		DWORD bytes;
+
+		if (WSASendTo(sock, bufs, 2, &bytes, 0, (struct sockaddr*)dst,
+					sizeof(*dst), NULL, NULL) == 0) {
+			sent = bytes;
+		} else {
+			sent = -1;
+		}
+#endif
+	}
+
 	if (sent < 0) {
 		if (is_xrq) {
 			args->hints |= NMRP_TFTP_XMIT_BLK0_FAILURE;
 		}
-		sock_perror("sendto");
+		if (!args->tftp_udp) {
+			sock_perror("sendto");
+		}
+	} else if (args->capture && !args->tftp_udp) {
+		// with tftp_udp, the frame has already been captured by the ethsock
+		tftp_capture(sock, true, dst, pkt, data ? 4 : len, data,
+				data ? len - 4 : 0, args);
 	}
 #else
 	sent = len;
@@ -289,6 +798,159 @@ static ssize_t tftp_sendto(int sock, char *pkt, size_t len,
 	return sent;
 }
 
+#ifdef TFTP_MMSG
+// sends all blocks as one datagram, with a UDP_SEGMENT of the first one's
+// size. only the last block may be shorter, which is always the case.
+static int tftp_flush_gso(struct tftp_mmsg *m, int sock, struct sockaddr_in *dst)
+{
+	char control[CMSG_SPACE(sizeof(uint16_t))];
+	struct msghdr msg;
+	struct cmsghdr *cm;
+	uint16_t segsize;
+	size_t len;
+	unsigned i;
+	ssize_t sent;
+
+	segsize = 4 + m->tx_iov[0][1].iov_len;
+	for (i = 0, len = 0; i < m->tx_count; ++i) {
+		len += 4 + m->tx_iov[i][1].iov_len;
+	}
+
+	memset(&msg, 0, sizeof(msg));
+	memset(control, 0, sizeof(control));
+	msg.msg_name = dst;
+	msg.msg_namelen = sizeof(*dst);
+	// tx_iov is contiguous, so it's also a single array of iovecs
+	msg.msg_iov = &m->tx_iov[0][0];
+	msg.msg_iovlen = 2 * m->tx_count;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	cm = CMSG_FIRSTHDR(&msg);
+	cm->cmsg_level = SOL_UDP;
+	cm->cmsg_type = UDP_SEGMENT;
+	cm->cmsg_len = CMSG_LEN(sizeof(segsize));
+	memcpy(CMSG_DATA(cm), &segsize, sizeof(segsize));
+
+	sent = sendmsg(sock, &msg, 0);
+	if (sent == (ssize_t)len) {
+		return 0;
+	} else if (sent >= 0) {
+		fprintf(stderr, "Error: sent only %zd of %zu b.\n", sent, len);
+		return -1;
+	} else if (errno == EIO || errno == EINVAL || errno == ENOPROTOOPT
+			|| errno == EOPNOTSUPP || errno == EMSGSIZE) {
+		// not supported by the kernel, route or interface
+		if (verbosity > 1) {
+			printf("UDP GSO not available (%s); using sendmmsg.\n", strerror(errno));
+		}
+		m->gso = false;
+		return 1;
+	}
+
+	sock_perror("sendmsg");
+	return -1;
+}
+
+static int tftp_flush_mmsg(struct tftp_mmsg *m, int sock)
+{
+	unsigned done = 0;
+	int n;
+
+	while (done < m->tx_count) {
+		n = sendmmsg(sock, m->tx + done, m->tx_count - done, 0);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			sock_perror("sendmmsg");
+			return -1;
+		}
+		done += n;
+	}
+
+	return 0;
+}
+#endif
+
+// sends the blocks queued by tftp_queue(), if any
+static int tftp_flush(int sock, struct sockaddr_in *dst, struct nmrpd_args *args)
+{
+#ifdef TFTP_MMSG
+	struct tftp_mmsg *m = args->tftp_mmsg;
+	size_t len;
+	unsigned i;
+	int ret;
+
+	if (!m || !m->tx_count) {
+		return 0;
+	}
+
+	len = m->tx_count * (4 + m->tx_iov[0][1].iov_len);
+	ret = 1;
+
+	if (m->gso && m->tx_count > 1 && m->tx_count <= TFTP_GSO_MAX_SEGS
+			&& len <= TFTP_GSO_MAX_LEN) {
+		ret = tftp_flush_gso(m, sock, dst);
+	}
+
+	if (ret > 0) {
+		ret = tftp_flush_mmsg(m, sock);
+	}
+
+	if (!ret && args->capture) {
+		for (i = 0; i < m->tx_count; ++i) {
+			tftp_capture(sock, true, dst, m->hdrs[i], 4, m->tx_iov[i][1].iov_base,
+					m->tx_iov[i][1].iov_len, args);
+		}
+	}
+
+	m->tx_count = 0;
+	return ret;
+#else
+	return 0;
+#endif
+}
+
+// like tftp_sendto, but for DATA packets only, which (where supported) are
+// only sent by tftp_flush. `pkt` may be reused as soon as this returns; the
+// payload (`data`, or `pkt + 4`) must remain valid until then.
+static ssize_t tftp_queue(int sock, char *pkt, const void *data, size_t len,
+		struct sockaddr_in *dst, struct nmrpd_args *args)
+{
+#ifdef TFTP_MMSG
+	struct tftp_mmsg *m = args->tftp_mmsg;
+	struct msghdr *msg;
+	unsigned i;
+
+	if (m) {
+		if (m->tx_count == TFTP_WINDOWSIZE && tftp_flush(sock, dst, args) < 0) {
+			return -1;
+		}
+
+		tftp_trace(args, true, pkt, len + 4);
+
+		i = m->tx_count++;
+		memcpy(m->hdrs[i], pkt, 4);
+		m->tx_iov[i][0].iov_base = m->hdrs[i];
+		m->tx_iov[i][0].iov_len = 4;
+		m->tx_iov[i][1].iov_base = data ? (void*)data : pkt + 4;
+		m->tx_iov[i][1].iov_len = len;
+
+		msg = &m->tx[i].msg_hdr;
+		memset(msg, 0, sizeof(*msg));
+		msg->msg_name = dst;
+		msg->msg_namelen = sizeof(*dst);
+		msg->msg_iov = m->tx_iov[i];
+		msg->msg_iovlen = 2;
+
+		return len + 4;
+	}
+#endif
+
+	return tftp_sendto(sock, pkt, data, len, dst, args);
+}
+
 const char *leafname(const char *path)
 {
 	if (!path) {
@@ -328,15 +990,248 @@ void sock_perror(const char *msg)
 // On many routers this is not an issue, as they keep all traffic on the
 // original port.
 
-static const char* fw_rule_name = "nmrpflash_tftp";
-
+#ifdef NMRPFLASH_WIN_FW_COM
+//
+// The rule is managed using the Windows Firewall COM API, rather than by
+// running netsh. There's only one rule per process, covering the remote
+// addresses of all sessions that are currently uploading. Updating it is
+// slow, so addresses are only removed once their slot is needed, or when
+// the process exits: consecutive uploads to the same address, which is
+// the norm, leave the rule as it is.
+
+#define FW_MAX_ADDRS 64
+
+static const wchar_t *fw_rule_name = L"nmrpflash_tftp";
+static xmutex_t fw_lock = XMUTEX_INITIALIZER;
+static uint32_t fw_addrs[FW_MAX_ADDRS];
+// number of sessions using each address
+static unsigned fw_refs[FW_MAX_ADDRS];
+static unsigned fw_count = 0;
+static bool fw_atexit = false;
+// stale rules from previous runs are removed only once
+static bool fw_clean = false;
+
+static const GUID fw_clsid_policy2 = { 0xe2b3c97f, 0x6ae1, 0x41ac, { 0x81, 0x7a, 0xf6, 0xf9, 0x21, 0x66, 0xd7, 0xdd } };
+static const GUID fw_iid_policy2 = { 0x98325047, 0xc671, 0x4174, { 0x8d, 0x81, 0xde, 0xfc, 0xd3, 0xf0, 0x31, 0x86 } };
+static const GUID fw_clsid_rule = { 0x2c5bc43e, 0x3369, 0x4c33, { 0xab, 0x0c, 0xbe, 0x94, 0x69, 0x67, 0x7a, 0xf4 } };
+static const GUID fw_iid_rule = { 0xaf230d27, 0xbaba, 0x4e42, { 0xac, 0xed, 0xf5, 0x24, 0xf2, 0x2c, 0xfc, 0xe2 } };
+
+// must be called with fw_lock held
+static int fw_update()
+{
+	INetFwPolicy2 *policy = NULL;
+	INetFwRules *rules = NULL;
+	INetFwRule *rule = NULL;
+	BSTR name = NULL, addrs = NULL;
+	char buf[FW_MAX_ADDRS * 16];
+	wchar_t wbuf[FW_MAX_ADDRS * 16];
+	bool uninit;
+	unsigned i;
+	HRESULT hr;
+	int ret = -1;
+
+	// COM is initialized per thread, and this might be a session thread
+	hr = CoInitializeEx(NULL, COINIT_MULTITHREADED);
+	uninit = SUCCEEDED(hr);
+
+	hr = CoCreateInstance(&fw_clsid_policy2, NULL, CLSCTX_INPROC_SERVER,
+			&fw_iid_policy2, (void**)&policy);
+	if (FAILED(hr)) {
+		win_perror2("CoCreateInstance(NetFwPolicy2)", hr);
+		goto out;
+	}
+
+	hr = INetFwPolicy2_get_Rules(policy, &rules);
+	if (FAILED(hr)) {
+		win_perror2("INetFwPolicy2::get_Rules", hr);
+		goto out;
+	}
+
+	name = SysAllocString(fw_rule_name);
+	if (!name) {
+		goto out;
+	}
+
+	if (!fw_clean) {
+		// there might be more than one rule with this name
+		for (i = 0; i < 16 && INetFwRules_Item(rules, name, &rule) == S_OK; ++i) {
+			INetFwRule_Release(rule);
+			rule = NULL;
+			INetFwRules_Remove(rules, name);
+		}
+		fw_clean = true;
+	} else {
+		INetFwRules_Remove(rules, name);
+	}
+
+	if (!fw_count) {
+		ret = 0;
+		goto out;
+	}
+
+	buf[0] = '\0';
+	for (i = 0; i < fw_count; ++i) {
+		struct in_addr in = { .s_addr = fw_addrs[i] };
+		char ipbuf[INET_ADDRSTRLEN];
+		if (i) {
+			strcat(buf, ",");
+		}
+		strcat(buf, inet_ntop(AF_INET, &in, ipbuf, sizeof(ipbuf)));
+	}
+
+	if (!MultiByteToWideChar(CP_ACP, 0, buf, -1, wbuf, sizeof(wbuf) / sizeof(wbuf[0]))
+			|| !(addrs = SysAllocString(wbuf))) {
+		goto out;
+	}
+
+	hr = CoCreateInstance(&fw_clsid_rule, NULL, CLSCTX_INPROC_SERVER,
+			&fw_iid_rule, (void**)&rule);
+	if (FAILED(hr)) {
+		win_perror2("CoCreateInstance(NetFwRule)", hr);
+		goto out;
+	}
+
+	INetFwRule_put_Name(rule, name);
+	INetFwRule_put_Protocol(rule, NET_FW_IP_PROTOCOL_UDP);
+	INetFwRule_put_Direction(rule, NET_FW_RULE_DIR_IN);
+	INetFwRule_put_RemoteAddresses(rule, addrs);
+	INetFwRule_put_Action(rule, NET_FW_ACTION_ALLOW);
+	INetFwRule_put_Enabled(rule, VARIANT_TRUE);
+
+	hr = INetFwRules_Add(rules, rule);
+	if (FAILED(hr)) {
+		if (verbosity > 1) {
+			win_perror2("INetFwRules::Add", hr);
+		}
+		goto out;
+	}
+
+	ret = 0;
+
+out:
+	if (rule) {
+		INetFwRule_Release(rule);
+	}
+
+	if (rules) {
+		INetFwRules_Release(rules);
+	}
+
+	if (policy) {
+		INetFwPolicy2_Release(policy);
+	}
+
+	SysFreeString(name);
+	SysFreeString(addrs);
+
+	if (uninit) {
+		CoUninitialize();
+	}
+
+	return ret;
+}
+
+static void fw_remove()
+{
+	xmutex_lock(&fw_lock);
+	if (fw_count) {
+		fw_count = 0;
+		fw_update();
+	}
+	xmutex_unlock(&fw_lock);
+}
+
+int del_tftp_firewall_rule(struct sockaddr_in* addr)
+{
+	unsigned i;
+
+	xmutex_lock(&fw_lock);
+
+	for (i = 0; i < fw_count; ++i) {
+		if (fw_addrs[i] == addr->sin_addr.s_addr && fw_refs[i]) {
+			--fw_refs[i];
+			break;
+		}
+	}
+
+	xmutex_unlock(&fw_lock);
+	return 0;
+}
+
+void add_tftp_firewall_rule(struct sockaddr_in* addr)
+{
+	uint32_t old = 0;
+	unsigned i;
+	int err = -1;
+
+	xmutex_lock(&fw_lock);
+
+	for (i = 0; i < fw_count; ++i) {
+		if (fw_addrs[i] == addr->sin_addr.s_addr) {
+			++fw_refs[i];
+			err = 0;
+			goto out;
+		}
+	}
+
+	if (verbosity > 1) {
+		printf("Adding firewall rule for TFTP... ");
+	}
+
+	if (fw_count < FW_MAX_ADDRS) {
+		i = fw_count++;
+	} else {
+		// replace an address that is no longer used
+		for (i = 0; i < FW_MAX_ADDRS && fw_refs[i]; ++i)
+			;
+
+		if (i == FW_MAX_ADDRS) {
+			goto out;
+		}
+
+		old = fw_addrs[i];
+	}
+
+	fw_addrs[i] = addr->sin_addr.s_addr;
+	fw_refs[i] = 1;
+
+	err = fw_update();
+	if (err) {
+		// restore the rule for the other sessions
+		if (old) {
+			fw_addrs[i] = old;
+			fw_refs[i] = 0;
+		} else {
+			--fw_count;
+		}
+		fw_update();
+	} else if (!fw_atexit) {
+		atexit(&fw_remove);
+		fw_atexit = true;
+	}
+
+out:
+	xmutex_unlock(&fw_lock);
+
+	if (err) {
+		fprintf(stderr, "Warning: failed to add firewall rule for TFTP\n");
+	}
+}
+#else
+// one rule per remote address, so that concurrent sessions don't remove
+// each other's.
+
 int del_tftp_firewall_rule(struct sockaddr_in* addr)
 {
-	return systemf("netsh advfirewall firewall delete rule name=\"%s\" > NUL 2>&1", fw_rule_name);
+	char ipbuf[INET_ADDRSTRLEN];
+
+	return systemf("netsh advfirewall firewall delete rule name=\"nmrpflash_tftp_%s\" > NUL 2>&1",
+			inet_ntop(AF_INET, &addr->sin_addr, ipbuf, sizeof(ipbuf)));
 }
 
 void add_tftp_firewall_rule(struct sockaddr_in* addr)
 {
+	char ipbuf[INET_ADDRSTRLEN];
 	int err;
 
 	del_tftp_firewall_rule(addr);
@@ -345,132 +1240,464 @@ void add_tftp_firewall_rule(struct sockaddr_in* addr)
 		printf("Adding firewall rule for TFTP... ");
 	}
 
-	err = systemf("netsh advfirewall firewall add rule name=\"%s\" dir=in remoteip=%s protocol=udp action=allow %s",
-			fw_rule_name, inet_ntoa(addr->sin_addr), (verbosity > 1 ? "" : "> NUL 2>&1"));
+	inet_ntop(AF_INET, &addr->sin_addr, ipbuf, sizeof(ipbuf));
+	err = systemf("netsh advfirewall firewall add rule name=\"nmrpflash_tftp_%s\" dir=in remoteip=%s protocol=udp action=allow %s",
+			ipbuf, ipbuf, (verbosity > 1 ? "" : "> NUL 2>&1"));
 	if (err) {
 		fprintf(stderr, "Warning: failed to add firewall rule for TFTP\n");
 	}
 }
 #endif
+#endif
 
 inline bool tftp_is_valid_filename(const char *filename)
 {
 	return strlen(filename) <= 255 && is_netascii(filename);
 }
 
-static const char *spinner = "\\|/-";
+static bool hwaddr_is_set(const uint8_t *hwaddr)
+{
+	static const uint8_t zero[6] = { 0 };
+	return memcmp(hwaddr, zero, 6) != 0;
+}
+
+// returns the blksize that worked for this device or, failing that,
+// for another one with the same OUI, and stores the options that were
+// sent in *opts. returns 0 if there's neither.
+static uint16_t blksize_cache_get(const uint8_t *hwaddr, enum tftp_opts *opts)
+{
+	int exact = -1, oui = -1;
+	uint16_t blksize = 0;
+	unsigned i;
+
+	if (!hwaddr_is_set(hwaddr)) {
+		return 0;
+	}
+
+	xmutex_lock(&blksize_lock);
+
+	for (i = 0; i < BLKSIZE_CACHE_SIZE && blksize_cache[i].blksize; ++i) {
+		if (!memcmp(blksize_cache[i].hwaddr, hwaddr, 6)) {
+			exact = i;
+			break;
+		} else if (!memcmp(blksize_cache[i].hwaddr, hwaddr, 3)) {
+			oui = i;
+		}
+	}
+
+	if (exact >= 0 || oui >= 0) {
+		i = exact >= 0 ? exact : oui;
+		blksize = blksize_cache[i].blksize;
+		*opts = blksize_cache[i].opts;
+	}
+
+	xmutex_unlock(&blksize_lock);
+
+	return blksize;
+}
+
+static void blksize_cache_put(const uint8_t *hwaddr, uint16_t blksize, enum tftp_opts opts)
+{
+	unsigned i;
+
+	if (!hwaddr_is_set(hwaddr)) {
+		return;
+	}
+
+	xmutex_lock(&blksize_lock);
+
+	for (i = 0; i < BLKSIZE_CACHE_SIZE && blksize_cache[i].blksize; ++i) {
+		if (!memcmp(blksize_cache[i].hwaddr, hwaddr, 6)) {
+			break;
+		}
+	}
+
+	if (i == BLKSIZE_CACHE_SIZE || !blksize_cache[i].blksize) {
+		// replace the oldest entry once full
+		i = blksize_cache_next++ % BLKSIZE_CACHE_SIZE;
+		memcpy(blksize_cache[i].hwaddr, hwaddr, 6);
+	}
+
+	blksize_cache[i].blksize = blksize;
+	// the same options are sent, and the ladder is walked again if needed
+	blksize_cache[i].opts = opts == TFTP_OPTS_LADDER ? TFTP_OPTS_BLKSIZE : opts;
+
+	xmutex_unlock(&blksize_lock);
+}
+
+// the largest blksize that doesn't lead to IP fragmentation, unless we
+// already know that the device only handles smaller ones. *opts is set
+// to the options to start with.
+static uint16_t tftp_blksize(struct nmrpd_args *args, enum tftp_opts *opts)
+{
+	unsigned mtu, blksize;
+	uint16_t cached;
+
+#ifndef NMRPFLASH_FUZZ
+	mtu = args->sock ? ethsock_get_mtu(args->sock) : 0;
+#else
+	mtu = 0;
+#endif
+	if (mtu) {
+		blksize = mtu > TFTP_DATA_OVERHEAD + 512 ? mtu - TFTP_DATA_OVERHEAD : 512;
+		blksize = MIN(blksize, TFTP_MAX_BLKSIZE);
+	} else {
+		blksize = TFTP_BLKSIZE;
+	}
+
+	*opts = TFTP_OPTS_ALL;
+
+	cached = blksize_cache_get(args->hwaddr, opts);
+	if (cached && cached < blksize) {
+		if (verbosity) {
+			printf("Using blksize %u, which worked before.\n", cached);
+		}
+		blksize = cached;
+	}
+
+	return blksize;
+}
+
+// returns the next smaller blksize to try, or 0
+static uint16_t blksize_ladder_next(uint16_t blksize)
+{
+	unsigned i;
+
+	for (i = 0; i < sizeof(blksize_ladder) / sizeof(blksize_ladder[0]); ++i) {
+		if (blksize_ladder[i] < blksize) {
+			return blksize_ladder[i];
+		}
+	}
+
+	return 0;
+}
+
+// picks the options for the next WRQ after the remote refused the current
+// ones: the same blksize on its own, then no options at all, and only then
+// smaller blksizes. returns false once there's nothing left to try.
+static bool tftp_opts_refused(enum tftp_opts *opts, uint16_t *reqsize)
+{
+	switch (*opts) {
+		case TFTP_OPTS_ALL:
+			*opts = TFTP_OPTS_BLKSIZE;
+			printf("Retrying with blksize option only.\n");
+			return true;
+		case TFTP_OPTS_BLKSIZE:
+			*opts = TFTP_OPTS_NONE;
+			printf("Retrying without options.\n");
+			return true;
+		default:
+			if (!(*reqsize = blksize_ladder_next(*reqsize))) {
+				return false;
+			}
+
+			*opts = TFTP_OPTS_LADDER;
+			printf("Retrying with blksize %u.\n", *reqsize);
+			return true;
+	}
+}
+
+// like tftp_opts_refused, but after the remote accepted the options, and
+// then never acknowledged block 1: the negotiated blksize is retried
+// without a window first, since that's a burst of large packets too.
+static bool tftp_opts_timeout(enum tftp_opts *opts, uint16_t *reqsize,
+		uint16_t blksize, uint16_t windowsize)
+{
+	if (*opts == TFTP_OPTS_ALL && windowsize > 1) {
+		*opts = TFTP_OPTS_BLKSIZE;
+		*reqsize = blksize;
+		printf("No ACK for blksize %u; retrying without windowsize.\n", blksize);
+		return true;
+	} else if (!(*reqsize = blksize_ladder_next(blksize))) {
+		return false;
+	}
+
+	*opts = TFTP_OPTS_LADDER;
+	printf("No ACK for blksize %u; retrying with %u.\n", blksize, *reqsize);
+	return true;
+}
+
+static void tftp_close(int sock, struct nmrpd_args *args)
+{
+#if defined(NMRPFLASH_FUZZ_TFTP)
+	// not a socket
+#elif !defined(NMRPFLASH_WINDOWS)
+	shutdown(sock, SHUT_RDWR);
+	close(sock);
+#else
+#ifdef NMRPFLASH_WIN_OVERLAPPED
+	tftp_ovl_cancel(args->tftp_ovl, sock);
+#endif
+	shutdown(sock, SD_BOTH);
+	closesocket(sock);
+#endif
+}
+
+// block numbers on the wire wrap around to 0, unless the remote has
+// asked for rollover=1 (rollover is the negotiated value, or -1).
+static inline uint16_t block_to_wire(unsigned long block, int rollover)
+{
+	if (rollover == 1 && block) {
+		return ((block - 1) % 0xffff) + 1;
+	}
+
+	return block & 0xffff;
+}
+
+// maps a (16-bit) ACK block number to the corresponding block number
+// within the current window. returns 1 if the ACK belongs to a block in
+// the range [acked, sent], 0 if it's a late ACK for an earlier block,
+// and -1 if it acknowledges a block that hasn't been sent yet.
+static int ack_to_block(uint16_t ack, unsigned long acked, unsigned long sent,
+		int rollover, unsigned long *block)
+{
+	// number of distinct block numbers on the wire
+	unsigned long range = rollover == 1 ? 0xffff : 0x10000;
+	unsigned long offset;
+
+	if (rollover == 1 && !ack) {
+		// only valid before the first data block, i.e. as a late
+		// ACK(0), which is handled below.
+		offset = acked ? range : 0;
+	} else {
+		offset = (ack + range - block_to_wire(acked, rollover)) % range;
+	}
+
+	if (offset > range / 2) {
+		return 0;
+	} else if (acked + offset > sent) {
+		return -1;
+	}
+
+	*block = acked + offset;
+	return 1;
+}
 
 ssize_t tftp_put(struct nmrpd_args *args)
 {
 	struct sockaddr_in addr;
-	uint16_t block, port, op, blksize;
-	ssize_t len, last_len, bytes, fsize;
-	int fd, sock, ret, timeouts, errors, ackblock;
-	char rx[2048], tx[2048];
+	uint16_t port, op, blksize, windowsize, reqsize;
+	enum tftp_opts opts;
+	ssize_t len, bytes, fsize, lens[TFTP_WINDOWSIZE];
+	unsigned long acked, sent, avail, last, resent, n;
+	long long sent_at[TFTP_WINDOWSIZE], progress, begin;
+	struct rto rto;
+	int fd, sock, ret, status, timeouts, errors, ackblock, wrqs;
+	char rx[2048], tx[2048], *win, *pkt;
+	const uint8_t *data;
+	struct image *img;
 	const char *file_remote = args->file_remote;
 	char *val, *end;
-	bool rollover, discard;
+	bool wrapped, negotiated;
+	// negotiated value of the rollover option, or -1
+	int rollover;
+	// offer rollover, even if reqsize alone doesn't call for it
+	bool want_rollover = false;
 	const unsigned rx_timeout = args->blind_timeout ? 10 : MAX(args->rx_timeout / 50, 200);
 	const unsigned max_timeouts = args->blind_timeout ? 3 : 5;
+	struct nmrp_stats *stats = &args->stats;
+	struct progress *prog;
+	struct readahead *ra;
+#ifndef NMRPFLASH_FUZZ
+	uint32_t local = 0;
+#endif
 #ifndef NMRPFLASH_WINDOWS
 	int enabled = 1;
 #else
 	char enabled = TRUE;
 #endif
+#ifdef NMRPFLASH_WIN_OVERLAPPED
+	struct tftp_ovl ovl;
+
+	memset(&ovl, 0, sizeof(ovl));
+	ovl.ov.hEvent = WSACreateEvent();
+	// falls back to recvfrom
+	args->tftp_ovl = ovl.ov.hEvent != WSA_INVALID_EVENT ? &ovl : NULL;
+#endif
+#ifdef TFTP_MMSG
+	struct tftp_mmsg mmsg;
+
+	tftp_mmsg_init(&mmsg);
+	args->tftp_mmsg = &mmsg;
+#endif
 
 	sock = -1;
 	ret = -1;
 	fd = -1;
+	begin = 0;
+	prog = NULL;
+	ra = NULL;
+	win = NULL;
+	img = NULL;
 
-	if (g_interrupted) {
+	if (nmrp_interrupted()) {
 		goto cleanup;
 	}
 
+	reqsize = tftp_blksize(args, &opts);
+
 	if (!strcmp(args->file_local, "-")) {
 		fd = STDIN_FILENO;
 		if (!file_remote) {
 			file_remote = "firmware";
 		}
 		fsize = -1;
-	} else {
-		fd = open(args->file_local, O_RDONLY | O_BINARY);
-		if (fd < 0) {
-			xperror("open");
+
+		// blocks are kept until acknowledged, so they can be resent
+		win = malloc(TFTP_WINDOWSIZE * (reqsize + 4));
+		if (!win) {
+			xperror("malloc");
 			goto cleanup;
-		} else if (!file_remote) {
-			file_remote = args->file_local;
 		}
 
-		if (args->offset && (lseek(fd, args->offset, SEEK_SET) == (off_t)-1)) {
-			xperror("lseek");
+		// so that a slow source doesn't stall the upload, and blocks
+		// are always full-sized.
+		if (args->cb && args->cb->read) {
+			ra = readahead_open_cb(args->cb->read, args->cb->arg, TFTP_READAHEAD);
+		} else {
+			ra = readahead_open(fd, TFTP_READAHEAD);
+		}
+		if (!ra) {
 			goto cleanup;
 		}
-
-		struct stat st;
-		if (fstat(fd, &st) < 0) {
-			xperror("fstat");
+	} else {
+		img = args->image ? args->image : image_open(args->file_local, args->offset);
+		if (!img) {
 			goto cleanup;
+		} else if (!file_remote) {
+			file_remote = args->file_local;
 		}
 
-		// don't care if it's <= 0, we'll display the spinner in that case
-		fsize = st.st_size - args->offset;
+		fsize = img->size;
 	}
 
-#ifndef NMRPFLASH_FUZZ_TFTP
-	sock = socket(AF_INET, SOCK_DGRAM, 0);
-	if (sock < 0) {
-		sock_perror("socket");
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+
+	if ((addr.sin_addr.s_addr = inet_addr(args->ipaddr)) == INADDR_NONE) {
+		xperror("inet_addr");
 		goto cleanup;
 	}
 
-	if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &enabled, sizeof(enabled)) != 0) {
-		sock_perror("setsockopt");
-		goto cleanup;
+#ifndef NMRPFLASH_FUZZ
+	if (args->raw_tftp) {
+		if (!args->sock || !args->ipaddr_intf) {
+			fprintf(stderr, "Error: userspace TFTP requires an NMRP session.\n");
+			goto cleanup;
+		} else if ((local = inet_addr(args->ipaddr_intf)) == INADDR_NONE) {
+			xperror("inet_addr");
+			goto cleanup;
+		}
+
+		// tftp_recvfrom and tftp_sendto use neither
+#ifdef NMRPFLASH_WIN_OVERLAPPED
+		args->tftp_ovl = NULL;
+#endif
+#ifdef TFTP_MMSG
+		args->tftp_mmsg = NULL;
+#endif
 	}
+#endif
 
-#else
-	sock = STDIN_FILENO;
+#ifdef NMRPFLASH_WINDOWS
+	if (!args->raw_tftp) {
+		add_tftp_firewall_rule(&addr);
+	}
 #endif
 
-	memset(&addr, 0, sizeof(addr));
-	addr.sin_family = AF_INET;
+	// we start with the fixed timeout used previously, but it's adjusted
+	// as soon as we have actual round-trip times. the time we're willing to
+	// wait without making any progress is still the same though.
+	rto_init(&rto, rx_timeout, MIN(rx_timeout, TFTP_MIN_RTO_MS), rx_timeout * max_timeouts);
+	begin = micros();
 
-	if ((addr.sin_addr.s_addr = inet_addr(args->ipaddr)) == INADDR_NONE) {
-		xperror("inet_addr");
+	if (!args->quiet) {
+		prog = progress_start(fsize > 0 ? fsize : 0, false);
+	}
+
+restart:
+	// each attempt uses a new socket, so that late packets from the
+	// previous attempt are not mistaken for replies to the new one.
+	if (sock >= 0) {
+		tftp_close(sock, args);
+		sock = -1;
+		++stats->tftp.restarts;
+	}
+
+	// only the blocks of the last attempt make it into the image
+	stats->tftp.blocks = 0;
+
+#ifdef TFTP_MMSG
+	tftp_mmsg_reset(args->tftp_mmsg);
+#endif
+
+#ifndef NMRPFLASH_FUZZ
+	if (args->raw_tftp) {
+		// sock remains -1
+		udp_close(args->tftp_udp);
+		args->tftp_udp = udp_open(args->sock, local, args->hwaddr);
+		if (!args->tftp_udp) {
+			goto cleanup;
+		}
+	} else
+#endif
+#ifndef NMRPFLASH_FUZZ_TFTP
+	if ((sock = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+		sock_perror("socket");
+		goto cleanup;
+	} else if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &enabled, sizeof(enabled)) != 0) {
+		sock_perror("setsockopt");
 		goto cleanup;
 	}
+#else
+	sock = 0;
+#endif
 
+	// a new socket gets a new port
+	args->capture_addr.sin_port = 0;
 	addr.sin_port = htons(args->port);
 
 	blksize = 512;
-	block = 0;
-	last_len = -1;
-	len = 0;
+	windowsize = 1;
+	// block numbers, starting at 1, without 16-bit rollover. blocks
+	// in the range (acked, sent] are in flight, blocks (sent, avail]
+	// have already been read, and are waiting to be resent. once the
+	// final block has been read, its number is stored in `last`.
+	acked = sent = avail = last = 0;
+	// the highest block number that has been sent more than once. its
+	// round-trip time, and that of all blocks before it, is ambiguous.
+	resent = 0;
+	wrqs = 0;
 	bytes = 0;
 	errors = 0;
-	rollover = false;
+	rollover = -1;
+	wrapped = false;
+	negotiated = false;
 	/* Not really, but this way the loop sends our WRQ before receiving */
 	timeouts = 1;
-	discard = true;
+	progress = millis();
 
-#ifdef NMRPFLASH_WINDOWS
-	add_tftp_firewall_rule(&addr);
-#endif
-
-	pkt_mkwrq(tx, file_remote, TFTP_BLKSIZE);
+	if (opts == TFTP_OPTS_ALL) {
+		// only ask for rollover if we need it, since that's an option
+		// that few bootloaders know about.
+		pkt_mkwrq(tx, file_remote, reqsize, TFTP_WINDOWSIZE, fsize,
+				want_rollover || fsize < 0 || fsize / reqsize >= 0xffff);
+	} else {
+		pkt_mkwrq(tx, file_remote, opts != TFTP_OPTS_NONE ? reqsize : 0, 1, -1, false);
+	}
 
-	while (!g_interrupted) {
+	while (!nmrp_interrupted()) {
 		ackblock = -1;
 		op = pkt_num(rx);
 
 		if (!timeouts) {
 			if (op == ACK) {
 				ackblock = pkt_num(rx + 2);
-			} else if (op == OACK) {
+			} else if (op == OACK && !negotiated) {
 				ackblock = 0;
 				if ((val = pkt_optval(rx, "blksize"))) {
 					blksize = strtol(val, &end, 10);
-					if (*end != '\0' || blksize < 8 || blksize > TFTP_BLKSIZE) {
+					if (*end != '\0' || blksize < 8 || blksize > reqsize) {
 						fprintf(stderr, "Error: invalid blksize in OACK: %s\n", val);
 						ret = -1;
 						goto cleanup;
@@ -479,53 +1706,81 @@ ssize_t tftp_put(struct nmrpd_args *args)
 					if (verbosity) {
 						printf("Remote accepted blksize option: %d b\n", blksize);
 					}
-				}
-			}
-		}
 
-		if (timeouts || ackblock == block) {
-			if (!timeouts) {
-				if (++block == 0) {
-					if (!rollover) {
-						printf("Warning: TFTP block rollover. Upload might fail!\n");
-						rollover = true;
+					// with the blksize we got, the block number will wrap,
+					// but rollover wasn't offered for the one we asked for.
+					if (opts == TFTP_OPTS_ALL && !want_rollover && fsize >= 0
+							&& fsize / blksize >= 0xffff && fsize / reqsize < 0xffff) {
+						printf("Retrying with rollover option for blksize %u.\n", blksize);
+						want_rollover = true;
+						reqsize = blksize;
+						goto restart;
 					}
 				}
 
-				if (fsize > 0) {
-					printf("% 3zi %% ", (bytes * 100) / fsize);
-					fflush(stdout);
-					printf("\b\b\b\b\b\b");
-				} else {
-					printf("%c ", spinner[block & 3]);
-					fflush(stdout);
-					printf("\b\b");
+				if ((val = pkt_optval(rx, "windowsize"))) {
+					windowsize = strtol(val, &end, 10);
+					if (*end != '\0' || windowsize < 1 || windowsize > TFTP_WINDOWSIZE) {
+						fprintf(stderr, "Error: invalid windowsize in OACK: %s\n", val);
+						ret = -1;
+						goto cleanup;
+					}
+
+					if (verbosity) {
+						printf("Remote accepted windowsize option: %d\n", windowsize);
+					}
 				}
 
-				pkt_mknum(tx, DATA);
-				pkt_mknum(tx + 2, block);
-				len = read(fd, tx + 4, blksize);
-				if (len < 0) {
-					xperror("read");
-					ret = len;
-					goto cleanup;
-				} else if (!len) {
-					if (last_len != blksize && last_len != -1) {
-						break;
+				if ((val = pkt_optval(rx, "rollover"))) {
+					if (strcmp(val, "0") && strcmp(val, "1")) {
+						fprintf(stderr, "Error: invalid rollover in OACK: %s\n", val);
+						ret = -1;
+						goto cleanup;
+					}
+
+					rollover = *val - '0';
+
+					if (verbosity) {
+						printf("Remote accepted rollover option: %d\n", rollover);
 					}
 				}
 
-				last_len = len;
-				bytes += len;
+				if ((val = pkt_optval(rx, "tsize")) && verbosity) {
+					printf("Remote accepted tsize option: %s b\n", val);
+				}
 			}
+		}
 
-			ret = tftp_sendto(sock, tx, len, &addr, args);
-			if (ret < 0) {
-				goto cleanup;
+		if (ackblock != -1 && (status = ack_to_block(ackblock, acked, sent, rollover, &n)) > 0) {
+			if (!negotiated) {
+				negotiated = true;
+				progress = millis();
+				if (wrqs == 1) {
+					rto_update(&rto, micros() - sent_at[0]);
+					stats_rtt(stats, micros() - sent_at[0]);
+				}
+			} else if (n > acked) {
+				if (n > resent) {
+					rto_update(&rto, micros() - sent_at[n % windowsize]);
+					stats_rtt(stats, micros() - sent_at[n % windowsize]);
+				}
+
+				if (!acked) {
+					blksize_cache_put(args->hwaddr, blksize, opts);
+				}
+
+				progress = millis();
+				acked = n;
+				resent = MAX(resent, sent);
+				// if the remote didn't acknowledge the whole window, it
+				// missed a block, so we resume after the last one it got.
+				sent = n;
+			} else {
+				++stats->tftp.dup_acks;
 			}
-		} else if ((op != OACK && op != ACK) || ackblock > block) {
+		} else if (!timeouts && ((op != OACK && op != ACK) || (ackblock != -1 && status < 0))) {
 			if (verbosity) {
-				fprintf(stderr, "Expected ACK(%d), got ", block);
+				fprintf(stderr, "Expected ACK(%d), got ", block_to_wire(sent, rollover));
 				pkt_print(rx, stderr);
 				fprintf(stderr, ".\n");
 			}
@@ -537,27 +1792,127 @@ ssize_t tftp_put(struct nmrpd_args *args)
 			}
 		}
 
-		ret = tftp_recvfrom(sock, rx, &port, rx_timeout, blksize + 4);
+		if (!negotiated) {
+			if (timeouts) {
+				++wrqs;
+				++stats->tftp.wrqs;
+				sent_at[0] = micros();
+				ret = tftp_sendto(sock, tx, NULL, 0, &addr, args);
+				if (ret < 0) {
+					goto cleanup;
+				}
+			}
+		} else {
+			if (last && acked == last) {
+				break;
+			}
+
+			if (timeouts) {
+				// resend everything after the last acknowledged block
+				resent = MAX(resent, sent);
+				sent = acked;
+			}
+
+			while (sent < acked + windowsize && (!last || sent < last)) {
+				++sent;
+
+				if (sent > avail) {
+					if (sent > 0xffff && rollover < 0 && !wrapped) {
+						printf("Warning: TFTP block rollover. Upload might fail!\n");
+						wrapped = true;
+					}
+				}
+
+				if (img) {
+					pkt = tx;
+					data = img->data + (sent - 1) * blksize;
+					len = MIN(blksize, img->size - (sent - 1) * blksize);
+				} else {
+					pkt = win + (sent % windowsize) * (blksize + 4);
+					data = NULL;
+
+					if (sent > avail) {
+						// with a partial window in flight, the remote won't
+						// ACK anything, so there's no point in not waiting.
+						len = readahead_read(ra, pkt + 4, blksize);
+						if (len == -2) {
+							--sent;
+							break;
+						}
+						lens[sent % windowsize] = len;
+					}
+
+					len = lens[sent % windowsize];
+				}
+
+				if (sent > avail) {
+					if (len < 0) {
+						xperror("read");
+						ret = len;
+						goto cleanup;
+					} else if (len < blksize) {
+						last = sent;
+					}
+
+					avail = sent;
+					bytes += len;
+					++stats->tftp.blocks;
+					progress_update(prog, bytes);
+
+					if (args->cb && args->cb->progress) {
+						args->cb->progress(args->cb->arg, bytes, fsize > 0 ? fsize : 0);
+					}
+				} else {
+					++stats->tftp.resends;
+				}
+
+				pkt_mknum(pkt, DATA);
+				pkt_mknum(pkt + 2, block_to_wire(sent, rollover));
+
+				sent_at[sent % windowsize] = micros();
+				ret = tftp_queue(sock, pkt, data, len, &addr, args);
+				if (ret < 0) {
+					goto cleanup;
+				}
+			}
 
-		// stop calling nmrp_discard() if the last call didn't actually discard anything.
-		// this turned out to be a major bottleneck on Windows, each call blocking > 10ms
-		if (discard && args->sock) {
-			discard &= nmrp_discard(args->sock);
+			ret = tftp_flush(sock, &addr, args);
+			if (ret < 0) {
+				goto cleanup;
+			}
 		}
 
+#ifndef NMRPFLASH_FUZZ
+		ret = tftp_recvfrom(sock, rx, &port, rto.timeout, sizeof(rx), args);
+#else
+		// fuzzer inputs have one packet per blksize + 4 bytes
+		ret = tftp_recvfrom(sock, rx, &port, rto.timeout, MIN(blksize + 4, sizeof(rx)), args);
+#endif
 		if (ret < 0) {
+			if (ret == -3 && !negotiated && tftp_opts_refused(&opts, &reqsize)) {
+				goto restart;
+			}
 			goto cleanup;
 		} else if (!ret) {
-			if (++timeouts < max_timeouts || (!block && timeouts < (max_timeouts * 4))) {
+			++timeouts;
+			++stats->tftp.timeouts;
+
+			if ((millis() - progress) < (rx_timeout * max_timeouts * (negotiated ? 1 : 4))) {
+				rto_backoff(&rto);
 				continue;
 			} else if (args->blind_timeout) {
 				timeouts = 0;
+				progress = millis();
 				// fake an ACK packet
 				pkt_mknum(rx, ACK);
-				pkt_mknum(rx + 2, block);
+				pkt_mknum(rx + 2, block_to_wire(sent, rollover));
 				continue;
-			} else if (block) {
-				fprintf(stderr, "Timeout while waiting for ACK(%d).\n", block);
+			} else if (negotiated && !acked && (img || !avail)
+					&& tftp_opts_timeout(&opts, &reqsize, blksize, windowsize)) {
+				// blocks that were already read from stdin can't be split
+				goto restart;
+			} else if (negotiated) {
+				fprintf(stderr, "Timeout while waiting for ACK(%d).\n", block_to_wire(sent, rollover));
 			} else {
 				fprintf(stderr, "Timeout while waiting for ACK(0)/OACK.\n");
 				args->hints |= NMRP_TFTP_XMIT_BLK0_FAILURE;
@@ -568,7 +1923,7 @@ ssize_t tftp_put(struct nmrpd_args *args)
 			timeouts = 0;
 			ret = 0;
 
-			if (!block && port != args->port) {
+			if (!negotiated && port != args->port) {
 				if (verbosity > 1) {
 					printf("Switching to port %d\n", port);
 				}
@@ -577,25 +1932,53 @@ ssize_t tftp_put(struct nmrpd_args *args)
 		}
 	}
 
-	ret = !g_interrupted ? 0 : -1;
+	ret = !nmrp_interrupted() ? 0 : -1;
 
 cleanup:
+	progress_stop(prog);
+
+	if (begin) {
+		stats->tftp.blksize = blksize;
+		stats->tftp.windowsize = windowsize;
+		stats->tftp.duration += micros() - begin;
+		if (!ret) {
+			stats->tftp.bytes = bytes;
+		}
+	}
+
+	readahead_close(ra);
+	free(win);
+
+	if (img != args->image) {
+		image_close(img);
+	}
+
 	if (fd >= 0) {
 		close(fd);
 	}
 
 	if (sock >= 0) {
-#ifndef NMRPFLASH_WINDOWS
-		shutdown(sock, SHUT_RDWR);
-		close(sock);
-#else
-		shutdown(sock, SD_BOTH);
-		closesocket(sock);
-#endif
+		tftp_close(sock, args);
 	}
 
+#ifdef NMRPFLASH_WIN_OVERLAPPED
+	if (ovl.ov.hEvent != WSA_INVALID_EVENT) {
+		WSACloseEvent(ovl.ov.hEvent);
+	}
+	args->tftp_ovl = NULL;
+#endif
+#ifdef TFTP_MMSG
+	args->tftp_mmsg = NULL;
+#endif
+#ifndef NMRPFLASH_FUZZ
+	udp_close(args->tftp_udp);
+	args->tftp_udp = NULL;
+#endif
+
 #ifdef NMRPFLASH_WINDOWS
-	del_tftp_firewall_rule(&addr);
+	if (!args->raw_tftp) {
+		del_tftp_firewall_rule(&addr);
+	}
 #endif
 
 	return (ret == 0) ? bytes : ret;
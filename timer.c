@@ -0,0 +1,204 @@
+/**
+ * nmrpflash - Netgear Unbrick Utility
+ * Copyright (C) 2016 Joseph Lehner <joseph.c.lehner@gmail.com>
+ *
+ * nmrpflash is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * nmrpflash is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with nmrpflash.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <string.h>
+#include "nmrpd.h"
+
+// a timer on level L is in the slot of the 64^L ms interval it expires
+// in. when the wheel's time reaches the start of an interval, its timers
+// are moved to a lower level, or to the due list. only occupied slots are
+// ever visited, so a timer costs at most TIMER_LEVELS moves, no matter how
+// long the wheel sleeps in between.
+
+#define LEVEL_SHIFT(level) ((level) * TIMER_SLOT_BITS)
+#define SLOT_MASK          (TIMER_SLOTS - 1)
+#define DUE                TIMER_LEVELS
+
+static void timer_link(struct timer_wheel *w, struct timer *t, unsigned level, unsigned slot)
+{
+	struct timer **head = level == DUE ? &w->due : &w->slots[level][slot];
+
+	t->level = level;
+	t->slot = slot;
+	t->next = *head;
+	t->pprev = head;
+
+	if (*head) {
+		(*head)->pprev = &t->next;
+	}
+
+	*head = t;
+
+	if (level != DUE) {
+		w->used[level] |= 1ULL << slot;
+	}
+}
+
+static void timer_place(struct timer_wheel *w, struct timer *t)
+{
+	long long delta = t->expires - w->now;
+	long long when = t->expires;
+	unsigned level;
+
+	if (delta <= 0) {
+		timer_link(w, t, DUE, 0);
+		return;
+	}
+
+	for (level = 0; level < TIMER_LEVELS - 1; ++level) {
+		if (delta < (1LL << LEVEL_SHIFT(level + 1))) {
+			break;
+		}
+	}
+
+	if (delta >= (1LL << LEVEL_SHIFT(TIMER_LEVELS))) {
+		// cascaded again once we get there
+		when = w->now + (1LL << LEVEL_SHIFT(TIMER_LEVELS)) - 1;
+	}
+
+	timer_link(w, t, level, (when >> LEVEL_SHIFT(level)) & SLOT_MASK);
+}
+
+// start of the next occupied interval on this level, after w->now, or -1
+static long long timer_level_next(struct timer_wheel *w, unsigned level)
+{
+	uint64_t used = w->used[level];
+	long long base = w->now >> LEVEL_SHIFT(level);
+	unsigned cur = base & SLOT_MASK;
+	uint64_t ahead;
+	unsigned slot;
+
+	if (!used) {
+		return -1;
+	}
+
+	base &= ~(long long)SLOT_MASK;
+	ahead = cur == SLOT_MASK ? 0 : used & (~0ULL << (cur + 1));
+
+	if (ahead) {
+		slot = __builtin_ctzll(ahead);
+	} else {
+		slot = __builtin_ctzll(used);
+		base += TIMER_SLOTS;
+	}
+
+	return (base + slot) << LEVEL_SHIFT(level);
+}
+
+static long long timer_wheel_first(struct timer_wheel *w)
+{
+	long long next, first = -1;
+	unsigned level;
+
+	for (level = 0; level < TIMER_LEVELS; ++level) {
+		next = timer_level_next(w, level);
+		if (next >= 0 && (first < 0 || next < first)) {
+			first = next;
+		}
+	}
+
+	return first;
+}
+
+void timer_wheel_init(struct timer_wheel *w, long long now)
+{
+	memset(w, 0, sizeof(*w));
+	w->now = now;
+}
+
+void timer_set(struct timer_wheel *w, struct timer *t, long long expires)
+{
+	timer_cancel(w, t);
+	t->expires = expires;
+	timer_place(w, t);
+}
+
+void timer_cancel(struct timer_wheel *w, struct timer *t)
+{
+	if (!t->pprev) {
+		return;
+	}
+
+	*t->pprev = t->next;
+	if (t->next) {
+		t->next->pprev = t->pprev;
+	}
+
+	if (t->level != DUE && !w->slots[t->level][t->slot]) {
+		w->used[t->level] &= ~(1ULL << t->slot);
+	}
+
+	t->next = NULL;
+	t->pprev = NULL;
+}
+
+long long timer_wheel_next(struct timer_wheel *w, long long now)
+{
+	long long first;
+
+	if (w->due) {
+		return 0;
+	}
+
+	first = timer_wheel_first(w);
+	if (first < 0) {
+		return -1;
+	}
+
+	return MAX(first - now, 0);
+}
+
+struct timer *timer_wheel_expire(struct timer_wheel *w, long long now)
+{
+	struct timer *t, *list;
+	long long first;
+	unsigned slot;
+	int level;
+
+	while (!w->due) {
+		first = timer_wheel_first(w);
+		if (first < 0 || first > now) {
+			w->now = MAX(w->now, now);
+			return NULL;
+		}
+
+		w->now = first;
+
+		// from the top, so that cascaded timers are seen by the levels below
+		for (level = TIMER_LEVELS - 1; level >= 0; --level) {
+			if (first & ((1LL << LEVEL_SHIFT(level)) - 1)) {
+				continue;
+			}
+
+			slot = (first >> LEVEL_SHIFT(level)) & SLOT_MASK;
+			list = w->slots[level][slot];
+			w->slots[level][slot] = NULL;
+			w->used[level] &= ~(1ULL << slot);
+
+			while ((t = list)) {
+				list = t->next;
+				timer_place(w, t);
+			}
+		}
+	}
+
+	t = w->due;
+	timer_cancel(w, t);
+	return t;
+}
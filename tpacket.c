@@ -0,0 +1,354 @@
+/**
+ * nmrpflash - Netgear Unbrick Utility
+ * Copyright (C) 2016 Joseph Lehner <joseph.c.lehner@gmail.com>
+ *
+ * nmrpflash is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * nmrpflash is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with nmrpflash.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "nmrpd.h"
+
+#ifdef NMRPFLASH_TPACKET
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <linux/if_packet.h>
+#include <linux/if_ether.h>
+#include <linux/filter.h>
+#include <net/if_arp.h>
+#include <net/if.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <errno.h>
+#include <poll.h>
+
+// NMRP traffic is sparse, so a few small blocks are plenty
+#define TPACKET_BLOCK_SIZE (1 << 16)
+#define TPACKET_BLOCK_NR 4
+#define TPACKET_FRAME_SIZE 2048
+// retire partially filled blocks after 1 ms, like pcap's immediate mode
+#define TPACKET_RETIRE_TOV 1
+
+struct tpacket
+{
+	int fd;
+	uint8_t *ring;
+	size_t len;
+	unsigned block_nr;
+	// block we're currently reading from
+	unsigned block;
+	// packets left in the current block, if started
+	unsigned left;
+	bool started;
+	struct tpacket3_hdr *pkt;
+	// for tpacket_add_ipv4
+	uint16_t protocol;
+	uint8_t hwaddr[6];
+	unsigned snaplen;
+	bool vlan;
+	int ifindex;
+};
+
+static inline struct tpacket_block_desc *tpacket_block(struct tpacket *tp)
+{
+	return (struct tpacket_block_desc*)(tp->ring + tp->block * TPACKET_BLOCK_SIZE);
+}
+
+static bool tpacket_is_ether(int fd, const char *intf)
+{
+	struct ifreq ifr;
+
+	memset(&ifr, 0, sizeof(ifr));
+	strncpy(ifr.ifr_name, intf, sizeof(ifr.ifr_name) - 1);
+
+	if (ioctl(fd, SIOCGIFHWADDR, &ifr) < 0) {
+		xperror("ioctl(SIOCGIFHWADDR)");
+		return false;
+	}
+
+	return ifr.ifr_hwaddr.sa_family == ARPHRD_ETHER;
+}
+
+// equivalent to "ether proto <protocol> and not ether src <hwaddr>", or
+// with `ipv4`, "(ether proto <protocol> or ip or arp) and ...". with
+// `vlan`, only tagged frames are accepted; the kernel has already moved
+// the tag out of the frame at this point, so the offsets are the same.
+static int tpacket_set_filter(int fd, uint16_t protocol, const uint8_t *hwaddr,
+		unsigned snaplen, bool vlan, bool ipv4)
+{
+	uint32_t hw_hi = (hwaddr[0] << 24) | (hwaddr[1] << 16) | (hwaddr[2] << 8) | hwaddr[3];
+	uint32_t hw_lo = (hwaddr[4] << 8) | hwaddr[5];
+
+	// without `ipv4`, the two extra comparisons are repeats of the first
+	struct sock_filter insns[] = {
+		BPF_STMT(BPF_LD | BPF_B | BPF_ABS, SKF_AD_OFF + SKF_AD_VLAN_TAG_PRESENT),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 9, 0),
+		BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 12),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, protocol, 2, 0),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ipv4 ? ETH_P_IP : protocol, 1, 0),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ipv4 ? ETH_P_ARP : protocol, 0, 5),
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 6),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, hw_hi, 0, 2),
+		BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 10),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, hw_lo, 1, 0),
+		BPF_STMT(BPF_RET | BPF_K, snaplen),
+		BPF_STMT(BPF_RET | BPF_K, 0),
+	};
+
+	struct sock_fprog prog = {
+		.len = sizeof(insns) / sizeof(insns[0]) - (vlan ? 0 : 2),
+		.filter = vlan ? insns : insns + 2,
+	};
+
+	if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) < 0) {
+		xperror("setsockopt(SO_ATTACH_FILTER)");
+		return -1;
+	}
+
+	return 0;
+}
+
+struct tpacket *tpacket_open(const char *intf, uint16_t protocol,
+		const uint8_t *hwaddr, unsigned snaplen, unsigned bufsize, bool vlan)
+{
+	struct tpacket_req3 req;
+	struct packet_mreq mreq;
+	struct sockaddr_ll sll;
+	struct tpacket *tp;
+	int val;
+
+	tp = calloc(1, sizeof(*tp));
+	if (!tp) {
+		xperror("calloc");
+		return NULL;
+	}
+
+	tp->ring = MAP_FAILED;
+
+	// protocol 0 doesn't receive anything until we bind() below, so no
+	// unfiltered packets can end up in the ring.
+	tp->fd = socket(AF_PACKET, SOCK_RAW, 0);
+	if (tp->fd < 0) {
+		xperror("socket(AF_PACKET)");
+		goto err;
+	}
+
+	if (!tpacket_is_ether(tp->fd, intf)) {
+		goto err;
+	}
+
+	if (tpacket_set_filter(tp->fd, protocol, hwaddr, snaplen, vlan, false) != 0) {
+		goto err;
+	}
+
+	tp->protocol = protocol;
+	memcpy(tp->hwaddr, hwaddr, 6);
+	tp->snaplen = snaplen;
+	tp->vlan = vlan;
+
+	val = TPACKET_V3;
+	if (setsockopt(tp->fd, SOL_PACKET, PACKET_VERSION, &val, sizeof(val)) < 0) {
+		xperror("setsockopt(PACKET_VERSION)");
+		goto err;
+	}
+
+#ifdef PACKET_IGNORE_OUTGOING
+	// not fatal; the filter takes care of our own packets anyway
+	val = 1;
+	setsockopt(tp->fd, SOL_PACKET, PACKET_IGNORE_OUTGOING, &val, sizeof(val));
+#endif
+
+	tp->block_nr = MAX(bufsize / TPACKET_BLOCK_SIZE, TPACKET_BLOCK_NR);
+
+	memset(&req, 0, sizeof(req));
+	req.tp_block_size = TPACKET_BLOCK_SIZE;
+	req.tp_block_nr = tp->block_nr;
+	req.tp_frame_size = TPACKET_FRAME_SIZE;
+	req.tp_frame_nr = (TPACKET_BLOCK_SIZE / TPACKET_FRAME_SIZE) * tp->block_nr;
+	req.tp_retire_blk_tov = TPACKET_RETIRE_TOV;
+
+	if (setsockopt(tp->fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) < 0) {
+		xperror("setsockopt(PACKET_RX_RING)");
+		goto err;
+	}
+
+	tp->len = (size_t)TPACKET_BLOCK_SIZE * tp->block_nr;
+	tp->ring = mmap(NULL, tp->len, PROT_READ | PROT_WRITE, MAP_SHARED, tp->fd, 0);
+	if (tp->ring == MAP_FAILED) {
+		xperror("mmap");
+		goto err;
+	}
+
+	memset(&sll, 0, sizeof(sll));
+	sll.sll_family = AF_PACKET;
+	// tagged frames must be received before they're handed to the VLAN
+	// interface, as that strips the tag.
+	sll.sll_protocol = htons(vlan ? ETH_P_ALL : protocol);
+	sll.sll_ifindex = if_nametoindex(intf);
+
+	if (!sll.sll_ifindex) {
+		xperror("if_nametoindex");
+		goto err;
+	}
+
+	if (bind(tp->fd, (struct sockaddr*)&sll, sizeof(sll)) < 0) {
+		xperror("bind");
+		goto err;
+	}
+
+	tp->ifindex = sll.sll_ifindex;
+
+	memset(&mreq, 0, sizeof(mreq));
+	mreq.mr_ifindex = sll.sll_ifindex;
+	mreq.mr_type = PACKET_MR_PROMISC;
+
+	if (setsockopt(tp->fd, SOL_PACKET, PACKET_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0) {
+		xperror("setsockopt(PACKET_ADD_MEMBERSHIP)");
+		goto err;
+	}
+
+	return tp;
+
+err:
+	tpacket_close(tp);
+	return NULL;
+}
+
+int tpacket_add_ipv4(struct tpacket *tp)
+{
+	struct sockaddr_ll sll;
+
+	// replaces the current filter
+	if (tpacket_set_filter(tp->fd, tp->protocol, tp->hwaddr, tp->snaplen,
+				tp->vlan, true) != 0) {
+		return -1;
+	} else if (tp->vlan) {
+		return 0;
+	}
+
+	// the socket is bound to `protocol`, so nothing else would ever reach
+	// the filter. rebinding only replaces the protocol hook.
+	memset(&sll, 0, sizeof(sll));
+	sll.sll_family = AF_PACKET;
+	sll.sll_protocol = htons(ETH_P_ALL);
+	sll.sll_ifindex = tp->ifindex;
+
+	if (bind(tp->fd, (struct sockaddr*)&sll, sizeof(sll)) < 0) {
+		xperror("bind");
+		return -1;
+	}
+
+	return 0;
+}
+
+int tpacket_fd(struct tpacket *tp)
+{
+	return tp->fd;
+}
+
+ssize_t tpacket_recv_ref(struct tpacket *tp, const uint8_t **buf, uint16_t *vid, int timeout)
+{
+	struct tpacket_block_desc *bd;
+	struct tpacket3_hdr *hdr;
+	struct pollfd pfd;
+	bool waited = false;
+	int status;
+
+	while (true) {
+		bd = tpacket_block(tp);
+
+		if (!(bd->hdr.bh1.block_status & TP_STATUS_USER)) {
+			if (waited) {
+				return 0;
+			}
+
+			pfd.fd = tp->fd;
+			pfd.events = POLLIN | POLLERR;
+			pfd.revents = 0;
+
+			status = poll(&pfd, 1, timeout);
+			if (status < 0) {
+				if (errno == EINTR) {
+					return 0;
+				}
+				xperror("poll");
+				return -1;
+			} else if (!status) {
+				return 0;
+			}
+
+			waited = true;
+			continue;
+		}
+
+		if (!tp->started) {
+			tp->started = true;
+			tp->left = bd->hdr.bh1.num_pkts;
+			tp->pkt = (struct tpacket3_hdr*)((uint8_t*)bd + bd->hdr.bh1.offset_to_first_pkt);
+		}
+
+		if (!tp->left) {
+			// the packet(s) we returned from this block are no longer
+			// needed, so it's safe to hand the block back to the kernel
+			__sync_synchronize();
+			bd->hdr.bh1.block_status = TP_STATUS_KERNEL;
+			__sync_synchronize();
+
+			tp->block = (tp->block + 1) % tp->block_nr;
+			tp->started = false;
+			continue;
+		}
+
+		hdr = tp->pkt;
+		tp->pkt = (struct tpacket3_hdr*)((uint8_t*)hdr + hdr->tp_next_offset);
+		--tp->left;
+
+		if (vid) {
+			*vid = (hdr->tp_status & TP_STATUS_VLAN_VALID) ? hdr->hv1.tp_vlan_tci & 0xfff : 0;
+		}
+
+		*buf = (uint8_t*)hdr + hdr->tp_mac;
+		return hdr->tp_snaplen;
+	}
+}
+
+int tpacket_send(struct tpacket *tp, const void *buf, size_t len)
+{
+	if (send(tp->fd, buf, len, 0) != len) {
+		xperror("send");
+		return -1;
+	}
+
+	return 0;
+}
+
+void tpacket_close(struct tpacket *tp)
+{
+	if (!tp) {
+		return;
+	}
+
+	if (tp->ring != MAP_FAILED) {
+		munmap(tp->ring, tp->len);
+	}
+
+	if (tp->fd >= 0) {
+		close(tp->fd);
+	}
+
+	free(tp);
+}
+#endif
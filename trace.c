@@ -0,0 +1,177 @@
+/**
+ * nmrpflash - Netgear Unbrick Utility
+ * Copyright (C) 2016 Joseph Lehner <joseph.c.lehner@gmail.com>
+ *
+ * nmrpflash is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * nmrpflash is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with nmrpflash.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include "nmrpd.h"
+
+// an event is only decoded by trace_dump, so recording one is just a few
+// stores. 16 bytes each.
+struct trace_event
+{
+	// since trace_open [us]
+	uint64_t time;
+	uint32_t len;
+	uint8_t kind;
+	uint8_t op;
+	uint16_t arg;
+};
+
+struct trace
+{
+	struct trace_event *events;
+	// the number of events is a power of 2
+	unsigned mask;
+	// total number of events recorded
+	unsigned long long count;
+	long long start;
+};
+
+// sessions may write to the same file
+static xmutex_t trace_lock = XMUTEX_INITIALIZER;
+
+static const char *nmrp_codes[] = {
+	[0x01] = "ADVERTISE",
+	[0x02] = "CONF_REQ",
+	[0x03] = "CONF_ACK",
+	[0x04] = "CLOSE_REQ",
+	[0x05] = "CLOSE_ACK",
+	[0x06] = "KEEP_ALIVE_REQ",
+	[0x07] = "KEEP_ALIVE_ACK",
+	[0x10] = "TFTP_UL_REQ",
+};
+
+static const char *tftp_opcodes[] = {
+	[1] = "RRQ", [2] = "WRQ", [3] = "DATA", [4] = "ACK", [5] = "ERR", [6] = "OACK",
+};
+
+struct trace *trace_open(unsigned count)
+{
+	struct trace *t;
+	unsigned n;
+
+	for (n = 1; n < count; n <<= 1)
+		;
+
+	t = malloc(sizeof(*t));
+	if (!t) {
+		xperror("malloc");
+		return NULL;
+	}
+
+	t->events = malloc(n * sizeof(*t->events));
+	if (!t->events) {
+		xperror("malloc");
+		free(t);
+		return NULL;
+	}
+
+	t->mask = n - 1;
+	t->count = 0;
+	t->start = micros();
+
+	return t;
+}
+
+void trace_add(struct trace *t, enum trace_kind kind, uint8_t op, uint16_t arg, size_t len)
+{
+	struct trace_event *ev;
+
+	if (!t) {
+		return;
+	}
+
+	ev = &t->events[t->count++ & t->mask];
+	ev->time = micros() - t->start;
+	ev->len = len;
+	ev->kind = kind;
+	ev->op = op;
+	ev->arg = arg;
+}
+
+static const char *trace_name(const char **names, size_t count, uint8_t op)
+{
+	return op < count && names[op] ? names[op] : NULL;
+}
+
+static void trace_print(FILE *fp, const struct trace_event *ev)
+{
+	const char *name;
+	bool tftp = ev->kind == TRACE_TFTP_RX || ev->kind == TRACE_TFTP_TX;
+
+	fprintf(fp, "%6llu.%06llu ", (unsigned long long)ev->time / 1000000,
+			(unsigned long long)ev->time % 1000000);
+
+	if (ev->kind == TRACE_TFTP_TIMEOUT) {
+		fprintf(fp, "   TFTP timeout (%u ms)\n", ev->arg);
+		return;
+	}
+
+	fprintf(fp, "%s %s ", (ev->kind == TRACE_NMRP_RX || ev->kind == TRACE_TFTP_RX)
+			? ">>" : "<<", tftp ? "TFTP" : "NMRP");
+
+	if (tftp) {
+		name = trace_name(tftp_opcodes, sizeof(tftp_opcodes) / sizeof(tftp_opcodes[0]), ev->op);
+	} else {
+		name = trace_name(nmrp_codes, sizeof(nmrp_codes) / sizeof(nmrp_codes[0]), ev->op);
+	}
+
+	if (name) {
+		fprintf(fp, "%s", name);
+	} else {
+		fprintf(fp, "0x%02x", ev->op);
+	}
+
+	if (tftp && (ev->op == 3 || ev->op == 4 || ev->op == 5)) {
+		fprintf(fp, "(%u)", ev->arg);
+	}
+
+	fprintf(fp, ", %u b\n", ev->len);
+}
+
+void trace_dump(struct trace *t, FILE *fp, const char *intf)
+{
+	unsigned long long i, first;
+
+	if (!t) {
+		return;
+	}
+
+	first = t->count > t->mask ? t->count - t->mask - 1 : 0;
+
+	xmutex_lock(&trace_lock);
+
+	fprintf(fp, "Trace of session on %s (%llu of %llu events):\n",
+			intf ? intf : "?", t->count - first, t->count);
+
+	for (i = first; i < t->count; ++i) {
+		trace_print(fp, &t->events[i & t->mask]);
+	}
+
+	fflush(fp);
+	xmutex_unlock(&trace_lock);
+}
+
+void trace_close(struct trace *t)
+{
+	if (t) {
+		free(t->events);
+		free(t);
+	}
+}
@@ -0,0 +1,296 @@
+/**
+ * nmrpflash - Netgear Unbrick Utility
+ * Copyright (C) 2016 Joseph Lehner <joseph.c.lehner@gmail.com>
+ *
+ * nmrpflash is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * nmrpflash is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with nmrpflash.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include "nmrpd.h"
+
+#define UDP_ETH_P_IP  0x0800
+#define UDP_ETH_P_ARP 0x0806
+// don't fragment, and the mask of the "more fragments" bit and the offset
+#define UDP_IP_DF     0x4000
+#define UDP_IP_FRAG   0x3fff
+#define UDP_IP_TTL    64
+// ethernet, IPv4 (without options) and UDP headers
+#define UDP_FRAME_OVERHEAD (14 + 20 + 8)
+
+struct arp_pkt
+{
+	uint16_t htype;
+	uint16_t ptype;
+	uint8_t hlen;
+	uint8_t plen;
+	uint16_t op;
+	uint8_t sha[6];
+	uint32_t spa;
+	uint8_t tha[6];
+	uint32_t tpa;
+} PACKED;
+
+struct udp
+{
+	struct ethsock *sock;
+	// all in network byte order
+	uint32_t ipaddr;
+	uint16_t port;
+	uint16_t id;
+	uint8_t hwaddr[6];
+	uint8_t peer_hwaddr[6];
+	// the ethsock's timeout, restored by udp_close
+	unsigned timeout;
+	uint8_t *frame;
+	size_t frame_len;
+};
+
+struct udp *udp_open(struct ethsock *sock, uint32_t ipaddr, const uint8_t *peer_hwaddr)
+{
+	struct udp *u;
+	uint8_t *hwaddr;
+
+	if (!(hwaddr = ethsock_get_hwaddr(sock))) {
+		return NULL;
+	}
+
+	u = calloc(1, sizeof(*u));
+	if (!u) {
+		xperror("calloc");
+		return NULL;
+	}
+
+	// large enough for any blksize
+	u->frame_len = UDP_FRAME_OVERHEAD + 0xffff;
+	u->frame = malloc(u->frame_len);
+	if (!u->frame) {
+		xperror("malloc");
+		free(u);
+		return NULL;
+	}
+
+	u->sock = sock;
+	u->ipaddr = ipaddr;
+	memcpy(u->hwaddr, hwaddr, 6);
+	memcpy(u->peer_hwaddr, peer_hwaddr, 6);
+	u->timeout = ethsock_get_timeout(sock);
+
+	// an ephemeral port, which is different for every call, just like a
+	// new socket's would be.
+	u->port = htons(49152 + ((micros() ^ (uintptr_t)u) % 16384));
+	u->id = micros() & 0xffff;
+
+	return u;
+}
+
+uint16_t udp_port(struct udp *u)
+{
+	return ntohs(u->port);
+}
+
+int udp_sendto(struct udp *u, const struct sockaddr_in *dst, const void *hdr,
+		size_t hlen, const void *data, size_t dlen)
+{
+	struct eth_hdr *eh = (struct eth_hdr*)u->frame;
+	struct ip_hdr *ip = (struct ip_hdr*)(eh + 1);
+	struct udp_hdr *udp = (struct udp_hdr*)(ip + 1);
+	uint8_t *p = (uint8_t*)(udp + 1);
+	size_t len = sizeof(*udp) + hlen + dlen;
+	uint32_t sum;
+
+	if (UDP_FRAME_OVERHEAD + hlen + dlen > u->frame_len) {
+		fprintf(stderr, "Error: %zu b datagram is too large.\n", hlen + dlen);
+		return -1;
+	}
+
+	memcpy(eh->ether_dhost, u->peer_hwaddr, 6);
+	memcpy(eh->ether_shost, u->hwaddr, 6);
+	eh->ether_type = htons(UDP_ETH_P_IP);
+
+	memset(ip, 0, sizeof(*ip));
+	ip->ver_ihl = 0x45;
+	ip->len = htons(sizeof(*ip) + len);
+	ip->id = htons(u->id++);
+	ip->frag = htons(UDP_IP_DF);
+	ip->ttl = UDP_IP_TTL;
+	ip->proto = IPPROTO_UDP;
+	ip->src = u->ipaddr;
+	ip->dst = dst->sin_addr.s_addr;
+	ip->sum = ip_checksum(ip, sizeof(*ip));
+
+	udp->sport = u->port;
+	udp->dport = dst->sin_port;
+	udp->len = htons(len);
+	udp->sum = 0;
+
+	memcpy(p, hdr, hlen);
+	if (dlen) {
+		memcpy(p + hlen, data, dlen);
+	}
+
+	// the pseudo header: addresses, protocol and UDP length
+	sum = ip_sum(0, &ip->src, 8);
+	sum += IPPROTO_UDP + len;
+	sum = ip_sum(sum, udp, len);
+	udp->sum = ip_sum_fold(sum);
+	if (!udp->sum) {
+		// zero means "no checksum"
+		udp->sum = 0xffff;
+	}
+
+	return ethsock_send(u->sock, u->frame, UDP_FRAME_OVERHEAD + hlen + dlen);
+}
+
+static void udp_arp(struct udp *u, const uint8_t *buf, size_t len)
+{
+	const struct arp_pkt *req = (const struct arp_pkt*)(buf + sizeof(struct eth_hdr));
+	struct {
+		struct eth_hdr eh;
+		struct arp_pkt arp;
+	} PACKED reply;
+
+	if (len < sizeof(reply) || ntohs(req->op) != 1 || req->tpa != u->ipaddr
+			|| ntohs(req->ptype) != UDP_ETH_P_IP || req->hlen != 6 || req->plen != 4) {
+		return;
+	}
+
+	memcpy(reply.eh.ether_dhost, req->sha, 6);
+	memcpy(reply.eh.ether_shost, u->hwaddr, 6);
+	reply.eh.ether_type = htons(UDP_ETH_P_ARP);
+
+	reply.arp = *req;
+	reply.arp.op = htons(2);
+	memcpy(reply.arp.sha, u->hwaddr, 6);
+	reply.arp.spa = u->ipaddr;
+	memcpy(reply.arp.tha, req->sha, 6);
+	reply.arp.tpa = req->spa;
+
+	if (verbosity > 1) {
+		char macbuf[MAC_STR_LEN];
+		printf("Answering ARP request from %s.\n", mac_to_str((uint8_t*)req->sha, macbuf));
+	}
+
+	ethsock_send(u->sock, &reply, sizeof(reply));
+}
+
+// returns the UDP payload's length, if the frame is a datagram for us
+static ssize_t udp_parse(struct udp *u, const uint8_t *buf, size_t len,
+		const uint8_t **payload, struct sockaddr_in *src)
+{
+	const struct ip_hdr *ip = (const struct ip_hdr*)(buf + sizeof(struct eth_hdr));
+	const struct udp_hdr *udp;
+	size_t ihl, ilen, ulen;
+
+	len -= sizeof(struct eth_hdr);
+
+	if (len < sizeof(*ip) || (ip->ver_ihl >> 4) != 4 || ip->proto != IPPROTO_UDP
+			|| ip->dst != u->ipaddr || (ntohs(ip->frag) & UDP_IP_FRAG)) {
+		return -1;
+	}
+
+	ihl = (ip->ver_ihl & 0xf) * 4;
+	ilen = ntohs(ip->len);
+	// the frame may be padded, or truncated to the snaplen
+	if (ihl < sizeof(*ip) || ilen < ihl + sizeof(*udp) || ihl + sizeof(*udp) > len) {
+		return -1;
+	}
+
+	// a valid header sums to zero, as does a valid datagram
+	if (ip_checksum(ip, ihl)) {
+		if (verbosity > 1) {
+			printf("Discarding IPv4 packet with bad header checksum.\n");
+		}
+		return -1;
+	}
+
+	udp = (const struct udp_hdr*)((const uint8_t*)ip + ihl);
+	ulen = ntohs(udp->len);
+	if (udp->dport != u->port || ulen < sizeof(*udp) || ulen > ilen - ihl) {
+		return -1;
+	}
+
+	// zero means "no checksum". a truncated datagram can't be checked.
+	if (udp->sum && ihl + ulen <= len) {
+		uint32_t sum = ip_sum(0, &ip->src, 8);
+		sum += IPPROTO_UDP + ulen;
+		if (ip_sum_fold(ip_sum(sum, udp, ulen))) {
+			if (verbosity > 1) {
+				printf("Discarding UDP datagram with bad checksum.\n");
+			}
+			return -1;
+		}
+	}
+
+	memset(src, 0, sizeof(*src));
+	src->sin_family = AF_INET;
+	src->sin_addr.s_addr = ip->src;
+	src->sin_port = udp->sport;
+
+	*payload = (const uint8_t*)(udp + 1);
+	return MIN(ulen, len - ihl) - sizeof(*udp);
+}
+
+ssize_t udp_recvfrom(struct udp *u, void *buf, size_t len, struct sockaddr_in *src,
+		unsigned timeout)
+{
+	const uint8_t *frame, *payload;
+	long long now, deadline;
+	ssize_t bytes;
+	uint16_t type;
+
+	now = millis();
+	deadline = now + timeout;
+
+	for (; now < deadline && !nmrp_interrupted(); now = millis()) {
+		if (ethsock_set_timeout(u->sock, deadline - now) != 0) {
+			return -1;
+		}
+
+		bytes = ethsock_recv_ref(u->sock, &frame);
+		if (bytes < 0) {
+			return -1;
+		} else if (bytes < (ssize_t)sizeof(struct eth_hdr)) {
+			continue;
+		}
+
+		type = ntohs(((const struct eth_hdr*)frame)->ether_type);
+		if (type == UDP_ETH_P_ARP) {
+			udp_arp(u, frame, bytes);
+		} else if (type == UDP_ETH_P_IP) {
+			bytes = udp_parse(u, frame, bytes, &payload, src);
+			if (bytes >= 0) {
+				bytes = MIN((size_t)bytes, len);
+				memcpy(buf, payload, bytes);
+				return bytes;
+			}
+		} else if (verbosity > 1) {
+			// usually late NMRP packets, see nmrp_discard
+			printf("Discarding frame of type 0x%04x.\n", type);
+		}
+	}
+
+	return 0;
+}
+
+void udp_close(struct udp *u)
+{
+	if (u) {
+		ethsock_set_timeout(u->sock, u->timeout);
+		free(u->frame);
+		free(u);
+	}
+}
@@ -17,6 +17,7 @@
  *
  */
 
+#include <stdlib.h>
 #include <stdio.h>
 #include <errno.h>
 #include <time.h>
@@ -28,18 +29,42 @@
 #endif
 
 volatile sig_atomic_t g_interrupted = 0;
+volatile sig_atomic_t g_interrupts = 0;
+__thread struct nmrp_cancel *g_cancel = NULL;
 int verbosity = 0;
 
-long long millis()
+#ifdef NMRPFLASH_MACOS
+static mach_timebase_info_data_t timebase;
+static pthread_once_t timebase_once = PTHREAD_ONCE_INIT;
+
+static void timebase_init(void)
 {
-#ifndef NMRPFLASH_WINDOWS
+	mach_timebase_info(&timebase);
+}
+#endif
+
+long long micros()
+{
+#if defined(NMRPFLASH_WINDOWS)
+	LARGE_INTEGER now, freq;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&now);
+	return (now.QuadPart / freq.QuadPart) * 1000000
+		+ ((now.QuadPart % freq.QuadPart) * 1000000) / freq.QuadPart;
+#elif defined(NMRPFLASH_MACOS)
+	// called from several threads
+	pthread_once(&timebase_once, &timebase_init);
+	return (mach_absolute_time() * timebase.numer / timebase.denom) / 1000;
+#else
 	struct timespec ts;
 	clock_gettime(CLOCK_MONOTONIC, &ts);
-	return ts.tv_sec * 1000 + ((ts.tv_nsec + 500000) / 1000000);
-#else
-	return GetTickCount();
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
 #endif
+}
 
+long long millis()
+{
+	return (micros() + 500) / 1000;
 }
 
 time_t time_monotonic()
@@ -47,17 +72,53 @@ time_t time_monotonic()
 	return millis() / 1000;
 }
 
-char *xlltostr(long long ll, int base)
+void rto_init(struct rto *rto, unsigned initial, unsigned min, unsigned max)
 {
-	static char buf[32];
-	snprintf(buf, sizeof(buf) - 1, (base == 16 ? "%llx" : (base == 8 ? "%llo" : "%lld")), ll);
+	rto->samples = 0;
+	rto->srtt = 0;
+	rto->rttvar = 0;
+	rto->min = min;
+	rto->max = MAX(min, max);
+	rto->timeout = MIN(MAX(initial, rto->min), rto->max);
+}
+
+void rto_update(struct rto *rto, long long rtt)
+{
+	long long delta, timeout;
+
+	if (rtt < 0) {
+		return;
+	}
+
+	// Jacobson/Karels, as in RFC 6298
+	if (!rto->samples++) {
+		rto->srtt = rtt;
+		rto->rttvar = rtt / 2;
+	} else {
+		delta = rto->srtt > rtt ? rto->srtt - rtt : rtt - rto->srtt;
+		rto->rttvar += (delta - rto->rttvar) / 4;
+		rto->srtt += (rtt - rto->srtt) / 8;
+	}
+
+	// microseconds to milliseconds, rounding up
+	timeout = (rto->srtt + MAX(4 * rto->rttvar, 1000) + 999) / 1000;
+	rto->timeout = MIN(MAX(timeout, rto->min), rto->max);
+}
+
+void rto_backoff(struct rto *rto)
+{
+	rto->timeout = MIN(rto->timeout * 2, rto->max);
+}
+
+char *xlltostr(long long ll, int base, char *buf)
+{
+	snprintf(buf, XLLTOSTR_LEN, (base == 16 ? "%llx" : (base == 8 ? "%llo" : "%lld")), ll);
 	return buf;
 }
 
-const char *mac_to_str(uint8_t *mac)
+const char *mac_to_str(uint8_t *mac, char *buf)
 {
-	static char buf[18];
-	snprintf(buf, sizeof(buf), "%02x:%02x:%02x:%02x:%02x:%02x",
+	snprintf(buf, MAC_STR_LEN, "%02x:%02x:%02x:%02x:%02x:%02x",
 			mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
 	return buf;
 }
@@ -76,6 +137,47 @@ uint32_t netmask(uint32_t count)
 	return htonl(count <= 32 ? 0xffffffff << (32 - count) : 0);
 }
 
+void subnet_addrs(uint32_t mask, unsigned index, char *ipaddr, char *ipaddr_intf)
+{
+	uint32_t step = ~ntohl(mask) + 1;
+	struct in_addr in;
+
+	in.s_addr = htonl(ntohl(inet_addr(NMRP_DEFAULT_IP_REMOTE)) + index * step);
+	inet_ntop(AF_INET, &in, ipaddr, INET_ADDRSTRLEN);
+	in.s_addr = htonl(ntohl(inet_addr(NMRP_DEFAULT_IP_LOCAL)) + index * step);
+	inet_ntop(AF_INET, &in, ipaddr_intf, INET_ADDRSTRLEN);
+}
+
+uint32_t ip_sum(uint32_t sum, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+	size_t i;
+
+	for (i = 0; i + 1 < len; i += 2) {
+		sum += (p[i] << 8) | p[i + 1];
+	}
+
+	if (len & 1) {
+		sum += p[len - 1] << 8;
+	}
+
+	return sum;
+}
+
+uint16_t ip_sum_fold(uint32_t sum)
+{
+	while (sum >> 16) {
+		sum = (sum & 0xffff) + (sum >> 16);
+	}
+
+	return htons(~sum & 0xffff);
+}
+
+uint16_t ip_checksum(const void *buf, size_t len)
+{
+	return ip_sum_fold(ip_sum(0, buf, len));
+}
+
 int select_fd(int fd, unsigned timeout)
 {
 	struct timeval tv;
@@ -96,6 +198,137 @@ int select_fd(int fd, unsigned timeout)
 	return status;
 }
 
+#ifndef NMRPFLASH_WINDOWS
+int xthread_create(xthread_t *thread, void *(*fn)(void *), void *arg)
+{
+	int err = pthread_create(thread, NULL, fn, arg);
+	if (err) {
+		errno = err;
+		xperror("pthread_create");
+		return -1;
+	}
+
+	return 0;
+}
+
+int xthread_join(xthread_t thread)
+{
+	return pthread_join(thread, NULL) ? -1 : 0;
+}
+
+void xthread_detach(xthread_t thread)
+{
+	pthread_detach(thread);
+}
+
+void xmutex_lock(xmutex_t *mutex)
+{
+	pthread_mutex_lock(mutex);
+}
+
+void xmutex_unlock(xmutex_t *mutex)
+{
+	pthread_mutex_unlock(mutex);
+}
+
+void xcond_wait(xcond_t *cond, xmutex_t *mutex)
+{
+	pthread_cond_wait(cond, mutex);
+}
+
+void xcond_timedwait(xcond_t *cond, xmutex_t *mutex, unsigned msec)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += msec / 1000;
+	ts.tv_nsec += (msec % 1000) * 1000000L;
+	if (ts.tv_nsec >= 1000000000L) {
+		++ts.tv_sec;
+		ts.tv_nsec -= 1000000000L;
+	}
+
+	pthread_cond_timedwait(cond, mutex, &ts);
+}
+
+void xcond_broadcast(xcond_t *cond)
+{
+	pthread_cond_broadcast(cond);
+}
+#else
+struct xthread_start
+{
+	void *(*fn)(void *);
+	void *arg;
+};
+
+static DWORD WINAPI xthread_start(LPVOID p)
+{
+	struct xthread_start start = *(struct xthread_start*)p;
+	free(p);
+	start.fn(start.arg);
+	return 0;
+}
+
+int xthread_create(xthread_t *thread, void *(*fn)(void *), void *arg)
+{
+	struct xthread_start *start = malloc(sizeof(*start));
+	if (!start) {
+		xperror("malloc");
+		return -1;
+	}
+
+	start->fn = fn;
+	start->arg = arg;
+
+	*thread = CreateThread(NULL, 0, xthread_start, start, 0, NULL);
+	if (!*thread) {
+		win_perror2("CreateThread", GetLastError());
+		free(start);
+		return -1;
+	}
+
+	return 0;
+}
+
+int xthread_join(xthread_t thread)
+{
+	DWORD ret = WaitForSingleObject(thread, INFINITE);
+	CloseHandle(thread);
+	return ret == WAIT_OBJECT_0 ? 0 : -1;
+}
+
+void xthread_detach(xthread_t thread)
+{
+	CloseHandle(thread);
+}
+
+void xmutex_lock(xmutex_t *mutex)
+{
+	AcquireSRWLockExclusive(mutex);
+}
+
+void xmutex_unlock(xmutex_t *mutex)
+{
+	ReleaseSRWLockExclusive(mutex);
+}
+
+void xcond_wait(xcond_t *cond, xmutex_t *mutex)
+{
+	SleepConditionVariableSRW(cond, mutex, INFINITE, 0);
+}
+
+void xcond_timedwait(xcond_t *cond, xmutex_t *mutex, unsigned msec)
+{
+	SleepConditionVariableSRW(cond, mutex, msec, 0);
+}
+
+void xcond_broadcast(xcond_t *cond)
+{
+	WakeAllConditionVariable(cond);
+}
+#endif
+
 void xperror(const char *msg)
 {
 	if (errno != EINTR) {